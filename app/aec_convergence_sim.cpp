@@ -0,0 +1,209 @@
+/******************************************************************************
+ * Copyright 2017-2018 Baidu Robotic Vision Authors. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *****************************************************************************/
+
+// Closed-loop simulation of AEC: the model-based AecController against the legacy
+// computeNewAecTableIndex heuristic, with the same loop as XpSensorMultithread.
+// A 752x480 textured scene with noise is rendered with a brightness proportional to
+// scene luminance x gain x exposure of the AEC table entry that is in effect, and a register
+// write takes effect frame_delay frames later.
+// Reported: the frames until the brightness stays within +/-10% of the target (-1 = never),
+// and the number of register writes.
+// Usage: aec_convergence_sim [frame_delay]
+#include <driver/helper/aec_controller.h>
+#include <driver/helper/basic_image_utils.h>
+#include <driver/xp_aec_table.h>
+#include <opencv2/core.hpp>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+using XPDRIVER::AecController;
+using XPDRIVER::BrightnessStats;
+
+namespace {
+
+constexpr int kRows = 480;
+constexpr int kCols = 752;
+constexpr float kTargetBrightness = 100.f;  // the target of both AEC
+constexpr float kConvergedRatio = 0.1f;     // +/-10% of the target
+constexpr int kMinConvergedFrames = 5;      // the brightness has to hold for at least this long
+
+enum class AecMode {
+  LEGACY,  // computeNewAecTableIndex every 5 frames, smoothed once settled
+  MODEL,   // AecController every frame
+};
+
+class SceneRenderer {
+ public:
+  SceneRenderer() : texture_(kRows * kCols), rng_(1), noise_(0.f, 2.f) {
+    // A smooth gradient and a checkerboard of 60 pixel cells, in [0.14, 1.2]
+    for (int i = 0; i < kRows; ++i) {
+      for (int j = 0; j < kCols; ++j) {
+        const float shade = 0.5f + 0.4f * std::sin(i * 0.05f) * std::cos(j * 0.03f);
+        texture_[i * kCols + j] = shade * (((i / 60 + j / 60) % 2) ? 1.3f : 0.7f);
+      }
+    }
+  }
+
+  void render(float luminance, int aec_index, cv::Mat* img) {
+    const float scale = luminance * gain_x_exp(aec_index);
+    for (int i = 0; i < kRows; ++i) {
+      uint8_t* row = img->ptr<uint8_t>(i);
+      for (int j = 0; j < kCols; ++j) {
+        const float v = texture_[i * kCols + j] * scale + noise_(rng_);
+        row[j] = static_cast<uint8_t>(std::min(std::max(v, 0.f), 255.f));
+      }
+    }
+  }
+
+  // The scene luminance that is exposed at the target brightness with aec_index
+  float luminance_for_index(int aec_index) {
+    cv::Mat img(kRows, kCols, CV_8UC1);
+    BrightnessStats stats;
+    float luminance = kTargetBrightness / gain_x_exp(aec_index);
+    for (int it = 0; it < 3; ++it) {
+      render(luminance, aec_index, &img);
+      XPDRIVER::computeBrightnessStats(img, &stats);
+      luminance *= kTargetBrightness / std::max(stats.adjusted_pixel_val, 1);
+    }
+    return luminance;
+  }
+
+  static float gain_x_exp(int aec_index) {
+    return AecController::gain_x_exp(
+        XPDRIVER::XP_SENSOR::get_aec_table(XPDRIVER::XP_SENSOR::AecCurve::DEFAULT), aec_index);
+  }
+
+ private:
+  std::vector<float> texture_;
+  std::mt19937 rng_;
+  std::normal_distribution<float> noise_;
+};
+
+struct SimResult {
+  int converged_frames;  // since the (last) scene change.  -1 if never converged
+  int final_index;
+  int write_num;
+};
+
+// The scene luminance steps from luminance0 to luminance1 at change_frame
+SimResult simulate(SceneRenderer* renderer,
+                   AecMode mode,
+                   float luminance0,
+                   float luminance1,
+                   int change_frame,
+                   int start_index,
+                   int frame_delay,
+                   int frame_num) {
+  cv::Mat img(kRows, kCols, CV_8UC1);
+  BrightnessStats stats;
+  // The AEC table entry in effect for each frame
+  std::vector<int> applied_index(frame_num + frame_delay, start_index);
+  int aec_index = start_index;
+  bool aec_settle = false;
+  AecController aec_controller;
+  aec_controller.reset(start_index);
+  SimResult result{-1, start_index, 0};
+  int last_out_frame = change_frame - 1;
+  for (int frame = 0; frame < frame_num; ++frame) {
+    const float luminance = frame < change_frame ? luminance0 : luminance1;
+    renderer->render(luminance, applied_index[frame], &img);
+    XPDRIVER::computeBrightnessStats(img, &stats);
+    if (frame >= change_frame &&
+        std::fabs(stats.adjusted_pixel_val / kTargetBrightness - 1.f) >= kConvergedRatio) {
+      last_out_frame = frame;
+    }
+
+    int new_aec_index = aec_index;
+    bool updated = false;
+    if (mode == AecMode::MODEL) {
+      updated = aec_controller.update(stats, &new_aec_index);
+    } else if (frame % 5 == 3 &&
+               XPDRIVER::computeNewAecTableIndex(stats, aec_settle, &new_aec_index)) {
+      updated = new_aec_index != aec_index;
+      aec_settle = aec_settle || !updated;
+    }
+    if (updated) {
+      aec_index = new_aec_index;
+      ++result.write_num;
+      std::fill(applied_index.begin() + frame + frame_delay, applied_index.end(), aec_index);
+    }
+  }
+  if (frame_num - 1 - last_out_frame >= kMinConvergedFrames) {
+    result.converged_frames = last_out_frame + 1 - change_frame;
+  }
+  result.final_index = aec_index;
+  return result;
+}
+
+void print_row(const char* name, const SimResult& legacy, const SimResult& model) {
+  printf("%-24s %8d %8d | %8d %8d   (final index %d / %d)\n", name,
+         legacy.converged_frames, legacy.write_num, model.converged_frames, model.write_num,
+         legacy.final_index, model.final_index);
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  const int frame_delay = argc > 1 ? atoi(argv[1]) : 2;
+  if (frame_delay < 1) {
+    fprintf(stderr, "Usage: %s [frame_delay >= 1]\n", argv[0]);
+    return -1;
+  }
+  SceneRenderer renderer;
+  printf("%dx%d frames, register writes take effect %d frames later\n", kCols, kRows,
+         frame_delay);
+  printf("%-24s %8s %8s | %8s %8s\n", "", "legacy", "writes", "model", "writes");
+
+  printf("cold start from index 100, 120 frames\n");
+  constexpr int kColdStartFrames = 120;
+  for (const int target_index : {8, 30, 60, 130, 160}) {
+    const float luminance = renderer.luminance_for_index(target_index);
+    char name[32];
+    snprintf(name, sizeof(name), "  scene needs index %d", target_index);
+    print_row(name,
+              simulate(&renderer, AecMode::LEGACY, luminance, luminance, 0, 100, frame_delay,
+                       kColdStartFrames),
+              simulate(&renderer, AecMode::MODEL, luminance, luminance, 0, 100, frame_delay,
+                       kColdStartFrames));
+  }
+
+  printf("sudden light change at frame 60 from a scene that needs index 70, 200 frames\n");
+  constexpr int kChangeFrame = 60;
+  constexpr int kChangeFrames = 200;
+  const float luminance = renderer.luminance_for_index(70);
+  for (const float factor : {8.f, 1.f / 8, 32.f, 1.f / 32}) {
+    char name[32];
+    snprintf(name, sizeof(name), "  luminance x %g", factor);
+    print_row(name,
+              simulate(&renderer, AecMode::LEGACY, luminance, luminance * factor, kChangeFrame,
+                       70, frame_delay, kChangeFrames),
+              simulate(&renderer, AecMode::MODEL, luminance, luminance * factor, kChangeFrame,
+                       70, frame_delay, kChangeFrames));
+  }
+
+  printf("model-based AEC (default config) vs the actual frame delay, cold start 30 -> 70\n");
+  for (int delay = 1; delay <= 4; ++delay) {
+    const SimResult result = simulate(&renderer, AecMode::MODEL, luminance, luminance, 0, 30,
+                                      delay, kColdStartFrames);
+    printf("  delay %d: %d frames, %d writes\n", delay, result.converged_frames,
+           result.write_num);
+  }
+  return 0;
+}
@@ -0,0 +1,138 @@
+/******************************************************************************
+ * Copyright 2017-2018 Baidu Robotic Vision Authors. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *****************************************************************************/
+
+// Simulation of ClockSync: the sensor clock (1 ms counter) against the host clock with a skew,
+// a transfer latency with jitter, and late outliers, e.g., USB / scheduling delays.
+// Reported: the skew estimate, the rejected outliers, the error of the mapped host time after
+// the warmup, the recovery from a clock jump, and the cost of add_sample.
+// Usage: clock_sync_sim [duration_s]
+#include <driver/helper/clock_sync.h>
+#include <algorithm>
+#include <chrono>
+#include <cinttypes>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+
+using XPDRIVER::ClockSync;
+
+namespace {
+
+constexpr double kFrameRateHz = 30;
+constexpr double kSkewPpm = 40;           // the host clock runs faster
+constexpr int64_t kOffsetNs = 123456789012;
+constexpr double kLatencyNs = 3e6;        // the mean transfer latency
+constexpr double kLatencyStdNs = 0.3e6;
+constexpr double kOutlierRatio = 0.05;
+constexpr double kOutlierMinNs = 5e6;     // outliers are 5 - 30 ms late
+constexpr double kOutlierRangeNs = 25e6;
+constexpr double kSettleS = 120;          // the errors are collected after this long
+constexpr int64_t kSensorClockUnitNs = 1000000;
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  const double duration_s = argc > 1 ? atof(argv[1]) : 7200;
+  if (duration_s <= kSettleS) {
+    fprintf(stderr, "Usage: %s [duration_s > %g]\n", argv[0], kSettleS);
+    return -1;
+  }
+  std::mt19937 rng(3);
+  std::normal_distribution<double> jitter(0, kLatencyStdNs);
+  std::uniform_real_distribution<double> uniform(0, 1);
+
+  ClockSync clock_sync;
+  const int frame_num = static_cast<int>(duration_s * kFrameRateHz);
+  int outlier_num = 0;
+  int error_num = 0;
+  double error_sum_ns = 0;
+  double error_sq_sum_ns = 0;
+  double max_abs_error_ns = 0;
+  int64_t max_inverse_error_ns = 0;
+  for (int i = 0; i < frame_num; ++i) {
+    const double true_sensor_ns = i * 1e9 / kFrameRateHz;
+    // The sensor clock counts in ms
+    const int64_t sensor_ns =
+        static_cast<int64_t>(true_sensor_ns / kSensorClockUnitNs) * kSensorClockUnitNs;
+    double latency_ns = kLatencyNs + jitter(rng);
+    if (uniform(rng) < kOutlierRatio) {
+      latency_ns += kOutlierMinNs + uniform(rng) * kOutlierRangeNs;
+      ++outlier_num;
+    }
+    const double true_host_ns = kOffsetNs + true_sensor_ns * (1 + kSkewPpm * 1e-6);
+    clock_sync.add_sample(sensor_ns, static_cast<int64_t>(true_host_ns + latency_ns));
+    if (true_sensor_ns < kSettleS * 1e9 || !clock_sync.is_synced()) {
+      continue;
+    }
+    // The mapping includes the mean latency
+    const int64_t host_ns = clock_sync.sensor_to_host_ns(sensor_ns);
+    const double error_ns =
+        host_ns - (kOffsetNs + sensor_ns * (1 + kSkewPpm * 1e-6) + kLatencyNs);
+    error_sum_ns += error_ns;
+    error_sq_sum_ns += error_ns * error_ns;
+    max_abs_error_ns = std::max(max_abs_error_ns, std::fabs(error_ns));
+    ++error_num;
+    max_inverse_error_ns = std::max(max_inverse_error_ns,
+        std::abs(clock_sync.host_to_sensor_ns(host_ns) - sensor_ns));
+  }
+  ClockSync::Stats stats = clock_sync.stats();
+  printf("%g s at %g Hz, skew %g ppm, latency %g ms + N(0, %g ms), %g%% outliers %g - %g ms "
+         "late (%d)\n", duration_s, kFrameRateHz, kSkewPpm, kLatencyNs / 1e6,
+         kLatencyStdNs / 1e6, kOutlierRatio * 100, kOutlierMinNs / 1e6,
+         (kOutlierMinNs + kOutlierRangeNs) / 1e6, outlier_num);
+  printf("accepted %d, rejected %d, resets %d, residual std %.1f us, skew %.2f ppm\n",
+         stats.accepted_num, stats.rejected_num, stats.reset_num, stats.residual_std_ns / 1e3,
+         stats.skew_ppm);
+  if (error_num > 0) {
+    const double mean_ns = error_sum_ns / error_num;
+    const double std_ns = std::sqrt(error_sq_sum_ns / error_num - mean_ns * mean_ns);
+    printf("after %g s: mapping error mean %.1f us, std %.1f us, max %.1f us, "
+           "host_to_sensor_ns round trip max error %" PRId64 " ns\n", kSettleS, mean_ns / 1e3,
+           std_ns / 1e3, max_abs_error_ns / 1e3, max_inverse_error_ns);
+  }
+
+  // The host clock jumps by 0.5 s
+  constexpr int64_t kJumpNs = 500000000;
+  constexpr int kJumpFrames = 200;
+  const int64_t frame_period_ns = static_cast<int64_t>(1e9 / kFrameRateHz);
+  const int64_t jump_start_ns = static_cast<int64_t>(duration_s * 1e9);
+  int64_t sensor_ns = 0;
+  int recovered_frame = -1;
+  for (int i = 0; i < kJumpFrames; ++i) {
+    sensor_ns = jump_start_ns + i * frame_period_ns;
+    const int64_t expected_host_ns = sensor_ns + kOffsetNs + kJumpNs;
+    clock_sync.add_sample(sensor_ns, expected_host_ns);
+    if (recovered_frame < 0 && clock_sync.is_synced() &&
+        std::abs(clock_sync.sensor_to_host_ns(sensor_ns) - expected_host_ns) < 1000000) {
+      recovered_frame = i;
+    }
+  }
+  stats = clock_sync.stats();
+  printf("after a %g s host clock jump: resets %d, mapped within 1 ms after %d frames\n",
+         kJumpNs / 1e9, stats.reset_num, recovered_frame);
+
+  constexpr int kTimingNum = 1000000;
+  const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  for (int i = 0; i < kTimingNum; ++i) {
+    sensor_ns += frame_period_ns;
+    clock_sync.add_sample(sensor_ns, sensor_ns + kOffsetNs + kJumpNs);
+  }
+  printf("add_sample %.1f ns\n", std::chrono::duration<double, std::nano>(
+      std::chrono::steady_clock::now() - start).count() / kTimingNum);
+  return 0;
+}
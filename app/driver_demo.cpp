@@ -18,6 +18,7 @@
 #endif
 #include <glog/logging.h>
 #include <driver/helper/shared_queue.h>
+#include <driver/helper/spsc_ring.h>
 #include <driver/helper/timer.h>
 #include <driver/xp_aec_table.h>
 #include <driver/XP_sensor_driver.h>
@@ -44,9 +45,14 @@ using std::vector;
 using XPDRIVER::XpSensorMultithread;
 using std::chrono::steady_clock;
 DEFINE_bool(auto_gain, false, "turn on auto gain");
+DEFINE_bool(auto_infrared_pwm, false, "control the infrared PWM automatically (XPIRL2 only)");
+DEFINE_string(aec_curve, "default",
+              "AEC table: default, constant_ratio, constant_delta, fine_low_end or low_gain");
 DEFINE_string(dev_id, "", "which dev to open. Empty enables auto mode");
 DEFINE_bool(headless, false, "Do not show windows");
 DEFINE_bool(imu_from_image, false, "Load imu from image. Helpful for USB2.0");
+DEFINE_string(imu_calib, "", "imu calibration file with a section of this device. "
+              "Set empty to use the raw imu");
 DEFINE_bool(save_image_bin, false, "Do not save image bin file");
 DEFINE_string(sensor_type, "XP", "XP or XP2 or XP3 or FACE or XPIRL or XPIRL2");
 DEFINE_bool(spacebar_mode, false, "only save img when press space bar");
@@ -55,6 +61,7 @@ DEFINE_int32(valid_radius, 360,
              "The radius in pixel to check the point coverage from the pinhole center. "
              "Suggested value: 360 for 120 deg FOV and 220 for 170 deg FOV.");
 DEFINE_bool(verbose, false, "whether or not log more info");
+DEFINE_string(wb_mode, "auto", "white balance mode: auto, auto_smooth, disabled or preset");
 
 #ifdef __ARM_NEON__
 DEFINE_int32(cpu_core, 4, "bind program to run on specific core[0 ~ 7],"
@@ -77,10 +84,11 @@ struct ImgForSave {
 struct StereoImage {
   cv::Mat l;
   cv::Mat r;
-  float ts_100us;
+  int64_t ts_100us;
 };
 
-XPDRIVER::shared_queue<XPDRIVER::ImuData> imu_data_queue;
+// Filled by the driver IMU thread only, and drained by thread_write_imu_data only
+XPDRIVER::spsc_ring<XPDRIVER::ImuData> imu_data_ring(4096);
 XPDRIVER::shared_queue<ImgForSave> imgs_for_saving_queue;
 XPDRIVER::shared_queue<ImgForSave> IR_imgs_for_saving_queue;
 XPDRIVER::shared_queue<StereoImage> stereo_image_queue;
@@ -127,12 +135,14 @@ bool create_directory(const std::string dir_name) {
 
 // Callback functions for XpSensorMultithread
 // [NOTE] These callback functions have to be light-weight as it *WILL* block XpSensorMultithread
-void image_data_callback(const cv::Mat& img_l, const cv::Mat& img_r, const float ts_100us) {
+void image_data_callback(const cv::Mat& img_l, const cv::Mat& img_r,
+                         const XPDRIVER::FrameMetadata& metadata) {
   if (run_flag) {
     StereoImage stereo_img;
     stereo_img.l = img_l;
     stereo_img.r = img_r;
-    stereo_img.ts_100us = ts_100us;
+    // Exact, unlike the float ts_100us of ImageDataCallback after ~28 min
+    stereo_img.ts_100us = metadata.ts.sensor_ns / 100000;
     stereo_image_queue.push_back(stereo_img);
   }
 }
@@ -142,14 +152,14 @@ void IR_data_callback(const cv::Mat& img_l, const cv::Mat& img_r, const float ts
     StereoImage IR_img;
     IR_img.l = img_l;
     IR_img.r = img_r;
-    IR_img.ts_100us = ts_100us;
+    IR_img.ts_100us = static_cast<int64_t>(ts_100us);
     IR_image_queue.push_back(IR_img);
   }
 }
 
 void imu_data_callback(const XPDRIVER::ImuData& imu_data) {
   if (run_flag) {
-    imu_data_queue.push_back(imu_data);
+    imu_data_ring.push_back(imu_data);
   }
 }
 
@@ -163,7 +173,7 @@ bool kill_all_shared_queues() {
   IR_imgs_for_saving_queue.kill();
   stereo_image_queue.kill();
   IR_image_queue.kill();
-  imu_data_queue.kill();
+  imu_data_ring.kill();
   return true;
 }
 
@@ -219,10 +229,10 @@ bool process_infrared_pwm(char keypressed) {
        && (keypressed == 'i' || keypressed == 'I')) {
     g_auto_infrared = !g_auto_infrared;
     std::cout << "set infrared mode:" << ((g_auto_infrared == true) ? "on" : "off") << std::endl;
-    // TODO(zhourenyi): add auto pwm function
     if (g_auto_infrared == false)
       g_xp_sensor_ptr->set_infrared_index(0);
     g_xp_sensor_ptr->set_auto_infrared(g_auto_infrared);
+    g_xp_sensor_ptr->set_auto_infrared_pwm(FLAGS_auto_infrared_pwm);
   }
   return true;
 }
@@ -231,7 +241,8 @@ bool process_gain_control(char keypressed) {
   if (g_xp_sensor_ptr == nullptr) {
     return false;
   }
-  using XPDRIVER::XP_SENSOR::kAEC_steps;
+  const int aec_steps =
+      XPDRIVER::XP_SENSOR::get_aec_table(g_xp_sensor_ptr->aec_curve()).steps;
   if (!g_auto_gain && keypressed != -1) {  // -1 means no key is pressed
     switch (keypressed) {
       case '1':
@@ -241,28 +252,28 @@ bool process_gain_control(char keypressed) {
         break;
       case '2':
         // 20% of max brightness
-        g_aec_index = kAEC_steps * 0.2;
+        g_aec_index = aec_steps * 0.2;
         g_xp_sensor_ptr->set_aec_index(g_aec_index);
         break;
       case '3':
         // 60% of max brightness
-        g_aec_index = kAEC_steps * 0.6;
+        g_aec_index = aec_steps * 0.6;
         g_xp_sensor_ptr->set_aec_index(g_aec_index);
         break;
       case '4':
         // max brightness
-        g_aec_index = kAEC_steps - 1;
+        g_aec_index = aec_steps - 1;
         g_xp_sensor_ptr->set_aec_index(g_aec_index);
         break;
       case '+':
       case '=':
         ++g_aec_index;
-        if (g_aec_index >= kAEC_steps) g_aec_index = kAEC_steps - 1;
+        if (g_aec_index >= aec_steps) g_aec_index = aec_steps - 1;
         g_xp_sensor_ptr->set_aec_index(g_aec_index);
         break;
       case ']':
         g_aec_index += 5;
-        if (g_aec_index >= kAEC_steps) g_aec_index = kAEC_steps - 1;
+        if (g_aec_index >= aec_steps) g_aec_index = aec_steps - 1;
         g_xp_sensor_ptr->set_aec_index(g_aec_index);
         break;
       case '-':
@@ -557,26 +568,31 @@ void thread_write_imu_data() {
       cout << "Fail to open " << FLAGS_record_path + "/imu_data.txt " << endl;
     }
   }
+  std::vector<XPDRIVER::ImuData> imu_data_vec;
   while (run_flag) {
-    XPDRIVER::ImuData imu_data;
-    if (!imu_data_queue.wait_and_pop_front(&imu_data)) {
+    if (!imu_data_ring.wait_and_pop_all(&imu_data_vec)) {
       break;
     }
     if (imu_fstream.is_open()) {
       const int temperature = 999;  // a fake value
-      // The imu timestamp is in 100us
-      // accel is in m/s^2
-      // angv is in rad/s
-      imu_fstream << imu_data.time_stamp << " "
-                  << imu_data.accel[0] << " "
-                  << imu_data.accel[1] << " "
-                  << imu_data.accel[2] << " "
-                  << imu_data.ang_v[0] << " "
-                  << imu_data.ang_v[1] << " "
-                  << imu_data.ang_v[2] << " "
-                  << temperature << endl;
+      for (const XPDRIVER::ImuData& imu_data : imu_data_vec) {
+        // The imu timestamp is in 100us
+        // accel is in m/s^2
+        // angv is in rad/s
+        imu_fstream << imu_data.ts.sensor_ns / 100000 << " "
+                    << imu_data.accel[0] << " "
+                    << imu_data.accel[1] << " "
+                    << imu_data.accel[2] << " "
+                    << imu_data.ang_v[0] << " "
+                    << imu_data.ang_v[1] << " "
+                    << imu_data.ang_v[2] << " "
+                    << temperature << endl;
+      }
     }
   }
+  if (imu_data_ring.dropped_num() > 0) {
+    LOG(WARNING) << "Dropped " << imu_data_ring.dropped_num() << " imu data as the ring is full";
+  }
   if (imu_fstream.is_open()) {
     imu_fstream.close();
   }
@@ -653,7 +669,21 @@ int main(int argc, char** argv) {
     g_xp_sensor_ptr.reset(new XpSensorMultithread(FLAGS_sensor_type,
                                                   g_auto_gain,
                                                   FLAGS_imu_from_image,
-                                                  FLAGS_dev_id));
+                                                  FLAGS_dev_id,
+                                                  FLAGS_wb_mode));
+    using XPDRIVER::XP_SENSOR::AecCurve;
+    if (FLAGS_aec_curve == "constant_ratio") {
+      g_xp_sensor_ptr->set_aec_curve(AecCurve::CONSTANT_RATIO);
+    } else if (FLAGS_aec_curve == "constant_delta") {
+      g_xp_sensor_ptr->set_aec_curve(AecCurve::CONSTANT_DELTA);
+    } else if (FLAGS_aec_curve == "fine_low_end") {
+      g_xp_sensor_ptr->set_aec_curve(AecCurve::FINE_LOW_END);
+    } else if (FLAGS_aec_curve == "low_gain") {
+      g_xp_sensor_ptr->set_aec_curve(AecCurve::LOW_GAIN);
+    } else if (FLAGS_aec_curve != "default") {
+      LOG(ERROR) << "Unsupported aec_curve: " << FLAGS_aec_curve;
+      return -1;
+    }
     if (g_xp_sensor_ptr->init(g_aec_index)) {
       VLOG(1) << "XpSensorMultithread init succeeeded!";
     } else {
@@ -672,6 +702,10 @@ int main(int argc, char** argv) {
       // a interface demo to call deviceID
       // LOG(ERROR) << "deviceID in driver_demo:" << *deviceID;
     }
+    if (!FLAGS_imu_calib.empty() && !g_xp_sensor_ptr->load_imu_calibration(FLAGS_imu_calib)) {
+      LOG(ERROR) << "Failed to load imu calibration from " << FLAGS_imu_calib;
+      return -1;
+    }
 
     g_img_size.width = width;
     g_img_size.height = height;
@@ -713,7 +747,7 @@ int main(int argc, char** argv) {
 
   // Register callback functions and let XpSensorMultithread spin
   CHECK(g_xp_sensor_ptr);
-  g_xp_sensor_ptr->set_image_data_callback(image_data_callback);
+  g_xp_sensor_ptr->set_image_metadata_callback(image_data_callback);
   if (g_has_IR) {
     g_xp_sensor_ptr->set_IR_data_callback(IR_data_callback);
   }
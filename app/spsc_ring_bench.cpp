@@ -0,0 +1,198 @@
+/******************************************************************************
+ * Copyright 2017-2018 Baidu Robotic Vision Authors. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *****************************************************************************/
+
+// Microbenchmark of spsc_ring against shared_queue for the IMU samples (ImuData), i.e., the
+// driver callback thread pushes and ONE consumer thread pops.
+// Usage: spsc_ring_bench [element_num]
+#include <driver/basic_datatype.h>
+#include <driver/helper/shared_queue.h>
+#include <driver/helper/spsc_ring.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <thread>
+#include <vector>
+
+using XPDRIVER::ImuData;
+using XPDRIVER::shared_queue;
+using XPDRIVER::spsc_ring;
+using std::chrono::steady_clock;
+
+namespace {
+
+constexpr int kRingCapacity = 4096;
+
+// Push to either queue.  A full ring is retried as the benchmark must not drop any element.
+void push(shared_queue<ImuData>* queue, const ImuData& elem) {
+  queue->push_back(elem);
+}
+void push(spsc_ring<ImuData>* ring, const ImuData& elem) {
+  while (!ring->push_back(elem)) {
+    std::this_thread::yield();
+  }
+}
+
+double elapsed_ns(const steady_clock::time_point& start) {
+  return std::chrono::duration<double, std::nano>(steady_clock::now() - start).count();
+}
+
+// A producer thread pushes num elements flat out while the consumer pops them one by one
+// (pop_all = false) or in batches (pop_all = true).  Return ns per element.
+// The consumer also checks the order of the elements.
+template <typename Queue, typename Batch>
+double bench_throughput(Queue* queue, const int num, const bool pop_all) {
+  int order_error_num = 0;
+  const steady_clock::time_point start = steady_clock::now();
+  std::thread consumer([queue, num, pop_all, &order_error_num]() {
+    int64_t expected = 0;
+    if (pop_all) {
+      Batch batch;
+      for (int n = 0; n < num; n += batch.size()) {
+        queue->wait_and_pop_all(&batch);
+        for (const ImuData& elem : batch) {
+          order_error_num += (elem.ts.sensor_ns != expected);
+          expected = elem.ts.sensor_ns + 1;
+        }
+      }
+    } else {
+      ImuData elem{};
+      for (int n = 0; n < num; ++n) {
+        queue->wait_and_pop_front(&elem);
+        order_error_num += (elem.ts.sensor_ns != expected);
+        expected = elem.ts.sensor_ns + 1;
+      }
+    }
+  });
+  ImuData elem{};
+  for (int i = 0; i < num; ++i) {
+    elem.ts.sensor_ns = i;
+    push(queue, elem);
+  }
+  consumer.join();
+  const double ns = elapsed_ns(start) / num;
+  if (order_error_num > 0) {
+    printf("  [ERROR] %d elements out of order\n", order_error_num);
+  }
+  return ns;
+}
+
+// The producer pushes one element every period_us, and the consumer sleeps in between.
+// Report the latency from the push to the wake-up of the consumer.
+template <typename Queue>
+void bench_wake_latency(Queue* queue, const char* name, const int num, const int period_us) {
+  std::vector<double> latency_us(num);
+  std::atomic<int64_t> push_ns(0);
+  std::thread consumer([queue, num, &latency_us, &push_ns]() {
+    ImuData elem;
+    for (int i = 0; i < num; ++i) {
+      queue->wait_and_pop_front(&elem);
+      const int64_t now_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+          steady_clock::now().time_since_epoch()).count();
+      latency_us[i] = (now_ns - push_ns.load()) / 1e3;
+    }
+  });
+  ImuData elem{};
+  for (int i = 0; i < num; ++i) {
+    std::this_thread::sleep_for(std::chrono::microseconds(period_us));
+    push_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        steady_clock::now().time_since_epoch()).count();
+    push(queue, elem);
+  }
+  consumer.join();
+  std::sort(latency_us.begin(), latency_us.end());
+  printf("  %-12s  p50 %6.1f us  p99 %6.1f us\n", name, latency_us[num / 2],
+         latency_us[num * 99 / 100]);
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  const int num = argc > 1 ? atoi(argv[1]) : 5000000;
+  if (num <= 0) {
+    fprintf(stderr, "Usage: %s [element_num]\n", argv[0]);
+    return -1;
+  }
+  printf("%d ImuData (%zu bytes), %u hardware threads\n", num, sizeof(ImuData),
+         std::thread::hardware_concurrency());
+
+  printf("producer / consumer, blocking pop of one element (ns / element)\n");
+  {
+    shared_queue<ImuData> queue;
+    printf("  %-12s  %6.1f\n", "shared_queue",
+           bench_throughput<shared_queue<ImuData>, std::deque<ImuData>>(&queue, num, false));
+    queue.kill();
+  }
+  {
+    spsc_ring<ImuData> ring(kRingCapacity);
+    printf("  %-12s  %6.1f\n", "spsc_ring",
+           bench_throughput<spsc_ring<ImuData>, std::vector<ImuData>>(&ring, num, false));
+  }
+
+  printf("producer / consumer, blocking pop of all the elements (ns / element)\n");
+  {
+    shared_queue<ImuData> queue;
+    printf("  %-12s  %6.1f\n", "shared_queue",
+           bench_throughput<shared_queue<ImuData>, std::deque<ImuData>>(&queue, num, true));
+    queue.kill();
+  }
+  {
+    spsc_ring<ImuData> ring(kRingCapacity);
+    printf("  %-12s  %6.1f\n", "spsc_ring",
+           bench_throughput<spsc_ring<ImuData>, std::vector<ImuData>>(&ring, num, true));
+  }
+
+  printf("one thread, push + pop (ns / element)\n");
+  {
+    shared_queue<ImuData> queue;
+    ImuData elem{};
+    const steady_clock::time_point start = steady_clock::now();
+    for (int i = 0; i < num; ++i) {
+      queue.push_back(elem);
+      queue.wait_and_pop_front(&elem);
+    }
+    printf("  %-12s  %6.1f\n", "shared_queue", elapsed_ns(start) / num);
+    queue.kill();
+  }
+  {
+    spsc_ring<ImuData> ring(kRingCapacity);
+    ImuData elem{};
+    const steady_clock::time_point start = steady_clock::now();
+    for (int i = 0; i < num; ++i) {
+      ring.push_back(elem);
+      ring.pop_front(&elem, 1);
+    }
+    printf("  %-12s  %6.1f\n", "spsc_ring", elapsed_ns(start) / num);
+  }
+
+  // 2000 elements at ~5 kHz, i.e., the consumer sleeps before every element
+  constexpr int kLatencyNum = 2000;
+  constexpr int kLatencyPeriodUs = 200;
+  printf("wake-up latency of a sleeping consumer\n");
+  {
+    shared_queue<ImuData> queue;
+    bench_wake_latency(&queue, "shared_queue", kLatencyNum, kLatencyPeriodUs);
+    queue.kill();
+  }
+  {
+    spsc_ring<ImuData> ring(kRingCapacity);
+    bench_wake_latency(&ring, "spsc_ring", kLatencyNum, kLatencyPeriodUs);
+  }
+  return 0;
+}
@@ -27,6 +27,7 @@
 
 #include <driver/helper/counter_32_to_64.h>
 #include <driver/basic_datatype.h>  // for XP_20608_data
+#include <driver/xp_aec_table.h>
 #include <opencv2/videoio.hpp>
 #include <string>
 #include <vector>
@@ -67,10 +68,40 @@ bool set_registers_to_default(int fd,
                               int aec_index,
                               bool verbose = false,
                               uint32_t* exp_ptr = nullptr,
-                              uint32_t* gain_ptr = nullptr);
-bool read_register(int fd, int16_t addr, int16_t* val);
+                              uint32_t* gain_ptr = nullptr,
+                              AecCurve aec_curve = AecCurve::DEFAULT);
+// [NOTE] The driver keeps a shadow copy of the registers of each device (fd) it has written
+// or read.  A write that doesn't change the shadowed value is skipped, and a read is served
+// from the shadow copy if the value is known and use_shadow is true.  Use use_shadow = false to
+// read the value back from the sensor, e.g., for verification.
+// Call reset_register_shadow whenever the device is (re)opened or reset.
+bool read_register(int fd, int16_t addr, int16_t* val, bool use_shadow = true);
 bool set_register(int fd, int16_t addr, int16_t val);
-bool set_aec_index(int fd, uint32_t aec_index, bool verbose = false);
+// Batched register access.  The registers are accessed in the given order, back to back, and
+// the batch is never interleaved with the register access from other threads.
+// [NOTE] The firmware only takes ONE register per CY_FX_UVC_XU_CAM_REG transfer, and
+// CY_FX_UVC_XU_REG_BURST is the (read only) IMU burst, so a batch of n registers is still n
+// transfers (n x (2 transfers + 1 ms) for reads).  Switch the implementation here once the
+// firmware supports multi-register transfers.
+struct RegisterValue {
+  int16_t addr;
+  int16_t val;
+};
+bool set_registers(int fd, const RegisterValue* regs, int num);
+bool read_registers(int fd, RegisterValue* regs, int num, bool use_shadow = true);
+
+// The numbers of register transfers issued to / elided by the shadow copy of a device
+struct RegisterTransferStats {
+  uint64_t issued_write_num = 0;
+  uint64_t elided_write_num = 0;
+  uint64_t issued_read_num = 0;
+  uint64_t elided_read_num = 0;
+};
+void reset_register_shadow(int fd);
+RegisterTransferStats get_register_transfer_stats(int fd);
+// aec_index is an index of the AEC table of aec_curve
+bool set_aec_index(int fd, uint32_t aec_index, bool verbose = false,
+                   AecCurve aec_curve = AecCurve::DEFAULT);
 bool set_exp_percentage(int fd, int16_t val, bool verbose = false);
 bool set_gain_percentage(int fd, int16_t val, bool verbose = false);
 bool xp_imu_embed_img(int fd, bool enable);
@@ -82,10 +113,10 @@ bool check_min_soft_version(const char* soft_ver);
 SensorType read_hard_version(int fd);
 void read_deviceID(int fd, char* device_id);
 
-// Deprecated function
-/*
+// Deprecated function.  Enable / disable the on-chip AE / AG (register 0xaf).
+// [NOTE] While AE / AG is enabled, the exposure (0x0B) / gain (0x35) registers bypass the
+// register shadow, i.e., the reads always go to the sensor and the writes are never skipped.
 int set_auto_exp_and_gain(int fd, bool ae, bool ag);
-*/
 struct tlc59116_ctl_t {
   uint8_t UpdateBit: 1;
   uint8_t dumpRegister: 1;
@@ -153,6 +184,13 @@ class ImuReader {
   bool get_imu_from_img(const uint8_t* data,
                         XP_20608_data* imu_data_ptr,
                         const bool use_100us = false);
+  // Decode num samples of the burst, sample_stride bytes apart, in one pass.  Bit-exact with
+  // get_imu_from_img (clock count in ms) on each sample, except that the first few garbage
+  // samples are left out.  Return the number of samples written to imu_data.
+  int get_imu_burst_from_img(const uint8_t* data,
+                             const int num,
+                             const int sample_stride,
+                             XP_20608_data* imu_data);
   int imu_rate() const;
   int imu_sample_count() const;
   uint64_t first_imu_clock_count() const;
@@ -160,6 +198,9 @@ class ImuReader {
  private:
   bool get_vec3f_from_sensor_data(const uint8_t* data, float* v);
   bool get_vec3f_from_img_data(const uint8_t* data, float* v);
+  // Update the sample count, first clock count and rate with num samples from the image,
+  // sample_stride bytes apart.  Return the number of leading garbage samples to skip
+  int count_img_samples(const uint8_t* data, const int num, const int sample_stride);
 
  private:
   const float accel_scale_ = XP_BOARD_ACCEL_SCALE;
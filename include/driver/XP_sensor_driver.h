@@ -25,11 +25,24 @@
  * 3. XP sensor driver only supports Linux for now.
  */
 #include <driver/basic_datatype.h>  // For ImuData & XP_20608_data
-#include <driver/helper/basic_image_utils.h>  // For computeNewAecTableIndex
+#include <driver/helper/aec_controller.h>
+#include <driver/helper/basic_image_utils.h>  // For computeNewAecTableIndex & BrightnessStats
+#include <driver/helper/clock_sync.h>
+#include <driver/helper/exposure_tracker.h>
+#include <driver/helper/image_buffer_pool.h>
+#include <driver/helper/imu_calibration.h>
+#include <driver/helper/imu_history.h>
+#include <driver/helper/imu_poll_scheduler.h>
+#include <driver/helper/imu_preintegrator.h>
+#include <driver/helper/infrared_controller.h>
 #include <driver/XP_sensor.h>
 #include <driver/v4l2.h>
 #include <driver/helper/shared_queue.h>  // For shared_queue
+#include <driver/helper/spsc_ring.h>
+#include <chrono>
 #include <functional>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <thread>
 #include <vector>
@@ -48,8 +61,39 @@ class XpSensorMultithread {
   };
   typedef std::function<void(const cv::Mat&, const cv::Mat&, const float)> ImageDataCallback;
   typedef std::function<void(const XPDRIVER::ImuData&)> ImuDataCallback;
+  // All the IMU samples of a frame (imu_from_image) or of a pull interval, in time order.
+  // The samples are only valid during the call.
+  typedef std::function<void(const XPDRIVER::ImuData*, const int)> ImuBatchDataCallback;
+  // ImageDataCallback with the exact timestamps and the gain / exposure that the images were
+  // actually exposed with
+  typedef std::function<void(const cv::Mat&, const cv::Mat&, const FrameMetadata&)>
+      ImageMetadataCallback;
+  // ImageMetadataCallback with the IMU samples since the previous frame, interpolated at the
+  // two frame timestamps.  The ImuInterval is invalid, i.e., default, if the IMU history
+  // doesn't reach back to the previous frame, e.g., for the first frames.
+  typedef std::function<void(const cv::Mat&, const cv::Mat&, const FrameMetadata&,
+                             const ImuInterval&)> ImageImuCallback;
+  // The stats of the sensor control (AEC / IR) commands applied by thread_sensor_control
+  struct SensorControlStats {
+    float avg_latency_ms = 0;   // from the command is posted to the register writes finish
+    float max_latency_ms = 0;
+    float avg_transfer_ms = 0;  // the time spent in the USB control transfers only
+    int applied_num = 0;        // the number of commands applied to the sensor
+    int coalesced_num = 0;      // the number of commands superseded before being applied
+  };
+  // How the 500 Hz IMU samples embedded in the images (imu_from_image) are delivered
+  enum class ImuOutputMode {
+    SUBSAMPLED = 0,  // every 5th sample (~100 Hz) without filtering, i.e., aliased
+    FULL_RATE = 1,   // every sample
+    DECIMATED = 2,   // low-pass filtered and decimated to the requested rate (ImuDecimator)
+  };
+  // The images are decoded into the buffers of ImageBufferPool, and the ownership is handed
+  // over to the callee.  The buffers go back to the pool once the callee releases the pointer.
+  typedef std::function<void(const ImageBufferPool::StereoImagePtr&, const float)>
+      PooledImageDataCallback;
 
   // Core functions
+  // wb_mode: "auto", "auto_smooth", "disabled" or "preset"
   XpSensorMultithread(const std::string& sensor_type_str,
                       const bool use_auto_gain,
                       const bool imu_from_image,
@@ -65,19 +109,78 @@ class XpSensorMultithread {
   // The AEC change will be applied to the sensor in thread_stream_images
   bool set_aec_index(const int aec_index);
   bool set_auto_gain(const bool use_aec);
+  // Select the AEC table (default: AecCurve::DEFAULT).  Call before init to set the table that
+  // the aec_index of init refers to.  A switch at runtime keeps the current brightness, i.e.,
+  // maps the current index to the closest gain x exposure of the new table.
+  bool set_aec_curve(const XP_SENSOR::AecCurve aec_curve);
+  XP_SENSOR::AecCurve aec_curve() const { return aec_curve_; }
+  // Use AecController (default) or the legacy computeNewAecTableIndex heuristic for auto gain
+  bool set_model_based_aec(const bool use_model_based_aec);
+  // Combine both eyes for AEC (default: StereoAecMode::LEFT, i.e., the output left eye only).
+  // left_weight in [0, 1] is only used by StereoAecMode::WEIGHTED.
+  bool set_stereo_aec_mode(const StereoAecMode mode, const float left_weight = 0.5f);
+  // Set the AEC metering area and weights.  See BrightnessMetering for the details.
+  // [NOTE] roi is in the coordinates of the raw sensor images, i.e., before the FACE transpose.
+  // An empty roi / weights means the default central window / uniform weights.
+  // The change is picked up by thread_stream_images at the next AEC update.
+  bool set_aec_metering(const cv::Rect& roi,
+                        int weight_map_rows = 0,
+                        int weight_map_cols = 0,
+                        const std::vector<float>& weights = std::vector<float>());
   bool set_auto_infrared(const bool use_infrared);
   bool set_infrared_index(const int infrared_index);
+  // Control the infrared PWM automatically (XPIRL2 only) with InfraredController, which
+  // drives the brightness of the IR sites to the target jointly with AEC.
+  // Only in effect if the infrared light is on, i.e., set_auto_infrared(true).  Otherwise, or on
+  // the other sensors, a warning is logged once.
+  bool set_auto_infrared_pwm(const bool use_auto_pwm);
+  // Only used with imu_from_image (default: ImuOutputMode::SUBSAMPLED).  decimated_rate_hz is
+  // rounded to 500 Hz / an integer factor.  Must be called before run()
+  bool set_imu_output_mode(const ImuOutputMode mode, const int decimated_rate_hz = 100);
+  // Only used without imu_from_image (default: 100 Hz).  Must be called before run()
+  bool set_imu_pull_rate(const int rate_hz);
+  // Preintegrate the delivered IMU samples between consecutive frames into
+  // FrameMetadata::imu_preintegration.  Must be called before run()
+  bool set_imu_preintegration(const bool enable,
+                              const ImuPreintegrator::Config& config = ImuPreintegrator::Config());
+  // Correct the IMU with the calibration of this device (see load_imu_calibration in
+  // helper/imu_calibration.h).  Must be called after init() and before run()
+  bool load_imu_calibration(const std::string& calib_file);
   bool set_image_data_callback(const ImageDataCallback& callback);
+  bool set_image_metadata_callback(const ImageMetadataCallback& callback);
+  bool set_image_imu_callback(const ImageImuCallback& callback);
   bool set_IR_data_callback(const ImageDataCallback& callback);
   bool set_imu_data_callback(const ImuDataCallback& callback);
+  bool set_imu_batch_data_callback(const ImuBatchDataCallback& callback);
+  // [NOTE] The layout of the pool has to match the output images, i.e., RowNum x ColNum
+  // (ColNum x RowNum for FACE), CV_8UC1 for mono sensors and CV_8UC3 if is_color().
+  // If no buffer is free when a frame arrives, the frame is decoded into driver-allocated
+  // images and is only delivered through ImageDataCallback (see get_pool_dropped_frames).
+  // The ImageDataCallback / ImageMetadataCallback / ImageImuCallback never get the pooled
+  // buffers, as they may keep the images.  They get driver-owned copies if the pooled output
+  // is used, so only use the pooled callback to avoid the copies.
+  // Must be called before run()
+  bool set_image_buffer_pool(const std::shared_ptr<ImageBufferPool>& pool);
+  bool set_pooled_image_data_callback(const PooledImageDataCallback& callback);
 
   // Getters
   float get_image_rate() const { return stream_images_rate_; }
   float get_imu_rate() const { return pull_imu_rate_; }
+  // The number of frames that are not delivered to PooledImageDataCallback, as all the
+  // buffers of the pool are in use
+  uint64_t get_pool_dropped_frames() const { return pool_dropped_frames_; }
   XpSoftVersion get_sensor_soft_ver_unit() const { return sensor_soft_ver_unit_; }
   bool get_sensor_resolution(uint16_t* width, uint16_t* height);
   bool get_sensor_deviceid(std::string* device_id);
 
+  SensorControlStats get_sensor_control_stats() const;
+  // The numbers of register transfers issued to / elided by the register shadow copy
+  XP_SENSOR::RegisterTransferStats get_register_transfer_stats() const;
+  // The sensor-to-host clock fit behind Timestamp::synced_host_ns
+  ClockSync::Stats get_clock_sync_stats() const { return clock_sync_.stats(); }
+  // The polling schedule of thread_pull_imu, with the wake-up jitter and missed sample histograms
+  ImuPollScheduler::Stats get_imu_pull_stats() const;
+
   bool is_color() const;
 
  protected:
@@ -87,6 +190,10 @@ class XpSensorMultithread {
   void thread_ioctl_control();
   void thread_pull_imu();
   void thread_stream_images();
+  // Apply the AEC / IR commands posted by thread_stream_images, so that the image path never
+  // blocks on the (slow) USB control transfers.  Only the latest command of each type is
+  // applied if several arrive while a transfer is in flight.
+  void thread_sensor_control();
 
   // [NOTE] The returned cv::Mat is CV_8UC1 if the sensor is mono-color,
   //        and CV_8UC3 if the sensor is color
@@ -95,11 +202,22 @@ class XpSensorMultithread {
                                 cv::Mat* img_r_ptr,
                                 cv::Mat* img_l_IR_ptr,
                                 cv::Mat* img_r_IR_ptr);
+  // Compute the brightness statistics of the IR sites of the XPIRL2 raw data (left eye)
+  bool compute_infrared_stats_from_raw_data(const uint8_t* img_data_ptr,
+                                            BrightnessStats* stats) const;
+  // Compute the AEC brightness statistics from the raw interleaved data without decoding
+  bool compute_aec_stats_from_raw_data(const uint8_t* img_data_ptr,
+                                       BrightnessStats* stats);
   bool get_XPIRL2_img_from_raw_data(const uint8_t* img_data_ptr,
                                     cv::Mat* img_l_ptr,
                                     cv::Mat* img_r_ptr,
                                     cv::Mat* img_l_IR_ptr,
                                     cv::Mat* img_r_IR_ptr);
+  // Sample the R / G / B (no IR) sites of the XPIRL2 raw mosaic of both eyes
+  void sample_XPIRL2_bayer_RGB_mean(const uint8_t* img_data_ptr,
+                                    uint32_t* b_mean_ptr,
+                                    uint32_t* g_mean_ptr,
+                                    uint32_t* r_mean_ptr) const;
   bool get_v024_img_from_raw_data(const uint8_t* img_data_ptr,
                                  cv::Mat* img_l_ptr,
                                  cv::Mat* img_r_ptr);
@@ -115,6 +233,12 @@ class XpSensorMultithread {
   void convert_imu_axes(const XP_20608_data& imu_data,
                         const SensorType sensor_type,
                         XPDRIVER::ImuData* xp_imu_ptr) const;
+  void convert_imu_axes(const XP_20608_data* imu_data,
+                        const int num,
+                        const SensorType sensor_type,
+                        XPDRIVER::ImuData* xp_imu) const;
+  // Call the batch callback once and the per-sample callback num times
+  void deliver_imu_data(const XPDRIVER::ImuData* imu_data, int num) const;
 
   // Member variables for sensor control
   std::string sensor_type_str_;
@@ -128,15 +252,45 @@ class XpSensorMultithread {
   bool use_auto_gain_;
   std::atomic<bool> aec_index_updated_;
   int aec_index_;  // use signed int as the index can go to negative during calculation
+  std::atomic<XP_SENSOR::AecCurve> aec_curve_;  // requested by set_aec_curve
+  XP_SENSOR::AecCurve aec_index_curve_;  // the table of aec_index_
   bool aec_settle_;
+  BrightnessStats aec_stats_;
+  BrightnessMetering aec_metering_;  // only accessed by thread_stream_images
+  std::mutex aec_metering_mutex_;
+  BrightnessMetering new_aec_metering_;  // guarded by aec_metering_mutex_
+  std::atomic<bool> aec_metering_updated_;
+  std::atomic<StereoAecMode> stereo_aec_mode_;
+  std::atomic<float> stereo_aec_left_weight_;
+  StereoBrightnessStats aec_stereo_stats_;
+  bool use_model_based_aec_ = true;
+  AecController aec_controller_;
+  ExposureTracker exposure_tracker_;
   bool use_auto_infrared_;
   std::atomic<bool> infrared_index_updated_;
   uint8_t infrared_index_;
+  bool use_auto_infrared_pwm_ = false;
+  InfraredController infrared_controller_;
+  BrightnessStats infrared_stats_;
   int video_sensor_file_id_;
   int imaging_FPS_;
   XpSoftVersion sensor_soft_ver_unit_;
   struct v4l2_buffer bufferinfo_;
   uint64_t first_imu_clock_count_ = 0;
+  ClockSync clock_sync_;  // fed with the frame timestamps by thread_stream_images
+  // The XP clock unit is 1 ms
+  static constexpr int64_t kSensorClockUnitNs = 1000000;
+  // Exact integer conversion of a Counter32To64 output to Timestamp::sensor_ns
+  int64_t sensor_clock_to_ns(uint64_t clock_count_wo_overflow) const {
+    return static_cast<int64_t>(clock_count_wo_overflow - first_imu_clock_count_) *
+        kSensorClockUnitNs;
+  }
+  ImuOutputMode imu_output_mode_ = ImuOutputMode::SUBSAMPLED;
+  bool use_imu_preintegration_ = false;
+  ImuPreintegrator::Config imu_preintegrator_config_;
+  // Raw IMU -> ImuData with the device calibration.  nullptr if not loaded
+  std::unique_ptr<ImuCorrector> imu_corrector_;
+  int imu_decimation_factor_ = 5;
 
   // For threading and timing stats
   std::vector<std::thread> thread_pool_;
@@ -145,14 +299,48 @@ class XpSensorMultithread {
   std::chrono::time_point<std::chrono::steady_clock> thread_stream_images_pre_timestamp_;
   std::atomic<float> pull_imu_rate_;
   std::atomic<int> pull_imu_count_;
+  std::atomic<uint64_t> pool_dropped_frames_;
   std::chrono::time_point<std::chrono::steady_clock> thread_pull_imu_pre_timestamp_;
+  // XPIRL2 decodes over budget since the last warning (thread_stream_images only)
+  int decode_over_budget_num_ = 0;
+  std::chrono::time_point<std::chrono::steady_clock> last_decode_over_budget_log_tp_;
+  int imu_pull_rate_hz_ = 100;
+  mutable std::mutex imu_pull_stats_mutex_;
+  ImuPollScheduler::Stats imu_pull_stats_;  // guarded by imu_pull_stats_mutex_
   // push by thread_ioctl_control. Fetch by thread_stream_images
-  XPDRIVER::shared_queue<uint8_t*> raw_sensor_img_mmap_ptr_queue_;
+  struct RawImage {
+    uint8_t* data;    // in the mmap buffer
+    int64_t host_ns;  // the V4L2 buffer timestamp if in CLOCK_MONOTONIC, or the dequeue time
+  };
+  XPDRIVER::shared_queue<RawImage> raw_sensor_img_mmap_ptr_queue_;
+
+  // For the sensor control thread
+  struct SensorControlCommand {
+    enum Type {
+      AEC,
+      INFRARED,
+    };
+    Type type;
+    int value;
+    std::chrono::time_point<std::chrono::steady_clock> post_time;
+    XP_SENSOR::AecCurve aec_curve;  // the table of value for AEC
+  };
+  // push by thread_stream_images. Fetch by thread_sensor_control
+  XPDRIVER::shared_queue<SensorControlCommand> sensor_control_cmd_queue_;
+  mutable std::mutex sensor_control_stats_mutex_;
+  SensorControlStats sensor_control_stats_;
 
   // For callback functions
   ImageDataCallback image_data_callback_;
+  ImageMetadataCallback image_metadata_callback_;
+  ImageImuCallback image_imu_callback_;
+  // The pulled IMU samples for the ImuHistory of thread_stream_images (ImageImuCallback only)
+  XPDRIVER::spsc_ring<XPDRIVER::ImuData> pulled_imu_ring_;
   ImageDataCallback IR_data_callback_;
   ImuDataCallback imu_data_callback_;
+  ImuBatchDataCallback imu_batch_data_callback_;
+  PooledImageDataCallback pooled_image_data_callback_;
+  std::shared_ptr<ImageBufferPool> image_buffer_pool_;
   std::shared_ptr<AutoWhiteBalance> whiteBalanceCorrector_;
 };
 
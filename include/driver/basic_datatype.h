@@ -20,17 +20,67 @@
 
 namespace XPDRIVER {
 
+// A sample / frame time in both the sensor and the host clock.
+// [NOTE] A float in 100us, e.g., ImuData::time_stamp, can no longer resolve 100us after
+// 2^24 x 100us (~28 min), so use these int64 ns instead for long runs.
+struct Timestamp {
+  int64_t sensor_ns = 0;  // the sensor clock, counted from the first IMU sample
+  int64_t host_ns = 0;    // CLOCK_MONOTONIC of the host when the data is received
+  // sensor_ns mapped to CLOCK_MONOTONIC by ClockSync.  0 until the clocks are synced.
+  int64_t synced_host_ns = 0;
+};
+
 struct ImuData {
-  float time_stamp;
+  float time_stamp;  // the sensor clock in 100us, i.e., ts.sensor_ns / 1e5
   float accel[3] {};
   float ang_v[3] {};
+  Timestamp ts;
+};
+
+// The sensor settings that an image was actually exposed with
+struct ExposureMetadata {
+  int16_t gain_reg_val = 0;  // analog gain reg val, 16 = 1x
+  int16_t exp_reg_val = 0;   // coarse shutter width reg val in rows
+  // The AEC table index of gain_reg_val and exp_reg_val.
+  // -1 if they come from different table entries, i.e., a change is half-way applied.
+  int aec_index = -1;
+};
+
+// The IMU motion between two times t0 and t1 (usually two frames) in the IMU frame at t0,
+// without gravity, i.e., the preintegrated measurements of Forster et al., "On-Manifold
+// Preintegration for Real-Time Visual-Inertial Odometry", TRO 2017.
+// All the matrices are row-major.
+struct ImuPreintegration {
+  bool valid = false;     // false if there is no IMU sample at or before t0
+  bool complete = false;  // false if the last IMU sample is before t1 and is held to t1
+  int64_t t0_ns = 0;      // Timestamp::sensor_ns
+  int64_t t1_ns = 0;
+  float delta_rot[9] {};  // R(t0)^T R(t1)
+  float delta_vel[3] {};  // R(t0)^T (v(t1) - v(t0) - g dt)
+  float delta_pos[3] {};  // R(t0)^T (p(t1) - p(t0) - v(t0) dt - g dt^2 / 2)
+  // Covariance of the errors [rotation (so3, right), velocity, position]
+  float cov[81] {};
+  // Jacobians w.r.t. the gyro / accel biases, to correct for a bias update to first order
+  float jac_rot_bg[9] {};
+  float jac_vel_bg[9] {};
+  float jac_vel_ba[9] {};
+  float jac_pos_bg[9] {};
+  float jac_pos_ba[9] {};
+};
+
+// Everything the driver knows about a (stereo) frame besides the pixels
+struct FrameMetadata {
+  Timestamp ts;  // the sensor clock of the frame timestamp embedded in the image
+  ExposureMetadata exposure;
+  // Since the previous frame.  Only with XpSensorMultithread::set_imu_preintegration.
+  ImuPreintegration imu_preintegration;
 };
 
 struct XP_20608_data {
   uint64_t clock_count;
   float accel[3];
   float gyro[3];
-  float temp;
+  float temp;  // deg C. NaN if the transport does not report it
 };
 
 enum class SensorType {
@@ -0,0 +1,76 @@
+/******************************************************************************
+ * Copyright 2017-2018 Baidu Robotic Vision Authors. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *****************************************************************************/
+
+#ifndef INCLUDE_DRIVER_HELPER_AEC_CONTROLLER_H_
+#define INCLUDE_DRIVER_HELPER_AEC_CONTROLLER_H_
+
+#include <driver/helper/basic_image_utils.h>  // For BrightnessStats
+#include <driver/xp_aec_table.h>
+
+namespace XPDRIVER {
+
+// A model-based AEC controller.
+// The brightness of an image is proportional to gain x exposure, which is known for every entry
+// of the AEC table.  Given the brightness measured under a known table entry, the controller
+// predicts the entry that brings the brightness to the target in ONE step, instead of walking
+// the table a few steps at a time as computeNewAecTableIndex does.
+// [NOTE] A register write only takes effect a few frames later.  The controller waits
+// frame_delay frames after each change before it trusts the measured brightness again, so the
+// brightness is always paired with the table entry it was actually exposed with.
+// Over-estimating frame_delay only slows the convergence down by a frame per step, while
+// under-estimating it may cause oscillation.
+class AecController {
+ public:
+  struct Config {
+    float target_brightness = 100.f;  // same target as computeNewAecTableIndex
+    int frame_delay = 3;              // frames between a register write and its first image
+    float deadband_ratio = 0.08f;     // |brightness / target - 1| below which nothing changes
+    float damping_zone_ratio = 0.2f;  // only damp the step within this zone around the target
+    float damping = 0.5f;             // the fraction of the (log) error corrected in the zone
+    int lowest_index = 1;             // same lower bound as computeNewAecTableIndex
+  };
+
+  AecController();
+  explicit AecController(const Config& config);
+
+  // Set the table index (of the AEC table of aec_curve) that is currently applied to the sensor,
+  // e.g., at start up or after switching the AEC table
+  void reset(int aec_index, XP_SENSOR::AecCurve aec_curve = XP_SENSOR::AecCurve::DEFAULT);
+
+  // Call once per frame with the brightness statistics of the frame.
+  // Return true if a new index is predicted and written to *aec_index_ptr, which is then
+  // expected to be applied to the sensor right away.
+  bool update(const BrightnessStats& stats, int* aec_index_ptr);
+
+  // true if the last measured brightness is within the deadband around the target
+  bool settled() const { return settled_; }
+  int aec_index() const { return aec_index_; }
+  XP_SENSOR::AecCurve aec_curve() const { return aec_table_->curve; }
+
+  // The index of table whose gain x exposure is the closest to gain_x_exp (in log scale)
+  static int find_index(const XP_SENSOR::AecTable& table, float gain_x_exp);
+  static float gain_x_exp(const XP_SENSOR::AecTable& table, int aec_index);
+
+ private:
+  Config config_;
+  const XP_SENSOR::AecTable* aec_table_;
+  int aec_index_;
+  int frames_since_update_;
+  bool settled_;
+};
+
+}  // namespace XPDRIVER
+#endif  // INCLUDE_DRIVER_HELPER_AEC_CONTROLLER_H_
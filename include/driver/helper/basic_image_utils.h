@@ -17,6 +17,7 @@
 #define INCLUDE_DRIVER_HELPER_BASIC_IMAGE_UTILS_H_
 
 #include <driver/helper/xp_logging.h>
+#include <driver/xp_aec_table.h>
 #include <opencv2/core.hpp>
 #include <vector>
 
@@ -44,6 +45,14 @@ class AutoWhiteBalance {
     correct_white_balance_coefficients(rgb_img_ptr);
   }
 
+  // Run white balance on a stereo pair.
+  // In smoothed mode (see setSmoothedAutoWhiteBalanceMode), ONE set of coefficients is shared
+  // by both eyes, the RGB statistics are only collected on a sparse grid every
+  // m_update_interval_ frames, and the coefficients are low-pass filtered over time.
+  // The per-frame cost is then (almost) only the LUT correction.
+  // Otherwise, it is the same as calling run() on each image.
+  void run(cv::Mat* rgb_img_l_ptr, cv::Mat* rgb_img_r_ptr);
+
   inline void setWhiteBalancePresetMode(float coeff_r,
     float coeff_g, float coeff_b) {
     m_coeff_r_ = coeff_r;
@@ -54,6 +63,42 @@ class AutoWhiteBalance {
 
   inline void setAutoWhiteBalanceMode() {
     m_use_preset_ = false;
+    m_use_smoothing_ = false;
+  }
+
+  // update_interval: collect statistics every update_interval frames
+  // smooth_alpha: weight of the new coefficients in the exponential filter, (0, 1]
+  // grid_step: sample one pixel every grid_step rows / cols
+  inline void setSmoothedAutoWhiteBalanceMode(int update_interval = 10,
+                                              float smooth_alpha = 0.2f,
+                                              int grid_step = 8) {
+    XP_CHECK_GT(update_interval, 0);
+    XP_CHECK_GT(smooth_alpha, 0.f);
+    XP_CHECK_LE(smooth_alpha, 1.f);
+    XP_CHECK_GT(grid_step, 0);
+    m_use_preset_ = false;
+    m_use_smoothing_ = true;
+    m_update_interval_ = update_interval;
+    m_smooth_alpha_ = smooth_alpha;
+    m_grid_step_ = grid_step;
+    m_frame_count_ = 0;
+    m_has_coeffs_ = false;
+  }
+
+  // For the raw Bayer path (e.g., XPIRL2), where the statistics are collected from the raw
+  // mosaic and the gains are applied inside the demosaic loop through the gain LUTs.
+  // [NOTE] r / g / b follow the naming of m_coeff_*, i.e., r is the 1st channel of
+  // the CV_8UC3 image and b is the 3rd one.
+  // needStatistics has to be called once per frame.  It returns true if new statistics
+  // are needed for this frame, and false in preset mode or if the smoothed mode skips it.
+  bool needStatistics();
+  void updateCoefficientsFromRGBMean(uint32_t r_mean, uint32_t g_mean, uint32_t b_mean);
+  // ch: 0 (r), 1 (g), or 2 (b)
+  inline const uint8_t* getGainLut(int ch) {
+    XP_CHECK_GE(ch, 0);
+    XP_CHECK_LT(ch, 3);
+    update_gain_lut();
+    return m_gain_lut_[ch];
   }
 
  private:
@@ -67,7 +112,25 @@ class AutoWhiteBalance {
                                     uint32_t* ptr_g_mean,
                                     uint32_t* ptr_b_mean) const;
   void correct_white_balance_coefficients_neon(cv::Mat* rgb_img_ptr);
+#elif defined __SSE2__
+  void compute_RGB_mean_sse(const cv::Mat& rgb_img_,
+                            uint32_t* ptr_r_mean,
+                            uint32_t* ptr_g_mean,
+                            uint32_t* ptr_b_mean) const;
 #endif  // __ARM_NEON__
+  // Rebuild the per-channel gain LUTs if the coefficients have changed since the last call
+  void update_gain_lut();
+  void correct_white_balance_coefficients_lut(cv::Mat* rgb_img_ptr);
+
+  void compute_RGB_mean_grid(const cv::Mat& rgb_img_,
+                             int grid_step,
+                             uint32_t* ptr_r_mean,
+                             uint32_t* ptr_g_mean,
+                             uint32_t* ptr_b_mean) const;
+  // return false if any of the channels is all black, i.e., the coefficients are not usable
+  static bool coefficients_from_RGB_mean(uint32_t r_mean, uint32_t g_mean, uint32_t b_mean,
+                                         float* coeff_r, float* coeff_g, float* coeff_b);
+  void update_smoothed_AWB_coefficients(const cv::Mat& rgb_img_l, const cv::Mat* rgb_img_r_ptr);
 
   void compute_AWB_coefficients(const cv::Mat& rgb_img_);
   void correct_white_balance_coefficients(cv::Mat* rgb_img_ptr);
@@ -76,11 +139,152 @@ class AutoWhiteBalance {
   float m_coeff_r_;
   float m_coeff_g_;
   float m_coeff_b_;
+
+  // For the smoothed auto white balance mode and the raw Bayer path
+  bool m_use_smoothing_ = false;
+  int m_update_interval_ = 10;
+  float m_smooth_alpha_ = 0.2f;
+  int m_grid_step_ = 8;
+  int m_frame_count_ = 0;  // in [0, m_update_interval_)
+  bool m_has_coeffs_ = false;
+
+  // [NOTE] m_gain_lut_[ch][v] = min(255, int(v * coeff_ch)), i.e., exactly the result of the
+  // float multiply and clamp, so applying the LUT is bit-exact with the float path.
+  // The LUTs are lazily rebuilt by update_gain_lut when the coefficients change.
+  uint8_t m_gain_lut_[3][256];
+  float m_gain_lut_coeffs_[3] = {-1.f, -1.f, -1.f};  // r, g, b. Invalid until first build
+};
+
+// The brightness statistics for AEC.  Reuse the same instance across frames so that no memory
+// is allocated per frame.
+struct BrightnessStats {
+  int histogram[256];
+  int pixel_num = 0;           // the number of sampled pixels
+  int avg_pixel_val = 0;       // same as the avg_pixel_val of sampleBrightnessHistogram
+  int adjusted_pixel_val = 0;  // same as gridBrightDarkAdjustBrightness
+
+  // Scratch buffers
+  std::vector<uint8_t> sampled_row;
+  std::vector<int> grid_sums;
+};
+
+// The metering area and weights of computeBrightnessStats
+// The metered area (roi) is divided into 10x10 grids.  The adjusted brightness is the weighted
+// average of the bright / dark adjusted grid brightness, so the weights decide which part of
+// the image the exposure is optimized for, e.g., de-weight the sky in the top third with
+//   set_weight_map(3, 1, {0.f, 1.f, 1.f})
+// The weights are precomputed into integer per-grid weights by prepare(), so metering adds no
+// per-pixel cost.  The default is the central window with uniform weights, which is bit-exact
+// with gridBrightDarkAdjustBrightness.
+class BrightnessMetering {
+ public:
+  BrightnessMetering() {}
+
+  // roi in pixels of the plane fed to computeBrightnessStats.  An empty roi means the default
+  // central window (kMarginRow / kMarginCol).  x / y are rounded down to even numbers to keep
+  // the Bayer phase of the sampling.
+  void set_roi(const cv::Rect& roi);
+  // A map_rows x map_cols weight map (row-major) stretched over the grids of the roi with
+  // nearest neighbor sampling.  Weights are clamped to [0, kMaxWeight].  Empty means uniform.
+  // Return false if the size of weights mismatches.
+  bool set_weight_map(int map_rows, int map_cols, const std::vector<float>& weights);
+
+  // Precompute the metered area and the per-grid weights for a rows x cols plane.
+  // Return false if the roi does not fit in the plane or all the weights are 0.
+  bool prepare(int rows, int cols);
+  bool is_prepared_for(int rows, int cols) const {
+    return prepared_rows_ == rows && prepared_cols_ == cols;
+  }
+
+  static constexpr float kMaxWeight = 16.f;
+
+  // The precomputed results
+  int start_row() const { return start_row_; }
+  int end_row() const { return end_row_; }
+  int start_col() const { return start_col_; }
+  int end_col() const { return end_col_; }
+  int grid_rows() const { return grid_rows_; }
+  int grid_cols() const { return grid_cols_; }
+  // grid_rows x grid_cols weights in fixed point (1.0 == kWeightOne)
+  const std::vector<int>& grid_weights() const { return grid_weights_; }
+  int64_t grid_weight_sum() const { return grid_weight_sum_; }
+  static constexpr int kWeightOne = 256;
+
+ private:
+  cv::Rect roi_;
+  int map_rows_ = 0;
+  int map_cols_ = 0;
+  std::vector<float> weight_map_;
+
+  int prepared_rows_ = -1;
+  int prepared_cols_ = -1;
+  int start_row_ = 0;
+  int end_row_ = 0;
+  int start_col_ = 0;
+  int end_col_ = 0;
+  int grid_rows_ = 0;
+  int grid_cols_ = 0;
+  std::vector<int> grid_weights_;
+  int64_t grid_weight_sum_ = 0;
 };
 
+// Compute the histogram, the average and the grid bright / dark adjusted brightness of the
+// sampled area in ONE sweep.  The results are bit-exact with sampleBrightnessHistogram and
+// gridBrightDarkAdjustBrightness.
+// The input is a plane of rows x cols pixels that are pixel_stride bytes apart, and row_step
+// bytes per row, so it can be
+//   a mono image:                          pixel_stride = 1
+//   one eye of the raw interleaved data:   pixel_stride = 2 (the right eye starts at data + 1)
+// For a raw Bayer mosaic, point data to the 1st site of the wanted color channel.  Only every
+// kPixelStep-th row / col is sampled, which are then the sites of the same color.
+// metering has to be prepared for rows x cols.  nullptr means the default metering.
+// Return false if nothing is sampled
+bool computeBrightnessStats(const uint8_t* data,
+                            int rows,
+                            int cols,
+                            size_t row_step,
+                            int pixel_stride,
+                            BrightnessStats* stats,
+                            const BrightnessMetering* metering = nullptr);
+bool computeBrightnessStats(const cv::Mat& mono_img,
+                            BrightnessStats* stats,
+                            const BrightnessMetering* metering = nullptr);
+
+// How to combine the brightness of the two eyes for AEC
+enum class StereoAecMode {
+  LEFT = 0,            // left eye only
+  MEAN = 1,            // the average of both eyes
+  MIN_SATURATION = 2,  // the eye with more saturated pixels, so that neither is over-exposed
+  WEIGHTED = 3,        // left_weight * left + (1 - left_weight) * right
+};
+
+struct StereoBrightnessStats {
+  BrightnessStats l;
+  BrightnessStats r;
+  BrightnessStats joint;  // l and r combined by StereoAecMode.  Feed it to AEC.
+};
+
+// The stereo version of computeBrightnessStats that samples BOTH eyes of the raw interleaved
+// data (left in the even bytes, right in the odd bytes) in one sweep.  Each eye samples every
+// other row of the mono sampling lattice, so the cost is about the same as one eye with
+// computeBrightnessStats.  metering is shared by both eyes.
+bool computeStereoBrightnessStats(const uint8_t* data,
+                                  int rows,
+                                  int cols,
+                                  size_t row_step,
+                                  StereoAecMode mode,
+                                  float left_weight,
+                                  StereoBrightnessStats* stats,
+                                  const BrightnessMetering* metering = nullptr);
+
 bool computeNewAecTableIndex(const cv::Mat& raw_img,
                              const bool smooth_aec,
                              int* aec_index_ptr);
+// The step sizes are tuned for XP_SENSOR::AecCurve::DEFAULT
+bool computeNewAecTableIndex(const BrightnessStats& stats,
+                             const bool smooth_aec,
+                             int* aec_index_ptr,
+                             XP_SENSOR::AecCurve aec_curve = XP_SENSOR::AecCurve::DEFAULT);
 
 int sampleBrightnessHistogram(const cv::Mat& raw_img,
                               std::vector<int>* histogram,
@@ -0,0 +1,92 @@
+/******************************************************************************
+ * Copyright 2017-2018 Baidu Robotic Vision Authors. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *****************************************************************************/
+
+#ifndef INCLUDE_DRIVER_HELPER_CLOCK_SYNC_H_
+#define INCLUDE_DRIVER_HELPER_CLOCK_SYNC_H_
+
+#include <cstdint>
+#include <mutex>
+
+namespace XPDRIVER {
+
+// Map the sensor clock to the host clock with an online linear fit
+//   host_ns - sensor_ns = offset + skew * sensor_ns
+// of (sensor time, host receive time) pairs, e.g., the frame timestamp embedded in each image
+// and the V4L2 buffer timestamp of the kernel.
+// The fit is an exponentially-weighted least squares over the last Config::window_s seconds
+// (of the sensor clock) kept as running weighted means / co-moments, so each sample costs O(1)
+// and the fit follows the drift of the two crystals.  A sample whose residual is beyond
+// Config::outlier_sigma x the running residual std is rejected as USB / scheduling jitter.
+// The mapped time includes the mean transfer latency of the accepted samples.
+// Thread safe.
+class ClockSync {
+ public:
+  struct Config {
+    double window_s = 60;          // the time constant of the exponential forgetting
+    float outlier_sigma = 3.f;
+    int64_t min_outlier_ns = 2000000;  // >= the 1 ms resolution of the sensor clock
+    int warmup_samples = 30;       // accept everything until then
+    double min_skew_span_s = 5;    // estimate the skew only with samples spread this long
+    int reset_after_outliers = 100;  // restart the fit, e.g., after a clock jump
+  };
+  struct Stats {
+    int accepted_num = 0;
+    int rejected_num = 0;
+    int reset_num = 0;
+    double residual_std_ns = 0;
+    double skew_ppm = 0;  // how much faster the host clock runs than the sensor clock
+  };
+
+  ClockSync();
+  explicit ClockSync(const Config& config);
+
+  void reset();
+
+  // Add a pair of the same instant in the two clocks.  Return false if it is rejected.
+  bool add_sample(int64_t sensor_ns, int64_t host_ns);
+
+  // Whether the mapping below is usable, i.e., the warmup has passed
+  bool is_synced() const;
+  int64_t sensor_to_host_ns(int64_t sensor_ns) const;
+  int64_t host_to_sensor_ns(int64_t host_ns) const;
+  Stats stats() const;
+
+ private:
+  void reset_fit();
+  bool has_skew() const;
+  // The fitted (host - sensor - ref_offset_ns_) at x seconds after ref_sensor_ns_
+  double predict(double x) const;
+
+  const Config config_;
+  mutable std::mutex mutex_;
+  bool has_ref_;
+  int64_t ref_sensor_ns_;  // x = 0
+  int64_t ref_offset_ns_;  // host - sensor of the first sample, to keep y small
+  // Exponentially-weighted running stats of x (sec) and y (ns)
+  double weight_;
+  double mean_x_;
+  double mean_y_;
+  double co_xx_;
+  double co_xy_;
+  double last_x_;
+  double residual_std_ns_;
+  int sample_num_;
+  int consecutive_outlier_num_;
+  Stats stats_;
+};
+
+}  // namespace XPDRIVER
+#endif  // INCLUDE_DRIVER_HELPER_CLOCK_SYNC_H_
@@ -0,0 +1,83 @@
+/******************************************************************************
+ * Copyright 2017-2018 Baidu Robotic Vision Authors. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *****************************************************************************/
+
+#ifndef INCLUDE_DRIVER_HELPER_EXPOSURE_TRACKER_H_
+#define INCLUDE_DRIVER_HELPER_EXPOSURE_TRACKER_H_
+
+#include <driver/basic_datatype.h>  // For ExposureMetadata
+#include <cstdint>
+#include <deque>
+#include <mutex>
+
+namespace XPDRIVER {
+
+// Track the gain / exposure register writes until they take effect, and label each frame with
+// the settings it was actually exposed with.  No register is read back from the sensor.
+// The host time of a write is mapped to the sensor clock with the lower envelope of
+// (host arrival time - sensor timestamp) of the recent frames, i.e., the minimum transfer delay.
+// A write takes effect delay_frames after the frame it lands in, i.e., the gain at the first
+// frame whose sensor timestamp is after the write, and the exposure one frame later.
+// Thread safe: the writes and the frames are usually reported by different threads.
+class ExposureTracker {
+ public:
+  struct Config {
+    int gain_delay_frames = 1;
+    int exp_delay_frames = 2;
+    int offset_window_frames = 64;  // to follow the drift between the host and sensor clocks
+  };
+
+  ExposureTracker();
+  explicit ExposureTracker(const Config& config);
+
+  // Set the settings that are already active, e.g., written before streaming starts
+  void reset(int16_t gain_reg_val, int16_t exp_reg_val, int aec_index);
+
+  // Call right after the registers are written (gain last)
+  void on_registers_written(int64_t host_time_us,
+                            int16_t gain_reg_val,
+                            int16_t exp_reg_val,
+                            int aec_index);
+
+  // Call once per frame in the order of arrival.  Return the settings of the frame.
+  ExposureMetadata on_frame(int64_t sensor_time_us, int64_t host_time_us);
+
+ private:
+  struct PendingWrite {
+    int64_t sensor_time_us;
+    int16_t gain_reg_val;
+    int16_t exp_reg_val;
+    int aec_index;
+    int frames_after;  // the number of frames after the write
+  };
+
+  const Config config_;
+  std::mutex mutex_;
+  std::deque<PendingWrite> pending_writes_;
+  // The active settings and the table index each of them comes from
+  int16_t gain_reg_val_;
+  int16_t exp_reg_val_;
+  int gain_aec_index_;
+  int exp_aec_index_;
+  // host time - sensor time.  The min of the current and the last window.
+  bool has_offset_;
+  int64_t offset_us_;
+  int64_t window_offset_us_;
+  int64_t last_window_offset_us_;
+  int window_frames_;
+};
+
+}  // namespace XPDRIVER
+#endif  // INCLUDE_DRIVER_HELPER_EXPOSURE_TRACKER_H_
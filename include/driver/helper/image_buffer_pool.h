@@ -0,0 +1,85 @@
+/******************************************************************************
+ * Copyright 2017-2018 Baidu Robotic Vision Authors. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *****************************************************************************/
+
+#ifndef INCLUDE_DRIVER_HELPER_IMAGE_BUFFER_POOL_H_
+#define INCLUDE_DRIVER_HELPER_IMAGE_BUFFER_POOL_H_
+
+#include <driver/basic_datatype.h>  // For ExposureMetadata
+#include <opencv2/core.hpp>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace XPDRIVER {
+
+// The layout of the application-owned destination buffers.
+// [NOTE] rows / cols / type have to match the images produced by the driver, e.g.,
+// CV_8UC1 for mono sensors and CV_8UC3 for color sensors.  See XpSensorMultithread::is_color
+struct ImageBufferLayout {
+  int rows = 0;
+  int cols = 0;
+  int type = CV_8UC1;
+  size_t step = 0;       // bytes per row.  0 means tightly packed, i.e., cols * elem size
+  size_t alignment = 1;  // required alignment (in bytes) of the start of each buffer
+};
+
+// A pool of application-owned stereo image buffers.  The driver decodes each frame straight
+// into the next free buffer pair and hands the ownership over to the application through
+// XpSensorMultithread::PooledImageDataCallback.  The buffer pair goes back to the pool when
+// the last copy of the StereoImagePtr is released.
+// The pool never allocates, copies or frees image memory itself.
+class ImageBufferPool {
+ public:
+  struct StereoImage {
+    cv::Mat l;  // wraps the application-owned left buffer
+    cv::Mat r;  // wraps the application-owned right buffer
+    int index;  // the index of the buffer pair in the pool, in the order of add_buffer
+    ExposureMetadata exposure;  // filled by the driver for each frame
+    Timestamp ts;               // filled by the driver for each frame
+  };
+  typedef std::shared_ptr<StereoImage> StereoImagePtr;
+
+  explicit ImageBufferPool(const ImageBufferLayout& layout);
+
+  // Register a pair of buffers.  Each buffer has to hold at least layout.rows * step bytes.
+  // Return false if a buffer violates the alignment requirement.
+  bool add_buffer(uint8_t* l_data, uint8_t* r_data);
+
+  // Return nullptr if all the buffers are in use.  Thread safe.
+  StereoImagePtr acquire();
+
+  const ImageBufferLayout& layout() const { return layout_; }
+  size_t step() const { return step_; }
+  int size() const;
+  int num_free() const;
+
+ private:
+  struct State {
+    std::mutex m;
+    std::vector<uint8_t*> l_data;
+    std::vector<uint8_t*> r_data;
+    std::vector<int> free_indices;
+  };
+  const ImageBufferLayout layout_;
+  size_t step_;
+  // Shared with the deleters of the StereoImagePtr handed out, so that a buffer that is
+  // released after the pool is destroyed doesn't touch freed memory.
+  std::shared_ptr<State> state_;
+};
+
+}  // namespace XPDRIVER
+#endif  // INCLUDE_DRIVER_HELPER_IMAGE_BUFFER_POOL_H_
@@ -0,0 +1,75 @@
+/******************************************************************************
+ * Copyright 2017-2018 Baidu Robotic Vision Authors. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *****************************************************************************/
+
+#ifndef INCLUDE_DRIVER_HELPER_IMU_CALIBRATION_H_
+#define INCLUDE_DRIVER_HELPER_IMU_CALIBRATION_H_
+
+#include <driver/basic_datatype.h>  // For ImuData & XP_20608_data
+#include <string>
+
+namespace XPDRIVER {
+
+// The IMU intrinsics of one device, in the units and axes of XP_20608_data (dps, m/s^2), i.e.,
+// before the axis remap to the camera frame:
+//   calibrated = matrix * (raw - bias - temp_coeff * (temp - ref_temp))
+// The matrix is row-major and holds both the scale factors and the axis misalignment.
+// The temperature term is skipped if XP_20608_data::temp is unknown (NaN).
+struct ImuCalibration {
+  float ref_temp = 25.f;                      // deg C
+  float gyro_bias[3] = {0.f, 0.f, 0.f};       // dps
+  float gyro_temp_coeff[3] = {0.f, 0.f, 0.f};  // dps / deg C
+  float gyro_matrix[9] = {1.f, 0.f, 0.f, 0.f, 1.f, 0.f, 0.f, 0.f, 1.f};
+  float accel_bias[3] = {0.f, 0.f, 0.f};       // m / s^2
+  float accel_temp_coeff[3] = {0.f, 0.f, 0.f};  // m / s^2 / deg C
+  float accel_matrix[9] = {1.f, 0.f, 0.f, 0.f, 1.f, 0.f, 0.f, 0.f, 1.f};
+};
+
+// Load the calibration of device_id (XpSensorMultithread::get_sensor_deviceid) from a text
+// file of per-device sections.  '#' starts a comment, and a missing key keeps its default:
+//   [<device_id>]
+//   ref_temp 25
+//   gyro_bias 0.1 -0.2 0.05
+//   gyro_temp_coeff 0.01 0 0
+//   gyro_matrix 1.002 0.001 0  -0.001 0.998 0  0 0 1
+//   accel_bias ...  accel_temp_coeff ...  accel_matrix ...
+// Return false if the file cannot be read, is malformed, or has no section of device_id.
+bool load_imu_calibration(const std::string& file_name,
+                          const std::string& device_id,
+                          ImuCalibration* calib);
+
+// Convert the raw IMU samples to ImuData in one pass.  The calibration, the axis remap to the
+// camera frame, and the dps -> rad/s conversion are folded into one 3x3 matrix and offset per
+// sensor when constructed, so each sample costs a bias subtraction and a 3x3 product.
+// xp_imu axis k = axis_sign[k] * calibrated axis axis_src[k]
+class ImuCorrector {
+ public:
+  ImuCorrector(const ImuCalibration& calib, const int axis_src[3], const float axis_sign[3]);
+
+  // time_stamp and ts of xp_imu are not touched
+  void apply(const XP_20608_data* imu_data, int num, ImuData* xp_imu) const;
+
+ private:
+  float ref_temp_;
+  float gyro_bias_[3];
+  float gyro_temp_coeff_[3];
+  float gyro_matrix_[9];  // remap x rad/s x calibration matrix
+  float accel_bias_[3];
+  float accel_temp_coeff_[3];
+  float accel_matrix_[9];  // remap x calibration matrix
+};
+
+}  // namespace XPDRIVER
+#endif  // INCLUDE_DRIVER_HELPER_IMU_CALIBRATION_H_
@@ -0,0 +1,54 @@
+/******************************************************************************
+ * Copyright 2017-2018 Baidu Robotic Vision Authors. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *****************************************************************************/
+
+#ifndef INCLUDE_DRIVER_HELPER_IMU_DECIMATOR_H_
+#define INCLUDE_DRIVER_HELPER_IMU_DECIMATOR_H_
+
+#include <driver/basic_datatype.h>  // For ImuData
+#include <vector>
+
+namespace XPDRIVER {
+
+// Decimate an IMU stream by an integer factor with a linear-phase low-pass FIR filter
+// (Blackman-windowed sinc), so that the vibration above the output Nyquist rate doesn't alias
+// into the output.  The filter state is kept between calls, so the input can be fed in bursts,
+// e.g., the IMU samples embedded in each image.
+// The output time_stamp / ts is that of the input sample at the center of the filter, i.e.,
+// compensated for the group delay.  The output is then (taps - 1) / 2 input samples late.
+class ImuDecimator {
+ public:
+  // The filter is 8 x factor + 1 taps long, with the -6 dB point at cutoff_ratio x the output
+  // Nyquist rate, e.g., 40 Hz for 500 Hz -> 100 Hz.
+  explicit ImuDecimator(int factor, float cutoff_ratio = 0.8f);
+
+  // Feed one input sample.  Return true if an output sample is written to *output.
+  bool push(const ImuData& input, ImuData* output);
+  void reset();
+
+  int factor() const { return factor_; }
+  int taps() const { return static_cast<int>(coeffs_.size()); }
+
+ private:
+  const int factor_;
+  std::vector<float> coeffs_;
+  std::vector<ImuData> history_;  // ring buffer of the last taps() input samples
+  int head_;                      // the slot of the next input sample in history_
+  int filled_;                    // the number of valid samples in history_
+  int phase_;                     // the number of input samples since the last output
+};
+
+}  // namespace XPDRIVER
+#endif  // INCLUDE_DRIVER_HELPER_IMU_DECIMATOR_H_
@@ -0,0 +1,82 @@
+/******************************************************************************
+ * Copyright 2017-2018 Baidu Robotic Vision Authors. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *****************************************************************************/
+
+#ifndef INCLUDE_DRIVER_HELPER_IMU_HISTORY_H_
+#define INCLUDE_DRIVER_HELPER_IMU_HISTORY_H_
+
+#include <driver/basic_datatype.h>  // For ImuData
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace XPDRIVER {
+
+// The IMU samples between two times, e.g., the previous and the current frame, with the
+// endpoints interpolated at exactly those times.
+// The samples in between are NOT copied but point into ImuHistory, so they are only valid
+// until the next ImuHistory::push.
+struct ImuInterval {
+  ImuData begin;  // interpolated at t0
+  ImuData end;    // interpolated at t1, or the newest sample held to t1 if !complete
+  // The samples strictly inside (t0, t1), oldest first, in up to 2 contiguous pieces as the
+  // history is a ring buffer
+  const ImuData* inner[2] = {nullptr, nullptr};
+  int inner_num[2] = {0, 0};
+  // false if there is no sample at or after t1 yet
+  bool complete = false;
+  bool valid = false;  // set by a successful ImuHistory::query
+
+  int inner_size() const { return inner_num[0] + inner_num[1]; }
+  const ImuData& inner_at(int i) const {
+    return i < inner_num[0] ? inner[0][i] : inner[1][i - inner_num[0]];
+  }
+};
+
+// A ring buffer of the recent IMU samples indexed by Timestamp::sensor_ns, which answers
+// interval queries in O(log n) without copying the samples.
+// Not thread safe.  The driver only touches it in thread_stream_images.
+class ImuHistory {
+ public:
+  // capacity is rounded up to a power of 2
+  explicit ImuHistory(size_t capacity = 1024);
+
+  // The samples have to come in increasing ts.sensor_ns.  The others are dropped.
+  // The oldest sample is overwritten once the history is full.
+  void push(const ImuData& imu);
+  void push(const ImuData* imu, int num);
+  void clear();
+
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  // The i-th oldest sample
+  const ImuData& at(size_t i) const { return buf_[(head_ - size_ + i) & mask_]; }
+
+  // The samples in [t0_ns, t1_ns].  Return false if t1_ns < t0_ns, or there is no sample at or
+  // before t0_ns, i.e., the start of the interval is no longer (or not yet) in the history.
+  bool query(int64_t t0_ns, int64_t t1_ns, ImuInterval* interval) const;
+
+ private:
+  // The index of the first sample with ts.sensor_ns > t_ns (or >= t_ns if inclusive)
+  size_t first_index_after(int64_t t_ns, bool inclusive) const;
+
+  std::vector<ImuData> buf_;
+  size_t mask_;
+  size_t head_;  // the slot of the next sample, not wrapped
+  size_t size_;
+};
+
+}  // namespace XPDRIVER
+#endif  // INCLUDE_DRIVER_HELPER_IMU_HISTORY_H_
@@ -0,0 +1,96 @@
+/******************************************************************************
+ * Copyright 2017-2018 Baidu Robotic Vision Authors. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *****************************************************************************/
+
+#ifndef INCLUDE_DRIVER_HELPER_IMU_POLL_SCHEDULER_H_
+#define INCLUDE_DRIVER_HELPER_IMU_POLL_SCHEDULER_H_
+
+#include <cstdint>
+
+namespace XPDRIVER {
+
+// Schedule the IMU polls (IMU_DataAccess) on absolute CLOCK_MONOTONIC deadlines, so neither the
+// wake-up delay nor the ioctl time accumulates, and keep the polls in phase with the firmware.
+// - A poll that returns the same sample as the last one (duplicate) is early w.r.t. the
+//   firmware update.  It is retried after period / retry_divisor, which also shifts all the
+//   following deadlines by that much.
+// - After advance_after_polls new samples in a row, the deadlines move period /
+//   advance_divisor earlier to find the update edge again, e.g., as the clocks drift.
+// - A sample clock step of >= 1.5 x the firmware period is a gap, i.e., missed samples.  The
+//   firmware period is the min step over the recent samples.
+// - Deadlines already passed, e.g., after a long ioctl, are skipped, not caught up.
+// Not thread safe.
+class ImuPollScheduler {
+ public:
+  struct Config {
+    int rate_hz = 100;
+    int retry_divisor = 8;
+    int advance_after_polls = 50;
+    int advance_divisor = 32;
+  };
+  struct Stats {
+    static constexpr int kJitterBinUs = 50;
+    static constexpr int kJitterBinNum = 20;  // the last bin is for >= 950 us
+    static constexpr int kMissBinNum = 8;     // the last bin is for >= 8 missed samples
+    int poll_num = 0;
+    int sample_num = 0;     // new samples
+    int duplicate_num = 0;  // polls that returned the last sample again
+    int failure_num = 0;    // polls without a usable sample
+    int gap_num = 0;
+    int missed_sample_num = 0;
+    int overrun_num = 0;    // times that deadlines were skipped
+    int64_t firmware_period_ns = 0;
+    // The wake-up delay after the deadline in kJitterBinUs bins
+    int wake_jitter_hist[kJitterBinNum] {};
+    // missed_sample_hist[i] is the number of gaps of i + 1 missed samples
+    int missed_sample_hist[kMissBinNum] {};
+  };
+
+  ImuPollScheduler();
+  explicit ImuPollScheduler(const Config& config);
+
+  void start(int64_t now_ns);
+  // The CLOCK_MONOTONIC time to poll next
+  int64_t next_deadline_ns() const { return next_deadline_ns_; }
+
+  // Call when woken up for next_deadline_ns()
+  void on_wake(int64_t wake_ns);
+  // Call with the sensor clock of the polled sample and the time the poll is done.
+  // Return false if it is a duplicate.
+  bool on_sample(int64_t sample_sensor_ns, int64_t done_ns);
+  // Call instead of on_sample for a poll without a usable sample, e.g., a failed one
+  void on_failure(int64_t done_ns);
+
+  const Stats& stats() const { return stats_; }
+
+ private:
+  // Move next_deadline_ns_ one period on, skipping the deadlines before done_ns
+  void advance_deadline(int64_t done_ns);
+
+  const Config config_;
+  const int64_t period_ns_;
+  int64_t next_deadline_ns_;
+  bool has_last_sample_;
+  int64_t last_sample_sensor_ns_;
+  int new_sample_streak_;
+  // The min sample clock step of the current and the last window
+  int64_t window_min_step_ns_;
+  int64_t last_window_min_step_ns_;
+  int window_sample_num_;
+  Stats stats_;
+};
+
+}  // namespace XPDRIVER
+#endif  // INCLUDE_DRIVER_HELPER_IMU_POLL_SCHEDULER_H_
@@ -0,0 +1,55 @@
+/******************************************************************************
+ * Copyright 2017-2018 Baidu Robotic Vision Authors. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *****************************************************************************/
+
+#ifndef INCLUDE_DRIVER_HELPER_IMU_PREINTEGRATOR_H_
+#define INCLUDE_DRIVER_HELPER_IMU_PREINTEGRATOR_H_
+
+#include <driver/basic_datatype.h>  // For ImuData & ImuPreintegration
+#include <driver/helper/imu_history.h>  // For ImuInterval
+
+namespace XPDRIVER {
+
+// Preintegrate the IMU samples between two frames into ImuPreintegration.
+// Each segment between two consecutive samples is integrated with the mean of its two
+// measurements.  All the math is on fixed-size float arrays, so it stays in registers / L1.
+class ImuPreintegrator {
+ public:
+  struct Config {
+    // The default noise densities are the ones of the ICM-20608 datasheet
+    float gyro_noise_density = 1.4e-4f;   // rad / s / sqrt(Hz)
+    float accel_noise_density = 1.5e-3f;  // m / s^2 / sqrt(Hz)
+    // Subtracted from the measurements.  ImuPreintegration has the Jacobians for a new bias.
+    float gyro_bias[3] = {0.f, 0.f, 0.f};   // rad / s
+    float accel_bias[3] = {0.f, 0.f, 0.f};  // m / s^2
+  };
+
+  ImuPreintegrator();
+  explicit ImuPreintegrator(const Config& config);
+
+  // From interval.begin to interval.end.  An invalid interval results in an invalid
+  // ImuPreintegration.
+  void integrate(const ImuInterval& interval, ImuPreintegration* result) const;
+
+ private:
+  // Integrate the segment from imu0 to imu1, and propagate the covariance and Jacobians
+  void integrate_segment(const ImuData& imu0, const ImuData& imu1,
+                         ImuPreintegration* result) const;
+
+  const Config config_;
+};
+
+}  // namespace XPDRIVER
+#endif  // INCLUDE_DRIVER_HELPER_IMU_PREINTEGRATOR_H_
@@ -0,0 +1,68 @@
+/******************************************************************************
+ * Copyright 2017-2018 Baidu Robotic Vision Authors. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *****************************************************************************/
+
+#ifndef INCLUDE_DRIVER_HELPER_INFRARED_CONTROLLER_H_
+#define INCLUDE_DRIVER_HELPER_INFRARED_CONTROLLER_H_
+
+#include <driver/helper/basic_image_utils.h>  // For BrightnessStats
+
+namespace XPDRIVER {
+
+// A closed-loop controller of the infrared illuminator PWM.
+// The brightness of the IR sites is modeled as proportional to PWM x gain x exposure, i.e.,
+// the illuminator dominates the IR light.  Like AecController, the controller predicts the PWM
+// that brings the IR brightness to the target in one step.  It runs jointly with AEC:
+// the brightness is measured with the gain x exposure the frame was exposed with, and the PWM
+// is predicted for the gain x exposure that AEC has just set, so an AEC change is compensated
+// right away instead of being corrected by a few more PWM steps.
+// [NOTE] Every PWM change is a USB control transfer.  The changes are rate limited to one per
+// min_interval_frames, and changes within the deadband are skipped.
+class InfraredController {
+ public:
+  struct Config {
+    float target_brightness = 100.f;  // of the IR sites
+    int min_pwm = 1;                  // 0 turns the illuminator off
+    int max_pwm = 255;                // XP_SENSOR::infrared_pwm_max
+    int min_interval_frames = 5;      // also covers the frame delay of a PWM change
+    float deadband_ratio = 0.1f;      // |predicted pwm / pwm - 1| below which nothing changes
+  };
+
+  InfraredController();
+  explicit InfraredController(const Config& config);
+
+  // Set the PWM that is currently applied to the illuminator
+  void reset(int pwm);
+
+  // Call once per frame with the brightness statistics of the IR sites.
+  // frame_gain_x_exp: gain x exposure that the frame was exposed with
+  // aec_gain_x_exp: gain x exposure of the latest AEC setting
+  // Return true if a new PWM is predicted and written to *pwm_ptr, which is then expected to
+  // be applied right away.
+  bool update(const BrightnessStats& ir_stats,
+              float frame_gain_x_exp,
+              float aec_gain_x_exp,
+              int* pwm_ptr);
+
+  int pwm() const { return pwm_; }
+
+ private:
+  Config config_;
+  int pwm_;
+  int frames_since_update_;
+};
+
+}  // namespace XPDRIVER
+#endif  // INCLUDE_DRIVER_HELPER_INFRARED_CONTROLLER_H_
@@ -119,6 +119,19 @@ class shared_queue {
     }
   }
 
+  // Wait until the queue is non-empty, and then move ALL the elements out to elems.
+  bool wait_and_pop_all(Container* elems) {
+    std::unique_lock<std::mutex> lock(m_);
+    cond_.wait(lock, [this](){ return !queue_.empty() || kill_; });
+    if (kill_) {
+      return false;
+    } else {
+      elems->clear();
+      elems->swap(queue_);
+      return true;
+    }
+  }
+
   bool wait_and_peek_front(T* elem) {
     std::unique_lock<std::mutex> lock(m_);
     cond_.wait(lock, [this](){ return !queue_.empty() || kill_; });
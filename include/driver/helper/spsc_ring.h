@@ -0,0 +1,191 @@
+/******************************************************************************
+ * Copyright 2017-2018 Baidu Robotic Vision Authors. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *****************************************************************************/
+
+#ifndef INCLUDE_DRIVER_HELPER_SPSC_RING_H_
+#define INCLUDE_DRIVER_HELPER_SPSC_RING_H_
+
+#include <driver/helper/xp_logging.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+namespace XPDRIVER {
+
+// A lock-free single-producer / single-consumer ring buffer, e.g., for the IMU samples pushed
+// from XpSensorMultithread callbacks to ONE consumer thread.
+// Neither side takes a lock.  The producer makes a syscall (futex wake) only if the consumer is
+// sleeping on an empty ring, and the consumer only when it has to sleep.
+// If the ring is full, push_back drops the new element and counts it in dropped_num().
+// [NOTE] push_back must be called from one thread only, and all the other functions except
+// kill() / size() / empty() / dropped_num() from one (other) thread only.
+template <typename T>
+class spsc_ring {
+ public:
+  // Remove copy and assign
+  spsc_ring& operator=(const spsc_ring&) = delete;
+  spsc_ring(const spsc_ring& other) = delete;
+
+  // capacity is rounded up to a power of 2
+  explicit spsc_ring(size_t capacity = 1024)
+      : head_(0),
+        tail_(0),
+        signal_(0),
+        consumer_waiting_(false),
+        kill_(false),
+        dropped_num_(0) {
+    XP_CHECK_GT(capacity, 0);
+    XP_CHECK_LE(capacity, 1u << 30);
+    size_t n = 1;
+    while (n < capacity) {
+      n <<= 1;
+    }
+    buf_.resize(n);
+    mask_ = n - 1;
+  }
+
+  // Use this function to wake up the consumer before the application exits
+  void kill() {
+    kill_.store(true);
+    signal_.fetch_add(1);
+    futex_wake();
+  }
+
+  // Producer side
+  bool push_back(const T& elem) {
+    const uint32_t head = head_.load(std::memory_order_relaxed);
+    if (head - tail_cache_ > mask_) {
+      tail_cache_ = tail_.load(std::memory_order_acquire);
+      if (head - tail_cache_ > mask_) {
+        dropped_num_.fetch_add(1, std::memory_order_relaxed);
+        return false;
+      }
+    }
+    buf_[head & mask_] = elem;
+    // seq_cst pairs with the consumer_waiting_ store / head_ load in wait_non_empty, so that
+    // either the consumer sees the new element or we see it waiting.
+    // Only the first push_back after the consumer goes to sleep wakes it up.
+    head_.store(head + 1);
+    if (consumer_waiting_.load() && consumer_waiting_.exchange(false)) {
+      signal_.fetch_add(1);
+      futex_wake();
+    }
+    return true;
+  }
+
+  // Consumer side.  Move up to max_num elements out to elems, oldest first, without blocking.
+  // Return the number of elements moved.
+  size_t pop_front(T* elems, size_t max_num) {
+    const uint32_t tail = tail_.load(std::memory_order_relaxed);
+    const uint32_t head = head_.load(std::memory_order_acquire);
+    size_t num = head - tail;
+    if (num > max_num) {
+      num = max_num;
+    }
+    for (size_t i = 0; i < num; ++i) {
+      elems[i] = std::move(buf_[(tail + i) & mask_]);
+    }
+    tail_.store(tail + num, std::memory_order_release);
+    return num;
+  }
+
+  // Move ALL the available elements out to elems without blocking.
+  size_t pop_all(std::vector<T>* elems) {
+    elems->resize(size());
+    elems->resize(pop_front(elems->data(), elems->size()));
+    return elems->size();
+  }
+
+  // Copy the newest up-to-num elements to elems, oldest first, without consuming them.
+  size_t peek_newest(T* elems, size_t num) const {
+    const uint32_t tail = tail_.load(std::memory_order_relaxed);
+    const uint32_t head = head_.load(std::memory_order_acquire);
+    if (num > head - tail) {
+      num = head - tail;
+    }
+    for (size_t i = 0; i < num; ++i) {
+      elems[i] = buf_[(head - num + i) & mask_];
+    }
+    return num;
+  }
+
+  // Sleep on a futex until the ring is non-empty.  Return false if the ring is killed.
+  bool wait_non_empty() {
+    const uint32_t tail = tail_.load(std::memory_order_relaxed);
+    while (!kill_.load(std::memory_order_acquire)) {
+      if (head_.load(std::memory_order_acquire) != tail) {
+        return true;
+      }
+      // Read the futex word BEFORE re-checking, so that any push_back / kill after the
+      // re-check changes it and the futex wait returns immediately.
+      const uint32_t signal = signal_.load();
+      consumer_waiting_.store(true);
+      if (head_.load() == tail && !kill_.load()) {
+        syscall(SYS_futex, reinterpret_cast<uint32_t*>(&signal_), FUTEX_WAIT_PRIVATE, signal,
+                nullptr, nullptr, 0);
+      }
+      consumer_waiting_.store(false, std::memory_order_relaxed);
+    }
+    return false;
+  }
+
+  bool wait_and_pop_front(T* elem) {
+    return wait_non_empty() && pop_front(elem, 1) == 1;
+  }
+
+  // Wait until the ring is non-empty, and then move ALL the elements out to elems.
+  bool wait_and_pop_all(std::vector<T>* elems) {
+    return wait_non_empty() && pop_all(elems) > 0;
+  }
+
+  size_t size() const {
+    return head_.load(std::memory_order_acquire) - tail_.load(std::memory_order_acquire);
+  }
+  bool empty() const { return size() == 0; }
+  size_t capacity() const { return mask_ + 1; }
+  uint64_t dropped_num() const { return dropped_num_.load(std::memory_order_relaxed); }
+
+ private:
+  void futex_wake() {
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(&signal_), FUTEX_WAKE_PRIVATE, 1,
+            nullptr, nullptr, 0);
+  }
+
+  static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t),
+                "The futex word has to be a plain 32-bit integer");
+  // Producer- and consumer-owned fields are kept on separate cache lines by padding them
+  // kCacheLineSize bytes apart, which holds wherever the ring starts.
+  // [NOTE] Not alignas(64): an over-aligned ring embedded in a heap-allocated object,
+  // e.g., XpSensorMultithread, needs the C++17 aligned new to actually be aligned.
+  static constexpr size_t kCacheLineSize = 64;
+  std::vector<T> buf_;
+  uint32_t mask_;
+  char read_only_pad_[kCacheLineSize];
+  // The indices wrap around at 2^32, which is a multiple of the capacity.
+  std::atomic<uint32_t> head_;  // written by the producer
+  uint32_t tail_cache_ = 0;     // the producer's last seen tail_
+  char producer_pad_[kCacheLineSize - sizeof(std::atomic<uint32_t>) - sizeof(uint32_t)];
+  std::atomic<uint32_t> tail_;  // written by the consumer
+  char consumer_pad_[kCacheLineSize - sizeof(std::atomic<uint32_t>)];
+  std::atomic<uint32_t> signal_;  // the futex word, bumped to wake up the consumer
+  std::atomic<bool> consumer_waiting_;
+  std::atomic<bool> kill_;
+  std::atomic<uint64_t> dropped_num_;
+};
+}  // namespace XPDRIVER
+#endif  // INCLUDE_DRIVER_HELPER_SPSC_RING_H_
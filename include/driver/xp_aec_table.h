@@ -14,189 +14,52 @@
  * limitations under the License.
  *****************************************************************************/
 
-/*
- * [NOTE] This file is automatically generated by exposure_table.py
- * Do NOT modify this file directly!
- */
 #ifndef INCLUDE_DRIVER_XP_AEC_TABLE_H_
 #define INCLUDE_DRIVER_XP_AEC_TABLE_H_
 
+#include <cstdint>
+
 namespace XPDRIVER {
 namespace XP_SENSOR {
 
-const uint32_t kAEC_steps = 168;
-// Each row in kAEC_LUT is [gain_reg_val, exp_reg_val]
-const int16_t kAEC_LUT[168][2] = {
-  {16, 1},
-  {16, 2},
-  {16, 3},
-  {16, 4},
-  {16, 5},
-  {16, 6},
-  {16, 7},
-  {16, 8},
-  {16, 9},
-  {16, 10},
-  {16, 11},
-  {16, 12},
-  {16, 13},
-  {16, 14},
-  {16, 15},
-  {17, 15},
-  {17, 16},
-  {17, 17},
-  {17, 18},
-  {17, 19},
-  {17, 20},
-  {17, 21},
-  {17, 22},
-  {17, 23},
-  {17, 24},
-  {17, 25},
-  {17, 26},
-  {17, 27},
-  {17, 28},
-  {17, 29},
-  {17, 30},
-  {17, 31},
-  {18, 31},
-  {18, 32},
-  {18, 33},
-  {18, 34},
-  {18, 36},
-  {18, 38},
-  {18, 40},
-  {18, 42},
-  {18, 44},
-  {18, 46},
-  {18, 48},
-  {18, 50},
-  {18, 52},
-  {18, 54},
-  {18, 56},
-  {18, 58},
-  {18, 60},
-  {18, 62},
-  {19, 62},
-  {19, 64},
-  {19, 66},
-  {19, 68},
-  {19, 71},
-  {19, 74},
-  {19, 77},
-  {19, 80},
-  {19, 83},
-  {19, 86},
-  {19, 89},
-  {19, 92},
-  {19, 95},
-  {20, 95},
-  {20, 98},
-  {20, 101},
-  {20, 105},
-  {20, 109},
-  {20, 113},
-  {20, 117},
-  {20, 121},
-  {20, 125},
-  {21, 125},
-  {21, 129},
-  {21, 133},
-  {21, 137},
-  {21, 142},
-  {21, 147},
-  {21, 152},
-  {21, 157},
-  {21, 162},
-  {21, 167},
-  {21, 173},
-  {21, 179},
-  {21, 185},
-  {21, 191},
-  {22, 191},
-  {22, 197},
-  {22, 203},
-  {22, 210},
-  {22, 217},
-  {22, 224},
-  {22, 231},
-  {22, 238},
-  {22, 246},
-  {22, 254},
-  {23, 254},
-  {23, 262},
-  {23, 270},
-  {23, 279},
-  {23, 288},
-  {23, 297},
-  {23, 306},
-  {23, 316},
-  {23, 326},
-  {23, 336},
-  {23, 347},
-  {23, 358},
-  {23, 369},
-  {23, 381},
-  {24, 381},
-  {24, 393},
-  {24, 405},
-  {24, 418},
-  {24, 431},
-  {24, 444},
-  {24, 458},
-  {24, 472},
-  {24, 487},
-  {24, 502},
-  {25, 502},
-  {25, 518},
-  {25, 534},
-  {25, 551},
-  {25, 568},
-  {25, 586},
-  {25, 604},
-  {25, 623},
-  {25, 642},
-  {25, 662},
-  {25, 682},
-  {25, 703},
-  {25, 725},
-  {25, 747},
-  {25, 770},
-  {25, 794},
-  {25, 818},
-  {25, 843},
-  {25, 869},
-  {25, 896},
-  {25, 923},
-  {25, 951},
-  {25, 980},
-  {25, 1010},
-  {26, 1010},
-  {27, 1010},
-  {28, 1010},
-  {29, 1010},
-  {30, 1010},
-  {31, 1010},
-  {32, 1010},
-  {33, 1010},
-  {34, 1010},
-  {36, 1010},
-  {38, 1010},
-  {40, 1010},
-  {42, 1010},
-  {44, 1010},
-  {46, 1010},
-  {48, 1010},
-  {50, 1010},
-  {52, 1010},
-  {54, 1010},
-  {56, 1010},
-  {58, 1010},
-  {60, 1010},
-  {62, 1010},
-  {64, 1010}
+// The gain / exposure curves of the AEC tables, which are generated at compile time (see
+// xp_aec_table.cc).  Every table starts from the darkest setting, and gain x exposure strictly
+// increases with the table index.  Gain and exposure never move in opposite directions between
+// two neighbouring entries unless noted otherwise, as the gain register takes effect one frame
+// earlier than the exposure register, which would show up as a one-frame blink.
+enum class AecCurve : int {
+  // ~3% steps with one 1/16 gain step at the end of each exposure segment, then ~3% gain
+  // steps up to 4x.  The table formerly generated by utils/exposure_table.py.
+  DEFAULT = 0,
+  // 3% steps (limited by the exposure resolution at the low end).  Exposure first, then gain.
+  CONSTANT_RATIO = 1,
+  // 16 equal exposure steps per octave of exposure, then 1/16 gain steps
+  CONSTANT_DELTA = 2,
+  // CONSTANT_RATIO that fills the coarse exposure steps at the low end (e.g., 1 -> 2 rows is
+  // 100% brighter) with gain steps, so no step is larger than 1/16 gain (6.25%).
+  // [NOTE] The gain falls back to 1x when the exposure steps up at the low end (exposure < ~32
+  // rows), which may show up as a one-frame dip in brightness.
+  FINE_LOW_END = 3,
+  // FINE_LOW_END with the analog gain capped at 2x for less noise
+  LOW_GAIN = 4,
+};
+constexpr int kAecCurveNum = 5;
+
+// A row of an AEC table
+struct AecEntry {
+  int16_t gain;  // analog gain reg val, 16 = 1x
+  int16_t exp;   // coarse shutter width reg val in rows
 };
 
+struct AecTable {
+  AecCurve curve;
+  uint32_t steps;
+  const AecEntry* lut;  // [steps]
+};
+
+// Lookups are plain array accesses into the compile-time generated tables
+const AecTable& get_aec_table(AecCurve curve);
+
 }  // namespace XP_SENSOR
 }  // namespace XPDRIVER
 
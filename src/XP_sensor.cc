@@ -16,7 +16,6 @@
 // [NOTE] For now, XP sensor only works for Linux
 #include <driver/helper/xp_logging.h>
 #include <driver/XP_sensor.h>
-#include <driver/xp_aec_table.h>
 #include <driver/v4l2.h>
 #include <driver/firmware_config.h>
 #include <stdlib.h>
@@ -38,6 +37,16 @@
 #include <time.h>
 #endif  // __linux__
 #include <iostream>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+#ifdef __ARM_NEON__
+#include <arm_neon.h>
+#elif defined __SSE2__
+#include <emmintrin.h>
+#endif
 
 // Uncomment for quick outdoor setting hack
 // #define OUTDOOR_SETTING
@@ -163,7 +172,7 @@ bool IMU_DataAccess(int fd, XP_20608_data* data_ptr) {
   for (int k = 0; k < 3; k++) {
     data.accel[k] = accel_scale * raw_readings[k + 3] / 32768.f;
   }
-  data.temp = 99.f;
+  data.temp = std::numeric_limits<float>::quiet_NaN();  // not in the IMU burst
   for (int k = 0; k < 3; k++) {
     data.gyro[k] = gyro_scale * raw_readings[k] / 32768.f;
   }
@@ -194,7 +203,31 @@ void error_handle(const std::string ns = "") {
   return;
 }
 
-bool read_register(int fd, int16_t regaddr, int16_t* regval) {
+// The shadow copy of the sensor registers of a device (fd) to skip redundant USB control
+// transfers.  Only the values written or read by the driver are known.
+struct RegisterShadow {
+  // Serialize the access to the image sensor registers of this device.  A read is a
+  // set (address) + get pair, which must not be interleaved with the register access of another
+  // thread, e.g., the sensor control thread.  Guards values and stats.
+  std::mutex mutex;
+  std::unordered_map<int16_t, int16_t> values;
+  // The registers changed by the sensor itself, e.g., exposure / gain under the on-chip AE / AG
+  // (see set_auto_exp_and_gain).  They are never served from or kept in values.
+  std::unordered_set<int16_t> volatile_addrs;
+  RegisterTransferStats stats;
+};
+// [NOTE] The entries are never erased (see reset_register_shadow), so a RegisterShadow& stays
+// valid after register_shadows_mutex is released.  register_shadows_mutex is only held for the
+// lookup, so the (slow) register access of one device never blocks the other devices.
+static std::mutex register_shadows_mutex;
+static std::map<int, RegisterShadow> register_shadows;
+
+static RegisterShadow& get_register_shadow(int fd) {
+  std::lock_guard<std::mutex> lock(register_shadows_mutex);
+  return register_shadows[fd];
+}
+
+static bool read_register_unlocked(int fd, int16_t regaddr, int16_t* regval) {
   uint8_t value[4];
   struct uvc_xu_control_query xu_query;
 
@@ -227,7 +260,7 @@ bool read_register(int fd, int16_t regaddr, int16_t* regval) {
   return true;
 }
 
-bool set_register(int fd, int16_t regaddr, int16_t regval) {
+static bool set_register_unlocked(int fd, int16_t regaddr, int16_t regval) {
   uint8_t value[4];
   struct uvc_xu_control_query xu_query;
   xu_query.unit = 3;  // has to be unit 3
@@ -246,6 +279,101 @@ bool set_register(int fd, int16_t regaddr, int16_t regval) {
   return true;
 }
 
+// shadow.mutex has to be locked
+static bool read_register_shadowed(int fd, RegisterShadow* shadow_ptr, int16_t regaddr,
+                                   int16_t* regval, bool use_shadow) {
+  RegisterShadow& shadow = *shadow_ptr;
+  if (shadow.volatile_addrs.count(regaddr) > 0) {
+    ++shadow.stats.issued_read_num;
+    return read_register_unlocked(fd, regaddr, regval);
+  }
+  auto it = shadow.values.find(regaddr);
+  if (use_shadow && it != shadow.values.end()) {
+    *regval = it->second;
+    ++shadow.stats.elided_read_num;
+    return true;
+  }
+  ++shadow.stats.issued_read_num;
+  if (!read_register_unlocked(fd, regaddr, regval)) {
+    shadow.values.erase(regaddr);
+    return false;
+  }
+  shadow.values[regaddr] = *regval;
+  return true;
+}
+
+// shadow.mutex has to be locked
+static bool set_register_shadowed(int fd, RegisterShadow* shadow_ptr, int16_t regaddr,
+                                  int16_t regval) {
+  RegisterShadow& shadow = *shadow_ptr;
+  if (shadow.volatile_addrs.count(regaddr) > 0) {
+    ++shadow.stats.issued_write_num;
+    return set_register_unlocked(fd, regaddr, regval);
+  }
+  auto it = shadow.values.find(regaddr);
+  if (it != shadow.values.end() && it->second == regval) {
+    ++shadow.stats.elided_write_num;
+    return true;
+  }
+  ++shadow.stats.issued_write_num;
+  if (!set_register_unlocked(fd, regaddr, regval)) {
+    // The register may or may not have been changed
+    shadow.values.erase(regaddr);
+    return false;
+  }
+  shadow.values[regaddr] = regval;
+  return true;
+}
+
+bool read_register(int fd, int16_t regaddr, int16_t* regval, bool use_shadow) {
+  RegisterShadow& shadow = get_register_shadow(fd);
+  std::lock_guard<std::mutex> lock(shadow.mutex);
+  return read_register_shadowed(fd, &shadow, regaddr, regval, use_shadow);
+}
+
+bool set_register(int fd, int16_t regaddr, int16_t regval) {
+  RegisterShadow& shadow = get_register_shadow(fd);
+  std::lock_guard<std::mutex> lock(shadow.mutex);
+  return set_register_shadowed(fd, &shadow, regaddr, regval);
+}
+
+bool set_registers(int fd, const RegisterValue* regs, int num) {
+  XP_CHECK_NOTNULL(regs);
+  RegisterShadow& shadow = get_register_shadow(fd);
+  std::lock_guard<std::mutex> lock(shadow.mutex);
+  bool ok = true;
+  for (int i = 0; i < num; ++i) {
+    ok &= set_register_shadowed(fd, &shadow, regs[i].addr, regs[i].val);
+  }
+  return ok;
+}
+
+bool read_registers(int fd, RegisterValue* regs, int num, bool use_shadow) {
+  XP_CHECK_NOTNULL(regs);
+  RegisterShadow& shadow = get_register_shadow(fd);
+  std::lock_guard<std::mutex> lock(shadow.mutex);
+  bool ok = true;
+  for (int i = 0; i < num; ++i) {
+    ok &= read_register_shadowed(fd, &shadow, regs[i].addr, &regs[i].val, use_shadow);
+  }
+  return ok;
+}
+
+void reset_register_shadow(int fd) {
+  // Clear the entry in place rather than erasing it, as another thread may hold a reference
+  RegisterShadow& shadow = get_register_shadow(fd);
+  std::lock_guard<std::mutex> lock(shadow.mutex);
+  shadow.values.clear();
+  shadow.volatile_addrs.clear();
+  shadow.stats = RegisterTransferStats();
+}
+
+RegisterTransferStats get_register_transfer_stats(int fd) {
+  RegisterShadow& shadow = get_register_shadow(fd);
+  std::lock_guard<std::mutex> lock(shadow.mutex);
+  return shadow.stats;
+}
+
 // control infrared light brightness function of firmware with TLC59116 chip, default is disable.
 // on_Mode: tlc59116 wok on full output of some channel.
 // pwm_Mode: tlc59116 work on pwm mode.
@@ -491,40 +619,46 @@ void read_deviceID(int fd, char* device_id) {
 }
 
 bool set_registers_to_default(int v4l2_dev, SensorType sensor_type, int aec_index,
-                              bool verbose, uint32_t* exp_ptr, uint32_t* gain_ptr) {
-  if (sensor_type == SensorType::XPIRL2) {
-  // TODO(zhoury): add exposure init for XPIRL2
-
-  } else {
-    set_register(v4l2_dev, 0x0B, kAEC_LUT[aec_index][1]);  // COARSE_SHUTTER_WIDTH_TOTAL_CONTEXTA
-    set_register(v4l2_dev, 0x35, kAEC_LUT[aec_index][0]);  // GLOBAL_GAIN_CONTEXTA_REG
-  }
+                              bool verbose, uint32_t* exp_ptr, uint32_t* gain_ptr,
+                              AecCurve aec_curve) {
+  const AecTable& aec_table = get_aec_table(aec_curve);
+  XP_CHECK_GE(aec_index, 0);
+  XP_CHECK_LT(aec_index, aec_table.steps);
+  const AecEntry& aec_entry = aec_table.lut[aec_index];
+  // XPIRL2 shares the exposure / gain registers with the other sensors (see set_aec_index).
+  // Set them for every sensor so the driver always knows the exposure of the first frames.
+  const RegisterValue regs[2] = {
+    {0x0B, aec_entry.exp},   // COARSE_SHUTTER_WIDTH_TOTAL_CONTEXTA
+    {0x35, aec_entry.gain},  // GLOBAL_GAIN_CONTEXTA_REG
+  };
+  set_registers(v4l2_dev, regs, 2);
   // TODO(zhoury): Figure out why we cannot use set_aec_index here.
   // If not set registers in the order above, sometimes the image can be very dark
   if (gain_ptr != nullptr) {
     // convert from [16 - 64] to [0 - 100]
-    int16_t gain_reg_val = kAEC_LUT[aec_index][0];
+    int16_t gain_reg_val = aec_entry.gain;
     uint32_t gain_percentage = 100 * (gain_reg_val - XP_BOARD_MIN_GAIN) /
         (XP_BOARD_MAX_GAIN - XP_BOARD_MIN_GAIN);
     *gain_ptr = gain_percentage;
   }
   if (exp_ptr != nullptr) {
     // convert from [0 - XP_BOARD_MAX_EXP] to [0 - 100]
-    int16_t exp_reg_val = kAEC_LUT[aec_index][1];
+    int16_t exp_reg_val = aec_entry.exp;
     uint32_t exp_percentage = 100 * exp_reg_val / XP_BOARD_MAX_EXP;
     *exp_ptr = exp_percentage;
   }
 
   if (verbose) {
-    int16_t regval;
-    if (read_register(v4l2_dev, 0x06, &regval)) {
-      printf(" current v_blank = %d\n", regval);
-    }
-    if (read_register(v4l2_dev, 0x35, &regval)) {  // GLOBAL_GAIN_CONTEXTA_REG
-      printf(" current gain regval = %d\n", regval);
-    }
-    if (read_register(v4l2_dev, 0x0B, &regval)) {  // COARSE_SHUTTER_WIDTH_TOTAL_CONTEXTA
-      printf(" current exp regval = %d\n", regval);
+    RegisterValue regs[3] = {
+      {0x06, 0},  // V_BLANK
+      {0x35, 0},  // GLOBAL_GAIN_CONTEXTA_REG
+      {0x0B, 0},  // COARSE_SHUTTER_WIDTH_TOTAL_CONTEXTA
+    };
+    // Read back from the sensor rather than the shadow copy
+    if (read_registers(v4l2_dev, regs, 3, false)) {
+      printf(" current v_blank = %d\n", regs[0].val);
+      printf(" current gain regval = %d\n", regs[1].val);
+      printf(" current exp regval = %d\n", regs[2].val);
     }
 
     // V4L2 operation reads from the UVC descriptions, which is only set once by the firmware
@@ -545,14 +679,18 @@ bool set_registers_to_default(int v4l2_dev, SensorType sensor_type, int aec_inde
   return true;
 }
 
-bool set_aec_index(int fd, uint32_t aec_index, bool verbose) {
-  XP_CHECK_GE(aec_index, 0);
-  XP_CHECK_LT(aec_index, kAEC_steps);
+bool set_aec_index(int fd, uint32_t aec_index, bool verbose, AecCurve aec_curve) {
+  const AecTable& aec_table = get_aec_table(aec_curve);
+  XP_CHECK_LT(aec_index, aec_table.steps);
 
-  int16_t gain_reg_val = kAEC_LUT[aec_index][0];
-  int16_t exp_reg_val =  kAEC_LUT[aec_index][1];
-  set_register(fd, 0x0B, exp_reg_val);  // COARSE_SHUTTER_WIDTH_TOTAL_CONTEXTA
-  set_register(fd, 0x35, gain_reg_val);  // GLOBAL_GAIN_CONTEXTA_REG
+  int16_t gain_reg_val = aec_table.lut[aec_index].gain;
+  int16_t exp_reg_val = aec_table.lut[aec_index].exp;
+  // Write exposure and gain as one batch to keep them as close as possible in time
+  const RegisterValue regs[2] = {
+    {0x0B, exp_reg_val},   // COARSE_SHUTTER_WIDTH_TOTAL_CONTEXTA
+    {0x35, gain_reg_val},  // GLOBAL_GAIN_CONTEXTA_REG
+  };
+  set_registers(fd, regs, 2);
   if (verbose) {
     printf("aec index %d, reg val gain = %d  exp = %d\n", aec_index, gain_reg_val, exp_reg_val);
   }
@@ -601,14 +739,28 @@ bool set_gain_percentage(int fd, int16_t val, bool verbose) {
   return true;
 }
 
-/*
 int set_auto_exp_and_gain(int fd, bool ae, bool ag) {
   // not working yet. Need to set more registers
   int16_t ae_s = static_cast<int16_t>(ae);
   int16_t ag_s = static_cast<int16_t>(ag);
-  return set_register(fd, 0xaf, ae_s | (ag_s << 1));
+  RegisterShadow& shadow = get_register_shadow(fd);
+  std::lock_guard<std::mutex> lock(shadow.mutex);
+  // Under AE / AG the sensor changes the exposure / gain by itself, and after AE / AG the
+  // registers keep whatever AE / AG left there.  Either way the shadowed values are stale.
+  shadow.values.erase(0x0B);  // COARSE_SHUTTER_WIDTH_TOTAL_CONTEXTA
+  shadow.values.erase(0x35);  // GLOBAL_GAIN_CONTEXTA_REG
+  if (ae) {
+    shadow.volatile_addrs.insert(0x0B);
+  } else {
+    shadow.volatile_addrs.erase(0x0B);
+  }
+  if (ag) {
+    shadow.volatile_addrs.insert(0x35);
+  } else {
+    shadow.volatile_addrs.erase(0x35);
+  }
+  return set_register_shadowed(fd, &shadow, 0xaf, ae_s | (ag_s << 1));
 }
-*/
 #endif  // __linux__
 OpencvVideoCap::OpencvVideoCap(int vid) {
   cap_.open(vid);  // open the default camera
@@ -775,6 +927,7 @@ bool ImuReader::read(int fd, XP_20608_data* imu_data_ptr) {
     imu_data.gyro[i] *= gyro_scale_;
     imu_data.accel[i] *= accel_scale_;
   }
+  imu_data.temp = std::numeric_limits<float>::quiet_NaN();  // not in the serial line
   uint64_t time_unsign =   static_cast<uint64_t>(buf_[24] << 4 | buf_[25]) << 24
                          | static_cast<uint64_t>(buf_[26] << 4 | buf_[27]) << 16
                          | static_cast<uint64_t>(buf_[28] << 4 | buf_[29]) << 8
@@ -801,7 +954,9 @@ bool ImuReader::read(int fd, XP_20608_data* imu_data_ptr) {
   if (imu_sample_count_for_rate_ > 20) {
     const int time_us = std::chrono::duration_cast<std::chrono::microseconds>(
           std::chrono::steady_clock::now() - imu_sample_start_tp_).count();
-    imu_rate_ = 1000000 / (time_us / imu_sample_count_for_rate_);
+    if (time_us > 0) {
+      imu_rate_ = static_cast<int>(1000000LL * imu_sample_count_for_rate_ / time_us);
+    }
     imu_sample_start_tp_ = std::chrono::steady_clock::now();
     imu_sample_count_for_rate_ = 0;
   }
@@ -819,18 +974,11 @@ bool ImuReader::get_imu_from_img(const uint8_t* data,
     imu_data.gyro[i] *= gyro_scale_;
     imu_data.accel[i] *= accel_scale_;
   }
-  const uint64_t clock_count_with_overflow = get_timestamp_in_img(data);
-  // increment counter
-  ++imu_sample_count_;
-  if (imu_sample_count_ < 10) {
-    XP_LOG_INFO("imu_sample_count_ = " << imu_sample_count_);
-    // skip the first few imu samples
-    // garbage data
+  imu_data.temp = std::numeric_limits<float>::quiet_NaN();  // not in the IMU burst
+  if (count_img_samples(data, 1, 0) > 0) {
     return false;
   }
-  if (first_imu_clock_count_ == 0) {
-    first_imu_clock_count_ = clock_count_with_overflow;
-  }
+  const uint64_t clock_count_with_overflow = get_timestamp_in_img(data);
   if (use_100us) {
     // convert to 100us
     uint64_t time_100us = clock_count_with_overflow * 10;
@@ -839,20 +987,108 @@ bool ImuReader::get_imu_from_img(const uint8_t* data,
     // The clock count is stored in the unit of ms
     imu_data.clock_count = clock_count_with_overflow;
   }
+  return true;
+}
+
+namespace {
+// Decode the gyro and accel of one sample of the burst, i.e., 6 big-endian int16 at data, into
+// float(int16) * k.  k = scale / 32768 is exact, so the result is bit-exact with
+// float(int16) / 32768.f * scale.
+// [NOTE] The SIMD paths load 16 bytes, which is within the 17-byte sample.
+inline void decode_imu_sample(const uint8_t* data,
+                              const float gyro_k,
+                              const float accel_k,
+                              float* gyro,
+                              float* accel) {
+#ifdef __ARM_NEON__
+  // Swap the bytes of each int16, and sign extend lanes 0 - 2 (gyro) and 3 - 5 (accel)
+  const int16x8_t v = vreinterpretq_s16_u8(vrev16q_u8(vld1q_u8(data)));
+  const int32x4_t g = vmovl_s16(vget_low_s16(v));
+  const int32x4_t a = vmovl_s16(vget_low_s16(vextq_s16(v, v, 3)));
+  float g_f[4], a_f[4];
+  vst1q_f32(g_f, vmulq_n_f32(vcvtq_f32_s32(g), gyro_k));
+  vst1q_f32(a_f, vmulq_n_f32(vcvtq_f32_s32(a), accel_k));
+#elif defined __SSE2__
+  // Swap the bytes of each int16, then sign extend by placing each int16 in the high half of
+  // a 32-bit lane and shifting it down arithmetically
+  __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data));
+  v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+  const __m128i g = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+  const __m128i a_v = _mm_srli_si128(v, 6);
+  const __m128i a = _mm_srai_epi32(_mm_unpacklo_epi16(a_v, a_v), 16);
+  float g_f[4], a_f[4];
+  _mm_storeu_ps(g_f, _mm_mul_ps(_mm_cvtepi32_ps(g), _mm_set1_ps(gyro_k)));
+  _mm_storeu_ps(a_f, _mm_mul_ps(_mm_cvtepi32_ps(a), _mm_set1_ps(accel_k)));
+#else
+  float g_f[3], a_f[3];
+  for (int k = 0; k < 3; ++k) {
+    g_f[k] = static_cast<int16_t>((data[k * 2] << 8) | data[k * 2 + 1]) * gyro_k;
+    a_f[k] = static_cast<int16_t>((data[6 + k * 2] << 8) | data[7 + k * 2]) * accel_k;
+  }
+#endif  // __ARM_NEON__
+  for (int k = 0; k < 3; ++k) {
+    gyro[k] = g_f[k];
+    accel[k] = a_f[k];
+  }
+}
+}  // namespace
+
+int ImuReader::get_imu_burst_from_img(const uint8_t* data,
+                                      const int num,
+                                      const int sample_stride,
+                                      XP_20608_data* imu_data) {
+  XP_CHECK_NOTNULL(data);
+  XP_CHECK_NOTNULL(imu_data);
+  const int skip_num = count_img_samples(data, num, sample_stride);
+  const float gyro_k = gyro_scale_ / 32768.f;
+  const float accel_k = accel_scale_ / 32768.f;
+  for (int i = skip_num; i < num; ++i) {
+    const uint8_t* sample = data + i * sample_stride;
+    XP_20608_data& dst = imu_data[i - skip_num];
+    decode_imu_sample(sample, gyro_k, accel_k, dst.gyro, dst.accel);
+    dst.temp = std::numeric_limits<float>::quiet_NaN();  // not in the IMU burst
+    // The clock count is stored in the unit of ms
+    dst.clock_count = get_timestamp_in_img(sample);
+  }
+  return num - skip_num;
+}
+
+int ImuReader::count_img_samples(const uint8_t* data, const int num, const int sample_stride) {
+  // skip the first few imu samples
+  // garbage data
+  int skip_num = 0;
+  while (skip_num < num && imu_sample_count_ < 9) {
+    ++imu_sample_count_;
+    XP_LOG_INFO("imu_sample_count_ = " << imu_sample_count_);
+    ++skip_num;
+  }
+  const int valid_num = num - skip_num;
+  if (valid_num == 0) {
+    return skip_num;
+  }
+  // increment counter
+  imu_sample_count_ += valid_num;
+  if (first_imu_clock_count_ == 0) {
+    first_imu_clock_count_ = get_timestamp_in_img(data + skip_num * sample_stride);
+  }
   if (imu_sample_count_for_rate_ < 0) {
     // init
     imu_sample_start_tp_ = std::chrono::steady_clock::now();
   }
-  ++imu_sample_count_for_rate_;
+  imu_sample_count_for_rate_ += valid_num;
   if (imu_sample_count_for_rate_ > 20) {
     const int time_us = std::chrono::duration_cast<std::chrono::microseconds>(
           std::chrono::steady_clock::now() - imu_sample_start_tp_).count();
-    imu_rate_ = 1000000 / (time_us / imu_sample_count_for_rate_);
+    // The samples of a burst arrive at once, so time_us can be 0
+    if (time_us > 0) {
+      imu_rate_ = static_cast<int>(1000000LL * imu_sample_count_for_rate_ / time_us);
+    }
     imu_sample_start_tp_ = std::chrono::steady_clock::now();
     imu_sample_count_for_rate_ = 0;
   }
-  return true;
+  return skip_num;
 }
+
 bool ImuReader::get_vec3f_from_sensor_data(const uint8_t* data, float* v) {
   for (int xyz = 0; xyz < 3; ++xyz) {
     uint16_t unsigned_v = (data[0 + xyz * 4] << 4 | data[1 + xyz * 4]) << 8
@@ -868,12 +1104,8 @@ bool ImuReader::get_vec3f_from_sensor_data(const uint8_t* data, float* v) {
 }
 bool ImuReader::get_vec3f_from_img_data(const uint8_t* data, float* v) {
   for (int xyz = 0; xyz < 3; ++xyz) {
-    uint16_t unsigned_v = (data[0 + xyz * 2] << 8) | (data[1 + xyz * 2]);
-    int16_t signed_v = static_cast<int16_t>(unsigned_v);
-    if (unsigned_v & 0x8000) {
-       unsigned_v = 65536 - unsigned_v;
-       signed_v = static_cast<int16_t>(unsigned_v) * (-1);
-    }
+    // big-endian two's complement int16
+    const int16_t signed_v = static_cast<int16_t>((data[0 + xyz * 2] << 8) | data[1 + xyz * 2]);
     v[xyz] = static_cast<float>(signed_v) / 32768.f;
   }
   return true;
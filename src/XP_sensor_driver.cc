@@ -17,6 +17,7 @@
 #include <driver/XP_sensor_driver.h>
 #include <driver/v4l2.h>
 #include <driver/helper/timer.h>  // for profiling timer
+#include <driver/helper/imu_decimator.h>
 #include <opencv2/imgproc.hpp>
 #ifdef __linux__
 #include <sys/ioctl.h>
@@ -29,14 +30,37 @@
 #include <fcntl.h>
 #include <unistd.h>
 #endif  // __linux__
+#include <time.h>
+#include <algorithm>
 #include <chrono>
+#include <deque>
 #include <iostream>
 #include <fstream>
 #include <list>
 #include <cassert>
+#ifdef __ARM_NEON__
+#include <arm_neon.h>
+#endif
 
 using std::chrono::steady_clock;
 
+namespace {
+// The host time in Timestamp::host_ns
+int64_t monotonic_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+// Sleep until the CLOCK_MONOTONIC deadline, i.e., without accumulating the wake-up delays
+void sleep_until_monotonic_ns(int64_t deadline_ns) {
+  struct timespec ts;
+  ts.tv_sec = deadline_ns / 1000000000;
+  ts.tv_nsec = deadline_ns % 1000000000;
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) == EINTR) {}
+}
+}  // namespace
+
 namespace XPDRIVER {
 
 #ifdef __linux__  // XP sensor driver only supports Linux for now.
@@ -52,7 +76,12 @@ XpSensorMultithread::XpSensorMultithread(const std::string& sensor_type_str,
     use_auto_gain_(use_auto_gain),
     aec_index_updated_(false),
     aec_index_(100),
+    aec_curve_(XP_SENSOR::AecCurve::DEFAULT),
+    aec_index_curve_(XP_SENSOR::AecCurve::DEFAULT),
     aec_settle_(!use_auto_gain),
+    aec_metering_updated_(false),
+    stereo_aec_mode_(StereoAecMode::LEFT),
+    stereo_aec_left_weight_(0.5f),
     use_auto_infrared_(false),
     infrared_index_updated_(false),
     infrared_index_(100),
@@ -61,6 +90,7 @@ XpSensorMultithread::XpSensorMultithread(const std::string& sensor_type_str,
     wb_mode_str_(wb_mode) {
   pull_imu_rate_ = 0;
   stream_images_rate_ = 0;
+  pool_dropped_frames_ = 0;
 }
 XpSensorMultithread::~XpSensorMultithread() {
   if (is_running_) {
@@ -79,6 +109,9 @@ bool XpSensorMultithread::init(const int aec_index) {
     return false;
   }
 
+  // The registers of a newly opened device are unknown
+  XP_SENSOR::reset_register_shadow(video_sensor_file_id_);
+
   XP_SENSOR::XPSensorSpec XP_sensor_spec;
   if (!XP_SENSOR::get_XP_sensor_spec(video_sensor_file_id_, &XP_sensor_spec)) {
     return false;
@@ -110,22 +143,36 @@ bool XpSensorMultithread::init(const int aec_index) {
   // enable or disable imu embed img funciton of firmware
   XP_SENSOR::xp_imu_embed_img(video_sensor_file_id_, imu_from_image_);
 
+  aec_index_curve_ = aec_curve_;
+  const int aec_steps = XP_SENSOR::get_aec_table(aec_index_curve_).steps;
+  if (aec_index < 0 || aec_index >= aec_steps) {
+    XP_LOG_ERROR("aec_index " << aec_index << " is out of the AEC table");
+    return false;
+  }
   aec_index_ = aec_index;
   constexpr bool verbose = false;  // Do NOT turn verbose on if not using the latest firmware
   XP_SENSOR::set_registers_to_default(video_sensor_file_id_,
                                       sensor_type_,
                                       aec_index_,
-                                      verbose);
+                                      verbose,
+                                      nullptr,
+                                      nullptr,
+                                      aec_index_curve_);
+  const XP_SENSOR::AecEntry& aec_entry =
+      XP_SENSOR::get_aec_table(aec_index_curve_).lut[aec_index_];
+  exposure_tracker_.reset(aec_entry.gain, aec_entry.exp, aec_index_);
   // white balance
-  if (sensor_type_str_ == "XP3"  ||
-      sensor_type_str_ == "FACE" ||
-      sensor_type_str_ == "XPIRL2") {
+  if (is_color()) {
     whiteBalanceCorrector_.reset(new AutoWhiteBalance());
     assert(wb_mode_str_.empty() != true);
     assert(whiteBalanceCorrector_.get() != NULL);
     if (wb_mode_str_ == "auto") {
       // Don't need to do anything in auto white balance mode
       std::cout << "driver works in white balance auto mode" << std::endl;
+    } else if (wb_mode_str_ == "auto_smooth") {
+      // Shared, temporally smoothed coefficients that are only updated every few frames
+      std::cout << "driver works in white balance smoothed auto mode" << std::endl;
+      whiteBalanceCorrector_->setSmoothedAutoWhiteBalanceMode();
     } else if (wb_mode_str_ == "disabled") {
       // disable white balance to get raw image
       std::cout << "driver disable white balance" << std::endl;
@@ -145,9 +192,11 @@ bool XpSensorMultithread::run() {
   }
   is_running_ = true;
   first_imu_clock_count_ = 0;  // TODO(mingyu): verify if we need to reset everytime
+  clock_sync_.reset();  // The sensor times restart from the new first_imu_clock_count_
 
   thread_pool_.push_back(std::thread(&XpSensorMultithread::thread_ioctl_control, this));
   thread_pool_.push_back(std::thread(&XpSensorMultithread::thread_stream_images, this));
+  thread_pool_.push_back(std::thread(&XpSensorMultithread::thread_sensor_control, this));
   if (!imu_from_image_) {
     thread_pool_.push_back(std::thread(&XpSensorMultithread::thread_pull_imu, this));
   }
@@ -160,6 +209,7 @@ bool XpSensorMultithread::stop() {
     return false;
   }
   is_running_ = false;
+  sensor_control_cmd_queue_.kill();  // wake up thread_sensor_control
   for (std::thread& t : thread_pool_) {
     t.join();
   }
@@ -177,6 +227,24 @@ bool XpSensorMultithread::set_image_data_callback(
   return false;
 }
 
+bool XpSensorMultithread::set_image_imu_callback(
+    const XpSensorMultithread::ImageImuCallback& callback) {
+  if (callback) {
+    image_imu_callback_ = callback;
+    return true;
+  }
+  return false;
+}
+
+bool XpSensorMultithread::set_image_metadata_callback(
+    const XpSensorMultithread::ImageMetadataCallback& callback) {
+  if (callback) {
+    image_metadata_callback_ = callback;
+    return true;
+  }
+  return false;
+}
+
 bool XpSensorMultithread::set_IR_data_callback(
     const XpSensorMultithread::ImageDataCallback& callback) {
   if (callback) {
@@ -186,6 +254,29 @@ bool XpSensorMultithread::set_IR_data_callback(
   return false;
 }
 
+bool XpSensorMultithread::set_imu_batch_data_callback(
+    const XpSensorMultithread::ImuBatchDataCallback& callback) {
+  if (callback) {
+    imu_batch_data_callback_ = callback;
+    return true;
+  }
+  return false;
+}
+
+void XpSensorMultithread::deliver_imu_data(const XPDRIVER::ImuData* imu_data, int num) const {
+  if (num == 0) {
+    return;
+  }
+  if (imu_batch_data_callback_ != nullptr) {
+    imu_batch_data_callback_(imu_data, num);
+  }
+  if (imu_data_callback_ != nullptr) {
+    for (int i = 0; i < num; ++i) {
+      imu_data_callback_(imu_data[i]);
+    }
+  }
+}
+
 bool XpSensorMultithread::set_imu_data_callback(
     const XpSensorMultithread::ImuDataCallback& callback) {
   if (callback) {
@@ -195,6 +286,36 @@ bool XpSensorMultithread::set_imu_data_callback(
   return false;
 }
 
+bool XpSensorMultithread::set_image_buffer_pool(const std::shared_ptr<ImageBufferPool>& pool) {
+  if (is_running_ || !pool) {
+    return false;
+  }
+  const ImageBufferLayout& layout = pool->layout();
+  int rows = sensor_resolution_.RowNum;
+  int cols = sensor_resolution_.ColNum;
+  if (sensor_type_ == SensorType::FACE) {
+    std::swap(rows, cols);
+  }
+  const int type = is_color() ? CV_8UC3 : CV_8UC1;
+  if (layout.rows != rows || layout.cols != cols || layout.type != type) {
+    XP_LOG_ERROR("ImageBufferPool layout " << layout.rows << "x" << layout.cols
+                 << " type " << layout.type << " mismatches the sensor output "
+                 << rows << "x" << cols << " type " << type);
+    return false;
+  }
+  image_buffer_pool_ = pool;
+  return true;
+}
+
+bool XpSensorMultithread::set_pooled_image_data_callback(
+    const XpSensorMultithread::PooledImageDataCallback& callback) {
+  if (callback) {
+    pooled_image_data_callback_ = callback;
+    return true;
+  }
+  return false;
+}
+
 void XpSensorMultithread::thread_ioctl_control() {
   // TODO(mingyu): Put back thread param control
   XP_VLOG(1, "======== start thread_ioctl_control");
@@ -223,57 +344,82 @@ void XpSensorMultithread::thread_ioctl_control() {
       v4l2_buffer_cout++;
       continue;
     }
-    raw_sensor_img_mmap_ptr_queue_.push_back(img_data_ptr);
+    // The kernel timestamps the buffer when the transfer completes, which is free of the
+    // scheduling delay of this thread.
+    RawImage raw_img;
+    raw_img.data = img_data_ptr;
+    if ((bufferinfo_.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) == V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC &&
+        (bufferinfo_.timestamp.tv_sec != 0 || bufferinfo_.timestamp.tv_usec != 0)) {
+      raw_img.host_ns = static_cast<int64_t>(bufferinfo_.timestamp.tv_sec) * 1000000000 +
+          static_cast<int64_t>(bufferinfo_.timestamp.tv_usec) * 1000;
+    } else {
+      raw_img.host_ns = monotonic_ns();
+    }
+    raw_sensor_img_mmap_ptr_queue_.push_back(raw_img);
   }
   XP_VLOG(1, "======== terminate thread_ioctl_control raw_sensor_img_mmap_ptr_queue_.size() "
           << raw_sensor_img_mmap_ptr_queue_.size());
 }
 
-void XpSensorMultithread::convert_imu_axes(const XP_20608_data& imu_data,
-                                           const SensorType sensor_type,
-                                           XPDRIVER::ImuData* xp_imu_ptr) const {
-  XPDRIVER::ImuData& xp_imu = *xp_imu_ptr;
+namespace {
+// [NOTE] We have to flip the axes properly to align IMU coordinates with Camera L
+// xp_imu axis k = sign[k] * imu axis src[k], for both accel and gyro
+bool get_imu_axes_map(const SensorType sensor_type, int src[3], float sign[3]) {
   if (sensor_type == SensorType::XP) {
-    xp_imu.accel[0] = imu_data.accel[0];
-    xp_imu.accel[1] = imu_data.accel[1];
-    xp_imu.accel[2] = imu_data.accel[2];
-    xp_imu.ang_v[0] = imu_data.gyro[0] / 180.f * M_PI;
-    xp_imu.ang_v[1] = imu_data.gyro[1] / 180.f * M_PI;
-    xp_imu.ang_v[2] = imu_data.gyro[2] / 180.f * M_PI;
+    src[0] = 0; src[1] = 1; src[2] = 2;
+    sign[0] = 1; sign[1] = 1; sign[2] = 1;
   } else if (sensor_type == SensorType::XP2 ||
              sensor_type == SensorType::XP3) {
-    xp_imu.accel[0] = - imu_data.accel[0];
-    xp_imu.accel[1] = - imu_data.accel[1];
-    xp_imu.accel[2] =   imu_data.accel[2];
-    xp_imu.ang_v[0] = - imu_data.gyro[0] / 180.f * M_PI;
-    xp_imu.ang_v[1] = - imu_data.gyro[1] / 180.f * M_PI;
-    xp_imu.ang_v[2] =   imu_data.gyro[2] / 180.f * M_PI;
+    src[0] = 0; src[1] = 1; src[2] = 2;
+    sign[0] = -1; sign[1] = -1; sign[2] = 1;
   } else if (sensor_type == SensorType::FACE) {
     // TODO(mingyu): Fix the imu axes here
-    xp_imu.accel[0] = - imu_data.accel[0];
-    xp_imu.accel[1] = - imu_data.accel[1];
-    xp_imu.accel[2] =   imu_data.accel[2];
-    xp_imu.ang_v[0] = - imu_data.gyro[0] / 180.f * M_PI;
-    xp_imu.ang_v[1] = - imu_data.gyro[1] / 180.f * M_PI;
-    xp_imu.ang_v[2] =   imu_data.gyro[2] / 180.f * M_PI;
+    src[0] = 0; src[1] = 1; src[2] = 2;
+    sign[0] = -1; sign[1] = -1; sign[2] = 1;
   } else if (sensor_type == SensorType::XPIRL2) {
-    xp_imu.accel[0] = - imu_data.accel[0];
-    xp_imu.accel[1] = - imu_data.accel[2];
-    xp_imu.accel[2] = - imu_data.accel[1];
-    xp_imu.ang_v[0] = - imu_data.gyro[0] / 180.f * M_PI;
-    xp_imu.ang_v[1] = - imu_data.gyro[2] / 180.f * M_PI;
-    xp_imu.ang_v[2] = - imu_data.gyro[1] / 180.f * M_PI;
+    src[0] = 0; src[1] = 2; src[2] = 1;
+    sign[0] = -1; sign[1] = -1; sign[2] = -1;
   } else if (sensor_type == SensorType::XPIRL) {
-    xp_imu.accel[0] = - imu_data.accel[0];
-    xp_imu.accel[1] =   imu_data.accel[1];
-    xp_imu.accel[2] = - imu_data.accel[2];
-    xp_imu.ang_v[0] = - imu_data.gyro[0] / 180.f * M_PI;
-    xp_imu.ang_v[1] =   imu_data.gyro[1] / 180.f * M_PI;
-    xp_imu.ang_v[2] = - imu_data.gyro[2] / 180.f * M_PI;
+    src[0] = 0; src[1] = 1; src[2] = 2;
+    sign[0] = -1; sign[1] = 1; sign[2] = -1;
   } else {
+    return false;
+  }
+  return true;
+}
+}  // namespace
+
+void XpSensorMultithread::convert_imu_axes(const XP_20608_data& imu_data,
+                                           const SensorType sensor_type,
+                                           XPDRIVER::ImuData* xp_imu_ptr) const {
+  convert_imu_axes(&imu_data, 1, sensor_type, xp_imu_ptr);
+}
+
+// The sensor type is resolved once for the whole batch, so the loop has no branches.
+// [NOTE] The sign is applied after the deg -> rad conversion, which is bit-exact with negating
+// the input, as the rounding is symmetric.
+// With a loaded calibration, ImuCorrector does the remap and the correction in one pass.
+void XpSensorMultithread::convert_imu_axes(const XP_20608_data* imu_data,
+                                           const int num,
+                                           const SensorType sensor_type,
+                                           XPDRIVER::ImuData* xp_imu) const {
+  if (imu_corrector_ != nullptr) {
+    imu_corrector_->apply(imu_data, num, xp_imu);
+    return;
+  }
+  int src[3];
+  float sign[3];
+  if (!get_imu_axes_map(sensor_type, src, sign)) {
     XP_LOG_FATAL("Non-supported sensor type");
   }
+  for (int i = 0; i < num; ++i) {
+    for (int k = 0; k < 3; ++k) {
+      xp_imu[i].accel[k] = sign[k] * imu_data[i].accel[src[k]];
+      xp_imu[i].ang_v[k] = sign[k] * static_cast<float>(imu_data[i].gyro[src[k]] / 180.f * M_PI);
+    }
+  }
 }
+
 void XpSensorMultithread::thread_pull_imu() {
   // TODO(mingyu): Put back thread param control
   const float clock_unit_ms = 1;
@@ -281,28 +427,40 @@ void XpSensorMultithread::thread_pull_imu() {
   XP_VLOG(1, "====== start thread_pull_imu ======");
   uint64_t last_clock_count_64 = 0;
   int startup_imu_count = 0;
+  ImuPollScheduler::Config poll_config;
+  poll_config.rate_hz = imu_pull_rate_hz_;
+  ImuPollScheduler poll_scheduler(poll_config);
+  poll_scheduler.start(monotonic_ns());
   while (is_running_) {
     XPDRIVER::ScopedLoopProfilingTimer pull_imu_profiling_timer(
       "XpSensorMultithread::thread_pull_imu", 1);
-    // sleep to get ~100 Hz rate
-    std::this_thread::sleep_for(std::chrono::microseconds(9900));
+    sleep_until_monotonic_ns(poll_scheduler.next_deadline_ns());
+    poll_scheduler.on_wake(monotonic_ns());
 
     XP_20608_data imu_data;
     bool imu_access_ok = (XP_SENSOR::IMU_DataAccess(video_sensor_file_id_, &imu_data));
+    const int64_t arrival_host_ns = monotonic_ns();
     if (imu_access_ok) {
       // when working in IMU pulling mode, the time stamp of the first several IMU is not stable
       // we drop the first 5 IMU frame here.
       if (startup_imu_count < 5) {
         ++startup_imu_count;
+        poll_scheduler.on_failure(arrival_host_ns);
         continue;
       }
       uint64_t clock_count_wo_overflow = counter32To64.convertNewCount32(imu_data.clock_count);
       if (first_imu_clock_count_ == 0) {
         first_imu_clock_count_ = clock_count_wo_overflow;
       }
+      const bool is_new_sample = poll_scheduler.on_sample(
+          static_cast<int64_t>(clock_count_wo_overflow) * kSensorClockUnitNs, arrival_host_ns);
+      {
+        std::lock_guard<std::mutex> lock(imu_pull_stats_mutex_);
+        imu_pull_stats_ = poll_scheduler.stats();
+      }
       if (last_clock_count_64 > 0) {
-        if (last_clock_count_64 == clock_count_wo_overflow) {
-          XP_LOG_WARNING("WARNING: Imu pulling too fast");
+        if (!is_new_sample) {
+          XP_VLOG(1, "Imu polled before the firmware update.  Retry");
           continue;
         }
         // only for debug
@@ -322,8 +480,14 @@ void XpSensorMultithread::thread_pull_imu() {
       XPDRIVER::ImuData xp_imu;
       convert_imu_axes(imu_data, sensor_type_, &xp_imu);
       xp_imu.time_stamp = (clock_count_wo_overflow - first_imu_clock_count_) * clock_unit_ms * 10;
-      if (imu_data_callback_ != nullptr) {
-        imu_data_callback_(xp_imu);
+      xp_imu.ts.sensor_ns = sensor_clock_to_ns(clock_count_wo_overflow);
+      xp_imu.ts.host_ns = arrival_host_ns;
+      if (clock_sync_.is_synced()) {
+        xp_imu.ts.synced_host_ns = clock_sync_.sensor_to_host_ns(xp_imu.ts.sensor_ns);
+      }
+      deliver_imu_data(&xp_imu, 1);
+      if (image_imu_callback_ != nullptr || use_imu_preintegration_) {
+        pulled_imu_ring_.push_back(xp_imu);
       }
 
       ++pull_imu_count_;
@@ -336,6 +500,7 @@ void XpSensorMultithread::thread_pull_imu() {
       }
     } else {
       XP_LOG_ERROR("XPDRIVER::IMU_DataAccess failed");
+      poll_scheduler.on_failure(arrival_host_ns);
     }
   }
   XP_VLOG(1, "========= thread_pull_imu terminated =========");
@@ -362,13 +527,36 @@ void XpSensorMultithread::thread_stream_images() {
   const int imu_data_len = 17;
   // prevent imu data overflow
   Counter32To64 counter32To64_imu(XP_CLOCK_32BIT_MAX_COUNT);
+  // The filter state is carried across the IMU bursts of the frames
+  ImuDecimator imu_decimator(imu_decimation_factor_);
+  // The delivered IMU samples, to cut the interval between two frames for ImageImuCallback
+  // and the preintegration
+  const bool use_imu_history = image_imu_callback_ != nullptr || use_imu_preintegration_;
+  ImuHistory imu_history;
+  int64_t last_frame_sensor_ns = -1;
+  const ImuPreintegrator imu_preintegrator(imu_preintegrator_config_);
+  const int imu_step = (imu_output_mode_ == ImuOutputMode::SUBSAMPLED) ? 5 : 1;
+  // Reused for the IMU burst of every frame
+  std::vector<XP_20608_data> raw_imu_batch;
+  std::vector<XPDRIVER::ImuData> imu_batch;
+  // The legacy image callbacks may keep the images, so they never get the pooled buffers
+  const bool use_legacy_image_callbacks = image_data_callback_ != nullptr ||
+      image_metadata_callback_ != nullptr || image_imu_callback_ != nullptr;
+  // The pool exhaustion is logged at most once per kPoolDropLogPeriodMs
+  constexpr int kPoolDropLogPeriodMs = 1000;
+  steady_clock::time_point last_pool_drop_log_tp;
+  uint64_t logged_pool_dropped_frames = 0;
+  // Whether it has been logged that the auto infrared PWM is enabled but cannot run
+  bool logged_infrared_pwm_idle = false;
   while (is_running_) {
     XPDRIVER::ScopedLoopProfilingTimer loopProfilingTimer(
       "XpSensorMultithread::thread_stream_images", 1);
-    uint8_t* img_data_ptr = nullptr;
-    if (!raw_sensor_img_mmap_ptr_queue_.wait_and_pop_front(&img_data_ptr)) {
+    RawImage raw_img;
+    if (!raw_sensor_img_mmap_ptr_queue_.wait_and_pop_front(&raw_img)) {
       break;
     }
+    uint8_t* img_data_ptr = raw_img.data;
+    const int64_t arrival_host_ns = raw_img.host_ns;
     ++frame_counter;
 #ifdef __ARM_NEON__
     // since arm platform is buggy, signal the user that at least
@@ -396,30 +584,53 @@ void XpSensorMultithread::thread_stream_images() {
         imu_burst_data_pos = imu_burst_data_pos + imu_data_len + 4;
       }
       pull_imu_count_ += imu_num;  // Will calculate the effective imu rate w/ image rate
-      XP_20608_data imu_data;  // read IMU encoded in
-      constexpr bool use_100us = false;
-      for (int imu_i = 0; imu_i < imu_num; imu_i += 5) {
-        if (imu_reader.get_imu_from_img(imu_burst_data_pos + imu_i * imu_data_len, &imu_data,
-                                        use_100us)) {
-          if (first_imu_clock_count_ == 0) {
-            first_imu_clock_count_ = imu_reader.first_imu_clock_count();
-            XP_VLOG(1, "Setting first_imu_clock_count_ " << first_imu_clock_count_);
-          }
-          // TODO(mingyu): the timestamp / clock count is so messy here...
-          // Need to UNIFY
-          uint64_t clock_count_wo_overflow =
-              counter32To64_imu.convertNewCount32(imu_data.clock_count);
-
-          XPDRIVER::ImuData xp_imu;
-          convert_imu_axes(imu_data, sensor_type_, &xp_imu);
-          // The XP clock unit is ms.  1 ms = 10 100us
-          xp_imu.time_stamp = (clock_count_wo_overflow - first_imu_clock_count_) * 10;  // in 100us
-
-          if (imu_data_callback_ != nullptr) {
-            imu_data_callback_(xp_imu);
+      // Decode the whole burst in one pass
+      const int read_imu_num = (imu_num + imu_step - 1) / imu_step;
+      raw_imu_batch.resize(read_imu_num);
+      raw_imu_batch.resize(imu_reader.get_imu_burst_from_img(imu_burst_data_pos, read_imu_num,
+                                                             imu_step * imu_data_len,
+                                                             raw_imu_batch.data()));
+      if (first_imu_clock_count_ == 0 && !raw_imu_batch.empty()) {
+        first_imu_clock_count_ = imu_reader.first_imu_clock_count();
+        XP_VLOG(1, "Setting first_imu_clock_count_ " << first_imu_clock_count_);
+      }
+      // TODO(mingyu): the timestamp / clock count is so messy here...
+      // Need to UNIFY
+      for (XP_20608_data& imu_data : raw_imu_batch) {
+        imu_data.clock_count = counter32To64_imu.convertNewCount32(imu_data.clock_count);
+      }
+
+      // Convert the whole burst in one loop
+      const int raw_imu_num = raw_imu_batch.size();
+      imu_batch.resize(raw_imu_num);
+      convert_imu_axes(raw_imu_batch.data(), raw_imu_num, sensor_type_, imu_batch.data());
+      for (int i = 0; i < raw_imu_num; ++i) {
+        // The XP clock unit is ms.  1 ms = 10 100us
+        imu_batch[i].time_stamp =
+            (raw_imu_batch[i].clock_count - first_imu_clock_count_) * 10;  // in 100us
+        // All the samples of the burst are received with the image
+        imu_batch[i].ts.sensor_ns = sensor_clock_to_ns(raw_imu_batch[i].clock_count);
+        imu_batch[i].ts.host_ns = arrival_host_ns;
+      }
+      if (clock_sync_.is_synced()) {
+        for (int i = 0; i < raw_imu_num; ++i) {
+          imu_batch[i].ts.synced_host_ns = clock_sync_.sensor_to_host_ns(imu_batch[i].ts.sensor_ns);
+        }
+      }
+      int imu_batch_num = raw_imu_num;
+      if (imu_output_mode_ == ImuOutputMode::DECIMATED && imu_num > 1) {
+        // Decimate in place.  The input sample is consumed before the output is written.
+        imu_batch_num = 0;
+        for (int i = 0; i < raw_imu_num; ++i) {
+          if (imu_decimator.push(imu_batch[i], &imu_batch[imu_batch_num])) {
+            ++imu_batch_num;
           }
         }
       }
+      deliver_imu_data(imu_batch.data(), imu_batch_num);
+      if (use_imu_history) {
+        imu_history.push(imu_batch.data(), imu_batch_num);
+      }
     }
 
     // Start receiving image once we have received the first imu (for correct clock offset)
@@ -456,19 +667,85 @@ void XpSensorMultithread::thread_stream_images() {
     if (img_time_sec < 0) {
       continue;
     }
+    FrameMetadata metadata;
+    metadata.ts.sensor_ns = sensor_clock_to_ns(clock_count_wo_overflow);
+    metadata.ts.host_ns = arrival_host_ns;
+    clock_sync_.add_sample(metadata.ts.sensor_ns, metadata.ts.host_ns);
+    if (clock_sync_.is_synced()) {
+      metadata.ts.synced_host_ns = clock_sync_.sensor_to_host_ns(metadata.ts.sensor_ns);
+    }
+    // The gain / exposure that this frame was exposed with
+    metadata.exposure = exposure_tracker_.on_frame(clock_count_wo_overflow * 1000,
+                                                   arrival_host_ns / 1000);
+    const ExposureMetadata& exposure = metadata.exposure;
 
     // Get stereo images
     // [NOTE] The returned cv::Mat is CV_8UC1 if the sensor is mono-color,
     //        and CV_8UC3 if the sensor is color
+    // Decode into a buffer pair of the application if one is free
+    ImageBufferPool::StereoImagePtr pooled_img;
     cv::Mat img_l, img_r;
     cv::Mat img_l_IR, img_r_IR;
+    if (image_buffer_pool_ && pooled_image_data_callback_) {
+      pooled_img = image_buffer_pool_->acquire();
+      if (pooled_img) {
+        img_l = pooled_img->l;
+        img_r = pooled_img->r;
+      } else {
+        ++pool_dropped_frames_;
+        const steady_clock::time_point now_tp = steady_clock::now();
+        if (now_tp - last_pool_drop_log_tp >=
+            std::chrono::milliseconds(kPoolDropLogPeriodMs)) {
+          XP_LOG_WARNING("No free buffer in ImageBufferPool.  Dropped the pooled output of "
+                         << pool_dropped_frames_ - logged_pool_dropped_frames << " frames");
+          last_pool_drop_log_tp = now_tp;
+          logged_pool_dropped_frames = pool_dropped_frames_;
+        }
+      }
+    }
     get_images_from_raw_data(img_data_ptr, &img_l, &img_r, &img_l_IR, &img_r_IR);
+    if (pooled_img && (img_l.data != pooled_img->l.data || img_r.data != pooled_img->r.data)) {
+      // Should not happen as the layout is checked in set_image_buffer_pool
+      XP_LOG_ERROR("Decoding is not done in the pooled buffers");
+      pooled_img.reset();
+    }
 
-    // Control brightness with user input aec_index or aec (adjust every 5 frames)
-    if (use_auto_gain_ && frame_counter % 5 == 3) {
+    // Switch the AEC table while keeping the brightness
+    const XP_SENSOR::AecCurve aec_curve = aec_curve_;
+    if (aec_curve != aec_index_curve_) {
+      const float gain_x_exp = AecController::gain_x_exp(
+          XP_SENSOR::get_aec_table(aec_index_curve_), aec_index_);
+      aec_index_ = AecController::find_index(XP_SENSOR::get_aec_table(aec_curve), gain_x_exp);
+      aec_index_curve_ = aec_curve;
+      aec_index_updated_ = true;
+    }
+
+    // Control brightness with user input aec_index or aec
+    // [NOTE] AEC reads the raw data directly, so it doesn't depend on the output images.
+    if (use_auto_gain_ && use_model_based_aec_) {
+      // The model-based controller runs every frame and handles the frame delay by itself
+      if (aec_controller_.aec_index() != aec_index_ ||
+          aec_controller_.aec_curve() != aec_index_curve_) {
+        // aec_index_ has been changed outside of the controller, e.g., in manual mode
+        aec_controller_.reset(aec_index_, aec_index_curve_);
+      }
+      int new_aec_index = aec_index_;
+      if (compute_aec_stats_from_raw_data(img_data_ptr, &aec_stats_)) {
+        if (aec_controller_.update(aec_stats_, &new_aec_index)) {
+          aec_index_ = new_aec_index;
+          aec_index_updated_ = true;
+        } else if (aec_controller_.settled() && !aec_settle_) {
+          aec_settle_ = true;
+        }
+      } else {
+        XP_LOG_ERROR("compute_aec_stats_from_raw_data fails");
+      }
+    } else if (use_auto_gain_ && frame_counter % 5 == 3) {
+      // The legacy heuristic (adjust every 5 frames)
       int new_aec_index = aec_index_;
-      // [NOTE] Color image is converted to gray inside computeNewAecTableIndex
-      if (XPDRIVER::computeNewAecTableIndex(img_l, aec_settle_, &new_aec_index)) {
+      if (compute_aec_stats_from_raw_data(img_data_ptr, &aec_stats_) &&
+          XPDRIVER::computeNewAecTableIndex(aec_stats_, aec_settle_, &new_aec_index,
+                                            aec_index_curve_)) {
         if (new_aec_index != aec_index_) {
           aec_index_ = new_aec_index;
           aec_index_updated_ = true;
@@ -484,20 +761,47 @@ void XpSensorMultithread::thread_stream_images() {
       }
     }
 
+    // Control the infrared PWM jointly with AEC
+    if (use_auto_infrared_pwm_ && (!use_auto_infrared_ || sensor_type_ != SensorType::XPIRL2)) {
+      if (!logged_infrared_pwm_idle) {
+        XP_LOG_WARNING("auto infrared PWM is enabled but does nothing: "
+                       << (sensor_type_ != SensorType::XPIRL2 ?
+                           "only XPIRL2 is supported" : "the infrared light is off"));
+        logged_infrared_pwm_idle = true;
+      }
+    } else if (use_auto_infrared_pwm_) {
+      logged_infrared_pwm_idle = false;
+      if (infrared_controller_.pwm() != infrared_index_) {
+        // infrared_index_ has been changed outside of the controller, e.g., in manual mode
+        infrared_controller_.reset(infrared_index_);
+      }
+      const XP_SENSOR::AecEntry& aec_entry =
+          XP_SENSOR::get_aec_table(aec_index_curve_).lut[aec_index_];
+      // Fall back to the current AEC entry if the exposure of this frame is unknown
+      const float frame_gain_x_exp = (exposure.gain_reg_val > 0) ?
+          static_cast<float>(exposure.gain_reg_val) * exposure.exp_reg_val :
+          static_cast<float>(aec_entry.gain) * aec_entry.exp;
+      const float aec_gain_x_exp = static_cast<float>(aec_entry.gain) * aec_entry.exp;
+      int new_infrared_index = infrared_index_;
+      if (compute_infrared_stats_from_raw_data(img_data_ptr, &infrared_stats_) &&
+          infrared_controller_.update(infrared_stats_, frame_gain_x_exp, aec_gain_x_exp,
+                                      &new_infrared_index)) {
+        infrared_index_ = new_infrared_index;
+        infrared_index_updated_ = true;
+      }
+    }
+
+    // Hand the register writes over to thread_sensor_control.  Never block here.
     if (aec_index_updated_) {
       aec_index_updated_ = false;  // reset
-      const bool verbose = !use_auto_gain_;
-      XP_SENSOR::set_aec_index(video_sensor_file_id_, aec_index_, verbose);
+      sensor_control_cmd_queue_.push_back(
+          {SensorControlCommand::AEC, aec_index_, steady_clock::now(), aec_index_curve_});
     }
     if (infrared_index_updated_) {
       infrared_index_updated_ = false;  // reset
-      if (infrared_index_ != 0) {
-        // don't set channel value, firmware can choose default channel
-        XP_SENSOR::xp_infrared_ctl(video_sensor_file_id_, XP_SENSOR::pwm, 0, infrared_index_);
-      } else {
-        // close infrared light
-        XP_SENSOR::xp_infrared_ctl(video_sensor_file_id_, XP_SENSOR::off, 0, 0);
-      }
+      sensor_control_cmd_queue_.push_back(
+          {SensorControlCommand::INFRARED, infrared_index_, steady_clock::now(),
+           aec_index_curve_});
     }
 
     // Start to output images only if
@@ -519,10 +823,43 @@ void XpSensorMultithread::thread_stream_images() {
     // so that we can have IMU measurements queued up before the first image.
     if (img_time_sec <  0.05) continue;
 
+    // The IMU samples since the previous frame
+    ImuInterval imu_interval;
+    if (use_imu_history) {
+      XPDRIVER::ImuData pulled_imu;
+      while (pulled_imu_ring_.pop_front(&pulled_imu, 1) == 1) {
+        imu_history.push(pulled_imu);
+      }
+      const int64_t t0_ns =
+          last_frame_sensor_ns < 0 ? metadata.ts.sensor_ns : last_frame_sensor_ns;
+      imu_history.query(t0_ns, metadata.ts.sensor_ns, &imu_interval);
+      last_frame_sensor_ns = metadata.ts.sensor_ns;
+      if (use_imu_preintegration_) {
+        imu_preintegrator.integrate(imu_interval, &metadata.imu_preintegration);
+      }
+    }
+
     const float time_100us = img_time_sec * 10000;
+    if (pooled_img) {
+      // The pooled buffers are reused once the callee of the pooled output releases them, so
+      // the legacy callbacks get driver-owned copies, taken before the callee can modify them
+      if (use_legacy_image_callbacks) {
+        img_l = pooled_img->l.clone();
+        img_r = pooled_img->r.clone();
+      }
+      pooled_img->exposure = exposure;
+      pooled_img->ts = metadata.ts;
+      pooled_image_data_callback_(pooled_img, time_100us);
+    }
     if (image_data_callback_ != nullptr) {
       image_data_callback_(img_l, img_r, time_100us);
     }
+    if (image_metadata_callback_ != nullptr) {
+      image_metadata_callback_(img_l, img_r, metadata);
+    }
+    if (image_imu_callback_ != nullptr) {
+      image_imu_callback_(img_l, img_r, metadata, imu_interval);
+    }
 
     if (IR_data_callback_ != nullptr && sensor_type_ == SensorType::XPIRL2) {
       IR_data_callback_(img_l_IR, img_r_IR, time_100us);
@@ -555,6 +892,74 @@ void XpSensorMultithread::thread_stream_images() {
   XP_VLOG(1, "======== terminate thread_stream_images");
 }
 
+void XpSensorMultithread::thread_sensor_control() {
+  XP_VLOG(1, "======== start thread_sensor_control thread");
+  std::deque<SensorControlCommand> cmds;
+  float latency_ms_sum = 0;
+  float transfer_ms_sum = 0;
+  while (is_running_) {
+    if (!sensor_control_cmd_queue_.wait_and_pop_all(&cmds)) {
+      break;
+    }
+    // Coalesce: only keep the latest command of each type
+    const SensorControlCommand* latest_cmds[2] = {nullptr, nullptr};
+    for (const SensorControlCommand& cmd : cmds) {
+      latest_cmds[cmd.type] = &cmd;
+    }
+    int applied_num = 0;
+    float max_latency_ms = 0;
+    for (const SensorControlCommand* cmd : latest_cmds) {
+      if (cmd == nullptr) {
+        continue;
+      }
+      const auto transfer_start_ts = steady_clock::now();
+      if (cmd->type == SensorControlCommand::AEC) {
+        const bool verbose = !use_auto_gain_;
+        XP_SENSOR::set_aec_index(video_sensor_file_id_, cmd->value, verbose, cmd->aec_curve);
+        const XP_SENSOR::AecEntry& aec_entry =
+            XP_SENSOR::get_aec_table(cmd->aec_curve).lut[cmd->value];
+        exposure_tracker_.on_registers_written(monotonic_ns() / 1000,
+                                               aec_entry.gain, aec_entry.exp, cmd->value);
+      } else if (cmd->value != 0) {
+        // don't set channel value, firmware can choose default channel
+        XP_SENSOR::xp_infrared_ctl(video_sensor_file_id_, XP_SENSOR::pwm, 0, cmd->value);
+      } else {
+        // close infrared light
+        XP_SENSOR::xp_infrared_ctl(video_sensor_file_id_, XP_SENSOR::off, 0, 0);
+      }
+      const auto done_ts = steady_clock::now();
+      const float transfer_ms = std::chrono::duration_cast<std::chrono::microseconds>(
+          done_ts - transfer_start_ts).count() * 1e-3f;
+      const float latency_ms = std::chrono::duration_cast<std::chrono::microseconds>(
+          done_ts - cmd->post_time).count() * 1e-3f;
+      XP_VLOG(1, "sensor control cmd " << cmd->type << " value " << cmd->value
+              << " latency " << latency_ms << " ms transfer " << transfer_ms << " ms");
+      latency_ms_sum += latency_ms;
+      transfer_ms_sum += transfer_ms;
+      max_latency_ms = std::max(max_latency_ms, latency_ms);
+      ++applied_num;
+    }
+
+    std::lock_guard<std::mutex> lock(sensor_control_stats_mutex_);
+    SensorControlStats& stats = sensor_control_stats_;
+    stats.applied_num += applied_num;
+    stats.coalesced_num += cmds.size() - applied_num;
+    stats.max_latency_ms = std::max(stats.max_latency_ms, max_latency_ms);
+    stats.avg_latency_ms = latency_ms_sum / stats.applied_num;
+    stats.avg_transfer_ms = transfer_ms_sum / stats.applied_num;
+  }
+  XP_VLOG(1, "======== terminate thread_sensor_control");
+}
+
+XP_SENSOR::RegisterTransferStats XpSensorMultithread::get_register_transfer_stats() const {
+  return XP_SENSOR::get_register_transfer_stats(video_sensor_file_id_);
+}
+
+XpSensorMultithread::SensorControlStats XpSensorMultithread::get_sensor_control_stats() const {
+  std::lock_guard<std::mutex> lock(sensor_control_stats_mutex_);
+  return sensor_control_stats_;
+}
+
 bool XpSensorMultithread::set_auto_gain(const bool use_aec) {
   use_auto_gain_ = use_aec;
   return true;
@@ -564,11 +969,49 @@ bool XpSensorMultithread::set_aec_index(const int aec_index) {
   if (use_auto_gain_) {
     return false;
   }
+  const int aec_steps = XP_SENSOR::get_aec_table(aec_curve_).steps;
+  if (aec_index < 0 || aec_index >= aec_steps) {
+    return false;
+  }
   aec_index_ = aec_index;
   aec_index_updated_ = true;
   return true;
 }
 
+bool XpSensorMultithread::set_aec_curve(const XP_SENSOR::AecCurve aec_curve) {
+  aec_curve_ = aec_curve;
+  return true;
+}
+
+bool XpSensorMultithread::set_model_based_aec(const bool use_model_based_aec) {
+  use_model_based_aec_ = use_model_based_aec;
+  return true;
+}
+
+bool XpSensorMultithread::set_stereo_aec_mode(const StereoAecMode mode, const float left_weight) {
+  if (left_weight < 0.f || left_weight > 1.f) {
+    return false;
+  }
+  stereo_aec_left_weight_ = left_weight;
+  stereo_aec_mode_ = mode;
+  return true;
+}
+
+bool XpSensorMultithread::set_aec_metering(const cv::Rect& roi,
+                                           int weight_map_rows,
+                                           int weight_map_cols,
+                                           const std::vector<float>& weights) {
+  BrightnessMetering metering;
+  metering.set_roi(roi);
+  if (!metering.set_weight_map(weight_map_rows, weight_map_cols, weights)) {
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(aec_metering_mutex_);
+  new_aec_metering_ = metering;
+  aec_metering_updated_ = true;
+  return true;
+}
+
 bool XpSensorMultithread::set_auto_infrared(const bool use_infrared) {
   use_auto_infrared_ = use_infrared;
   return true;
@@ -583,6 +1026,81 @@ bool XpSensorMultithread::set_infrared_index(const int infrared_index) {
   return true;
 }
 
+bool XpSensorMultithread::set_auto_infrared_pwm(const bool use_auto_pwm) {
+  use_auto_infrared_pwm_ = use_auto_pwm;
+  return true;
+}
+
+bool XpSensorMultithread::set_imu_output_mode(const ImuOutputMode mode,
+                                              const int decimated_rate_hz) {
+  if (is_running_) {
+    XP_LOG_ERROR("set_imu_output_mode has to be called before run()");
+    return false;
+  }
+  constexpr int kEmbeddedImuRateHz = 500;
+  if (mode == ImuOutputMode::DECIMATED) {
+    if (decimated_rate_hz <= 0 || decimated_rate_hz > kEmbeddedImuRateHz) {
+      return false;
+    }
+    imu_decimation_factor_ =
+        (kEmbeddedImuRateHz + decimated_rate_hz / 2) / decimated_rate_hz;
+  }
+  imu_output_mode_ = mode;
+  return true;
+}
+
+bool XpSensorMultithread::set_imu_pull_rate(const int rate_hz) {
+  if (is_running_) {
+    XP_LOG_ERROR("set_imu_pull_rate has to be called before run()");
+    return false;
+  }
+  if (rate_hz <= 0 || rate_hz > 1000) {
+    return false;
+  }
+  imu_pull_rate_hz_ = rate_hz;
+  return true;
+}
+
+ImuPollScheduler::Stats XpSensorMultithread::get_imu_pull_stats() const {
+  std::lock_guard<std::mutex> lock(imu_pull_stats_mutex_);
+  return imu_pull_stats_;
+}
+
+bool XpSensorMultithread::set_imu_preintegration(const bool enable,
+                                                 const ImuPreintegrator::Config& config) {
+  if (is_running_) {
+    XP_LOG_ERROR("set_imu_preintegration has to be called before run()");
+    return false;
+  }
+  use_imu_preintegration_ = enable;
+  imu_preintegrator_config_ = config;
+  return true;
+}
+
+bool XpSensorMultithread::load_imu_calibration(const std::string& calib_file) {
+  if (is_running_) {
+    XP_LOG_ERROR("load_imu_calibration has to be called before run()");
+    return false;
+  }
+  if (sensor_device_id_.empty()) {
+    XP_LOG_ERROR("load_imu_calibration has to be called after init()");
+    return false;
+  }
+  ImuCalibration calib;
+  if (!XPDRIVER::load_imu_calibration(calib_file, sensor_device_id_, &calib)) {
+    return false;
+  }
+  int src[3];
+  float sign[3];
+  if (!get_imu_axes_map(sensor_type_, src, sign)) {
+    XP_LOG_ERROR("Non-supported sensor type");
+    return false;
+  }
+  imu_corrector_.reset(new ImuCorrector(calib, src, sign));
+  XP_LOG_INFO("Loaded imu calibration of device " << sensor_device_id_ << " from " << calib_file);
+  return true;
+}
+
 bool XpSensorMultithread::get_sensor_deviceid(std::string* device_id) {
   *device_id = sensor_device_id_;
   return true;
@@ -607,13 +1125,10 @@ bool XpSensorMultithread::is_color() const {
 bool XpSensorMultithread::get_v024_img_from_raw_data(const uint8_t* img_data_ptr,
                                                        cv::Mat* img_l_ptr,
                                                        cv::Mat* img_r_ptr) {
-  const int row_num = sensor_resolution_.RowNum;
-  const int col_num = sensor_resolution_.ColNum;
   int xp_shift_num = 0;
-
   zero_col_shift_detect(img_data_ptr, &xp_shift_num);
   handle_col_shift_case(const_cast<uint8_t*>(img_data_ptr), xp_shift_num);
-  sensor_MT9V_image_separate(img_data_ptr, img_l_ptr, img_r_ptr);
+  return sensor_MT9V_image_separate(img_data_ptr, img_l_ptr, img_r_ptr);
 }
 
 // handle XP3 FACE color sensor image from raw data
@@ -630,94 +1145,284 @@ bool XpSensorMultithread::get_v034_img_from_raw_data(const uint8_t* img_data_ptr
   handle_col_shift_case(const_cast<uint8_t*>(img_data_ptr), xp_shift_num);
   sensor_MT9V_image_separate(img_data_ptr, &img_l_mono, &img_r_mono);
 
-  cv::Mat img_l_color(row_num, col_num, CV_8UC3);
-  cv::Mat img_r_color(row_num, col_num, CV_8UC3);
-  cv::cvtColor(img_l_mono, img_l_color, cv::COLOR_BayerGR2BGR);
-  cv::cvtColor(img_r_mono, img_r_color, cv::COLOR_BayerGR2BGR);
-
-  whiteBalanceCorrector_->run(&img_l_color);
-  whiteBalanceCorrector_->run(&img_r_color);
   // FACE is basically XP3 with a special orientation configuration
   if (sensor_type_ == SensorType::FACE) {
+    cv::Mat img_l_color(row_num, col_num, CV_8UC3);
+    cv::Mat img_r_color(row_num, col_num, CV_8UC3);
+    cv::cvtColor(img_l_mono, img_l_color, cv::COLOR_BayerGR2BGR);
+    cv::cvtColor(img_r_mono, img_r_color, cv::COLOR_BayerGR2BGR);
+    whiteBalanceCorrector_->run(&img_l_color, &img_r_color);
     // TODO(mingyu): Figure out the flip / transpose used here
-    cv::transpose(img_l_color, img_l_color);
-    cv::flip(img_l_color, img_l_color, 1);
-    cv::transpose(img_r_color, img_r_color);
-    cv::flip(img_r_color, img_r_color, 0);
-    *img_r_ptr = img_l_color;
-    *img_l_ptr = img_r_color;
+    // [NOTE] The left and right eyes are swapped.  transpose writes into the output buffers
+    // directly, and flip is done in place.
+    cv::transpose(img_l_color, *img_r_ptr);
+    cv::flip(*img_r_ptr, *img_r_ptr, 1);
+    cv::transpose(img_r_color, *img_l_ptr);
+    cv::flip(*img_l_ptr, *img_l_ptr, 0);
   } else {
-    *img_l_ptr = img_l_color;
-    *img_r_ptr = img_r_color;
+    // Demosaic into the output buffers directly.  cvtColor only allocates if *img_l_ptr /
+    // *img_r_ptr do not have the right size and type yet.
+    cv::cvtColor(img_l_mono, *img_l_ptr, cv::COLOR_BayerGR2BGR);
+    cv::cvtColor(img_r_mono, *img_r_ptr, cv::COLOR_BayerGR2BGR);
+    whiteBalanceCorrector_->run(img_l_ptr, img_r_ptr);
+  }
+  return true;
+}
+
+// [NOTE] XPIRL2 raw data is an RGB-IR mosaic.  Each 2x2 cell is
+//   IR R
+//   B  G
+// The IR sites are moved to the quarter-resolution IR images and replaced by the average of
+// the 4 diagonal G sites, so that the mosaic can be demosaiced as a regular GB Bayer image.
+// The statistics for white balance are collected from the R / G / B sites only (IR excluded),
+// and the gains are applied through LUTs in the same loop, so white balance costs no extra
+// pass over the full image.
+void XpSensorMultithread::sample_XPIRL2_bayer_RGB_mean(const uint8_t* img_data_ptr,
+                                                       uint32_t* b_mean_ptr,
+                                                       uint32_t* g_mean_ptr,
+                                                       uint32_t* r_mean_ptr) const {
+  const int row_num = sensor_resolution_.RowNum;
+  const int col_num = sensor_resolution_.ColNum;
+  // Sample one 2x2 cell every kCellStep rows / cols from both eyes.
+  // The left and right eyes are interleaved in the byte lanes.
+  constexpr int kCellStep = 8;
+  uint32_t b_mean = 0, g_mean = 0, r_mean = 0;
+  for (int i = 0; i + 1 < row_num; i += kCellStep) {
+    const uint8_t* row_0 = img_data_ptr + i * col_num * 2;  // IR R IR R ...
+    const uint8_t* row_1 = row_0 + col_num * 2;             // B  G B  G ...
+    for (int j = 0; j + 1 < col_num; j += kCellStep) {
+      r_mean += row_0[(j + 1) * 2] + row_0[(j + 1) * 2 + 1];
+      b_mean += row_1[j * 2] + row_1[j * 2 + 1];
+      g_mean += row_1[(j + 1) * 2] + row_1[(j + 1) * 2 + 1];
+    }
   }
+  *b_mean_ptr = b_mean;
+  *g_mean_ptr = g_mean;
+  *r_mean_ptr = r_mean;
 }
 
+#ifdef __ARM_NEON__
+namespace {
+// Decode the interior cells of an IR R row of the XPIRL2 mosaic (see below) 16 cells at a time,
+// starting from col 2.  Same as the scalar loop: the IR sites are copied to the IR rows, and
+// replaced by the average of the 4 diagonal G sites, and the gain LUTs are applied.
+// Return the col from which the scalar loop continues.
+// [NOTE] The loads read up to col j + 33 of the rows above / below, and col_num - 2 is a
+// border cell, hence j + 34 <= col_num.
+int decode_XPIRL2_IR_row_neon(const uint8_t* raw_row,
+                              const int raw_row_step,
+                              const int col_num,
+                              const uint8_t* lut_g,
+                              const uint8_t* lut_r,
+                              uint8_t* l_mono_row,
+                              uint8_t* r_mono_row,
+                              uint8_t* l_IR_row,
+                              uint8_t* r_IR_row) {
+  const uint8_t* raw_row_above = raw_row - raw_row_step;
+  const uint8_t* raw_row_below = raw_row + raw_row_step;
+  uint8_t g[2][16], r[2][16];  // [eye][cell]
+  int j = 2;
+  for (; j + 34 <= col_num; j += 32) {
+    // val[0 / 1]: IR of the left / right eye, val[2 / 3]: R
+    const uint8x16x4_t cur = vld4q_u8(raw_row + j * 2);
+    // val[0 / 1]: G of the left / right eye at col j - 1 and j + 1
+    const uint8x16x4_t above_0 = vld4q_u8(raw_row_above + (j - 1) * 2);
+    const uint8x16x4_t above_1 = vld4q_u8(raw_row_above + (j + 1) * 2);
+    const uint8x16x4_t below_0 = vld4q_u8(raw_row_below + (j - 1) * 2);
+    const uint8x16x4_t below_1 = vld4q_u8(raw_row_below + (j + 1) * 2);
+    vst1q_u8(l_IR_row + (j >> 1), cur.val[0]);
+    vst1q_u8(r_IR_row + (j >> 1), cur.val[1]);
+    for (int eye = 0; eye < 2; ++eye) {
+      const uint16x8_t sum_lo = vaddq_u16(
+          vaddl_u8(vget_low_u8(above_0.val[eye]), vget_low_u8(above_1.val[eye])),
+          vaddl_u8(vget_low_u8(below_0.val[eye]), vget_low_u8(below_1.val[eye])));
+      const uint16x8_t sum_hi = vaddq_u16(
+          vaddl_u8(vget_high_u8(above_0.val[eye]), vget_high_u8(above_1.val[eye])),
+          vaddl_u8(vget_high_u8(below_0.val[eye]), vget_high_u8(below_1.val[eye])));
+      vst1q_u8(g[eye], vcombine_u8(vshrn_n_u16(sum_lo, 2), vshrn_n_u16(sum_hi, 2)));
+      vst1q_u8(r[eye], cur.val[2 + eye]);
+    }
+    // [NOTE] The LUTs are 256-entry gathers, which NEON has no instruction for
+    for (int k = 0; k < 16; ++k) {
+      l_mono_row[j + k * 2] = lut_g[g[0][k]];
+      r_mono_row[j + k * 2] = lut_g[g[1][k]];
+      l_mono_row[j + k * 2 + 1] = lut_r[r[0][k]];
+      r_mono_row[j + k * 2 + 1] = lut_r[r[1][k]];
+    }
+  }
+  return j;
+}
+}  // namespace
+#endif  // __ARM_NEON__
+
 bool XpSensorMultithread::get_XPIRL2_img_from_raw_data(const uint8_t* img_data_ptr,
                                                        cv::Mat* img_l_ptr,
                                                        cv::Mat* img_r_ptr,
                                                        cv::Mat* img_l_IR_ptr,
                                                        cv::Mat* img_r_IR_ptr) {
+  // [NOTE] The per-frame budget of the whole XPIRL2 decoding (IR separation, white balance and
+  // demosaic of both eyes).  White balance adds a sparse statistics pass (every frame in
+  // "auto" mode, every few frames in "auto_smooth" mode) and a table lookup per pixel.
+  constexpr int kDecodeBudgetUs = 15000;
+  XPDRIVER::MicrosecondTimer decode_timer("get_XPIRL2_img_from_raw_data", 1);
   const int row_num = sensor_resolution_.RowNum;
   const int col_num = sensor_resolution_.ColNum;
   cv::Mat img_l_mono(row_num, col_num, CV_8UC1);
   cv::Mat img_r_mono(row_num, col_num, CV_8UC1);
   cv::Mat img_l_IR(row_num / 2 , col_num / 2, CV_8UC1);
   cv::Mat img_r_IR(row_num / 2 , col_num / 2, CV_8UC1);
-  // THis function run slowly and need 65~85ms if we open auto-whitebalance
-#ifndef __ARM_NEON__
   int xp_shift_num = 0;
-
   zero_col_shift_detect(img_data_ptr, &xp_shift_num);
   handle_col_shift_case(const_cast<uint8_t*>(img_data_ptr), xp_shift_num);
+
+  // White balance gains in the channel order of the BGR output image
+  if (whiteBalanceCorrector_->needStatistics()) {
+    uint32_t b_mean = 0, g_mean = 0, r_mean = 0;
+    sample_XPIRL2_bayer_RGB_mean(img_data_ptr, &b_mean, &g_mean, &r_mean);
+    // AutoWhiteBalance names the 1st channel of the CV_8UC3 image r, which is B in BGR.
+    whiteBalanceCorrector_->updateCoefficientsFromRGBMean(b_mean, g_mean, r_mean);
+  }
+  const uint8_t* lut_b = whiteBalanceCorrector_->getGainLut(0);
+  const uint8_t* lut_g = whiteBalanceCorrector_->getGainLut(1);
+  const uint8_t* lut_r = whiteBalanceCorrector_->getGainLut(2);
+
+  const int raw_row_step = col_num * 2;
   for (int i = 0; i < row_num; ++i) {
-    for (int j = 0; j < col_num; ++j) {
-      if (i % 2 == 0 && j % 2 == 0) {
-        img_l_IR.at<uint8_t>(i >> 1, j >> 1) =
-            img_data_ptr[i * col_num * 2 + j * 2    ];
-        img_r_IR.at<uint8_t>(i >> 1, j >> 1) =
-            img_data_ptr[i * col_num* 2 + j* 2 + 1];
-        if (i == 0 || j == 0 || i == row_num - 2 || j == col_num - 2) {
-          img_l_mono.at<uint8_t>(i, j) =
-              img_data_ptr[i * col_num * 2 + j * 2    ];
-          img_r_mono.at<uint8_t>(i, j) =
-              img_data_ptr[i * col_num * 2 + j * 2 + 1];
-        } else {
-          img_l_mono.at<uint8_t>(i, j) = (
-            img_data_ptr[(i - 1) * col_num * 2 + (j - 1) * 2] +
-            img_data_ptr[(i - 1) * col_num * 2 + (j + 1) * 2] +
-            img_data_ptr[(i + 1) * col_num * 2 + (j - 1) * 2] +
-            img_data_ptr[(i + 1) * col_num * 2 + (j + 1) * 2]) / 4;
-          img_r_mono.at<uint8_t>(i, j) = (
-              img_data_ptr[(i - 1) * col_num * 2 + (j - 1) * 2 + 1] +
-              img_data_ptr[(i - 1) * col_num * 2 + (j + 1) * 2 + 1] +
-              img_data_ptr[(i + 1) * col_num * 2 + (j - 1) * 2 + 1] +
-              img_data_ptr[(i + 1) * col_num * 2 + (j + 1) * 2 + 1]) / 4;
-        }
+    const uint8_t* raw_row = img_data_ptr + i * raw_row_step;
+    uint8_t* l_mono_row = img_l_mono.ptr(i);
+    uint8_t* r_mono_row = img_r_mono.ptr(i);
+    if (i % 2 == 1) {
+      // B G B G ...
+      for (int j = 0; j < col_num; j += 2) {
+        l_mono_row[j] = lut_b[raw_row[j * 2]];
+        r_mono_row[j] = lut_b[raw_row[j * 2 + 1]];
+        l_mono_row[j + 1] = lut_g[raw_row[j * 2 + 2]];
+        r_mono_row[j + 1] = lut_g[raw_row[j * 2 + 3]];
+      }
+      continue;
+    }
+    // IR R IR R ...
+    uint8_t* l_IR_row = img_l_IR.ptr(i >> 1);
+    uint8_t* r_IR_row = img_r_IR.ptr(i >> 1);
+    const bool border_row = (i == 0 || i == row_num - 2);
+    const uint8_t* raw_row_above = raw_row - raw_row_step;
+    const uint8_t* raw_row_below = raw_row + raw_row_step;
+    for (int j = 0; j < col_num; j += 2) {
+#ifdef __ARM_NEON__
+      if (j == 2 && !border_row) {
+        j = decode_XPIRL2_IR_row_neon(raw_row, raw_row_step, col_num, lut_g, lut_r,
+                                      l_mono_row, r_mono_row, l_IR_row, r_IR_row);
+      }
+#endif  // __ARM_NEON__
+      l_IR_row[j >> 1] = raw_row[j * 2];
+      r_IR_row[j >> 1] = raw_row[j * 2 + 1];
+      if (border_row || j == 0 || j == col_num - 2) {
+        l_mono_row[j] = lut_g[raw_row[j * 2]];
+        r_mono_row[j] = lut_g[raw_row[j * 2 + 1]];
       } else {
-        img_l_mono.at<uint8_t>(i, j) =
-            img_data_ptr[i * col_num * 2 + j * 2    ];
-        img_r_mono.at<uint8_t>(i, j) =
-            img_data_ptr[i * col_num * 2 + j * 2 + 1];
+        l_mono_row[j] = lut_g[(raw_row_above[(j - 1) * 2] + raw_row_above[(j + 1) * 2] +
+                               raw_row_below[(j - 1) * 2] + raw_row_below[(j + 1) * 2]) / 4];
+        r_mono_row[j] = lut_g[(raw_row_above[(j - 1) * 2 + 1] +
+                               raw_row_above[(j + 1) * 2 + 1] +
+                               raw_row_below[(j - 1) * 2 + 1] +
+                               raw_row_below[(j + 1) * 2 + 1]) / 4];
       }
+      l_mono_row[j + 1] = lut_r[raw_row[j * 2 + 2]];
+      r_mono_row[j + 1] = lut_r[raw_row[j * 2 + 3]];
     }
   }
-#else
-  // TODO(yanghongtian): need add neon for XPIRL2
 
-#endif
-
-  cv::Mat img_l_color(row_num, col_num, CV_8UC3);
-  cv::Mat img_r_color(row_num, col_num, CV_8UC3);
-
-  cv::cvtColor(img_l_mono, img_l_color, cv::COLOR_BayerGB2BGR);
-  cv::cvtColor(img_r_mono, img_r_color, cv::COLOR_BayerGB2BGR);
-  // White balance need 20ms, So we need close it
-  // whiteBalanceCorrector_->run(&img_l_color);
-  // whiteBalanceCorrector_->run(&img_r_color);
+  cv::cvtColor(img_l_mono, *img_l_ptr, cv::COLOR_BayerGB2BGR);
+  cv::cvtColor(img_r_mono, *img_r_ptr, cv::COLOR_BayerGB2BGR);
   *img_l_IR_ptr = img_l_IR;
   *img_r_IR_ptr = img_r_IR;
-  *img_l_ptr = img_l_color;
-  *img_r_ptr = img_r_color;
+
+  // Log the frames over budget at most once per kDecodeBudgetLogPeriodMs
+  constexpr int kDecodeBudgetLogPeriodMs = 1000;
+  const int decode_us = decode_timer.end();
+  if (decode_us > kDecodeBudgetUs) {
+    ++decode_over_budget_num_;
+    const steady_clock::time_point now_tp = steady_clock::now();
+    if (now_tp - last_decode_over_budget_log_tp_ >=
+        std::chrono::milliseconds(kDecodeBudgetLogPeriodMs)) {
+      XP_LOG_WARNING("get_XPIRL2_img_from_raw_data takes " << decode_us << " us > budget "
+                     << kDecodeBudgetUs << " us.  " << decode_over_budget_num_
+                     << " frames over budget since the last warning");
+      last_decode_over_budget_log_tp_ = now_tp;
+      decode_over_budget_num_ = 0;
+    }
+  }
+  return true;
+}
+
+// [NOTE] The IR sites of the RGB-IR mosaic are (even row, even col), i.e., the pixels of the
+// quarter-resolution IR image, which are sampled straight from the raw data.
+// Call it AFTER get_images_from_raw_data, which fixes the column shift in place.
+bool XpSensorMultithread::compute_infrared_stats_from_raw_data(const uint8_t* img_data_ptr,
+                                                               BrightnessStats* stats) const {
+  const int row_num = sensor_resolution_.RowNum;
+  const int col_num = sensor_resolution_.ColNum;
+  const size_t row_step = col_num * 2;
+  constexpr int kPixelStride = 2;  // two eyes interleaved
+  return computeBrightnessStats(img_data_ptr, row_num, col_num, row_step, kPixelStride, stats);
+}
+
+// [NOTE] The brightness is estimated from the eye that is output as img_l:
+//   mono sensors: the raw pixels
+//   XP3 / FACE:   the G sites of the GR Bayer mosaic, i.e., (even row, even col)
+//   XPIRL2:       the G sites of the RGB-IR mosaic, i.e., (odd row, odd col)
+// G is the closest single channel to the luminance, and it is available without
+// demosaicing.  The sampling of computeBrightnessStats starts at an even row / col and steps
+// by 2, so the plane just needs to start at the right phase.
+// [NOTE] Call it AFTER get_images_from_raw_data, which fixes the column shift in place.
+bool XpSensorMultithread::compute_aec_stats_from_raw_data(const uint8_t* img_data_ptr,
+                                                          BrightnessStats* stats) {
+  const int row_num = sensor_resolution_.RowNum;
+  const int col_num = sensor_resolution_.ColNum;
+  const size_t row_step = col_num * 2;
+  constexpr int kPixelStride = 2;  // two eyes interleaved
+  const StereoAecMode stereo_aec_mode = stereo_aec_mode_;
+  // FACE swaps the left and right eyes
+  const bool swap_eyes = (sensor_type_ == SensorType::FACE);
+  const uint8_t* plane_ptr = img_data_ptr;
+  if (swap_eyes && stereo_aec_mode == StereoAecMode::LEFT) {
+    plane_ptr += 1;
+  }
+  int rows = row_num;
+  int cols = col_num;
+  if (sensor_type_ == SensorType::XPIRL2) {
+    plane_ptr += row_step + kPixelStride;
+    rows -= 1;
+    cols -= 1;
+  }
+  if (aec_metering_updated_) {
+    std::lock_guard<std::mutex> lock(aec_metering_mutex_);
+    aec_metering_ = new_aec_metering_;
+    aec_metering_updated_ = false;
+  }
+  // Only prepare once (or once per change), so metering costs nothing per frame
+  if (!aec_metering_.is_prepared_for(rows, cols) && !aec_metering_.prepare(rows, cols)) {
+    XP_LOG_ERROR("Invalid AEC metering.  Fall back to the default one");
+    aec_metering_ = BrightnessMetering();
+    XP_CHECK(aec_metering_.prepare(rows, cols));
+  }
+  if (stereo_aec_mode == StereoAecMode::LEFT) {
+    return computeBrightnessStats(plane_ptr, rows, cols, row_step, kPixelStride, stats,
+                                  &aec_metering_);
+  }
+  // [NOTE] The left eye of computeStereoBrightnessStats is the raw left eye
+  const float raw_left_weight = stereo_aec_left_weight_;
+  const float left_weight = swap_eyes ? 1.f - raw_left_weight : raw_left_weight;
+  if (!computeStereoBrightnessStats(plane_ptr, rows, cols, row_step, stereo_aec_mode,
+                                    left_weight, &aec_stereo_stats_, &aec_metering_)) {
+    return false;
+  }
+  std::copy(aec_stereo_stats_.joint.histogram, aec_stereo_stats_.joint.histogram + 256,
+            stats->histogram);
+  stats->pixel_num = aec_stereo_stats_.joint.pixel_num;
+  stats->avg_pixel_val = aec_stereo_stats_.joint.avg_pixel_val;
+  stats->adjusted_pixel_val = aec_stereo_stats_.joint.adjusted_pixel_val;
+  return true;
 }
 
 bool XpSensorMultithread::get_images_from_raw_data(const uint8_t* img_data_ptr,
@@ -804,31 +1509,29 @@ bool XpSensorMultithread::sensor_MT9V_image_separate(const uint8_t* img_data_ptr
                                                      cv::Mat* img_r_ptr) {
   const int row_num = sensor_resolution_.RowNum;
   const int col_num = sensor_resolution_.ColNum;
-  cv::Mat img_l_mono(row_num, col_num, CV_8UC1);
-  cv::Mat img_r_mono(row_num, col_num, CV_8UC1);
+  // [NOTE] No-op if the output images are already of the right size and type, e.g., buffers
+  // from ImageBufferPool.  The rows of the output images are NOT necessarily continuous.
+  img_l_ptr->create(row_num, col_num, CV_8UC1);
+  img_r_ptr->create(row_num, col_num, CV_8UC1);
 
-  const int total_size = row_num * col_num * 2;
-  uint8_t* l_row_ptr = img_l_mono.ptr();
-  uint8_t* r_row_ptr = img_r_mono.ptr();
-  const uint8_t* ptr_to_raw_image_data = img_data_ptr;
-#ifndef __ARM_NEON__
-  for (int i = 0; i < total_size; i += 2) {
-    *l_row_ptr = ptr_to_raw_image_data[i];
-    *r_row_ptr = ptr_to_raw_image_data[i + 1];
-    l_row_ptr++;
-    r_row_ptr++;
-  }
-#else
-  for (int i = 0; i < total_size; i += 16) {
-    uint8x8x2_t data = vld2_u8(ptr_to_raw_image_data + i);
-    vst1_u8(l_row_ptr, data.val[0]);
-    vst1_u8(r_row_ptr, data.val[1]);
-    l_row_ptr += 8;
-    r_row_ptr += 8;
-  }
+  for (int r = 0; r < row_num; ++r) {
+    const uint8_t* ptr_to_raw_image_data = img_data_ptr + r * col_num * 2;
+    uint8_t* l_row_ptr = img_l_ptr->ptr(r);
+    uint8_t* r_row_ptr = img_r_ptr->ptr(r);
+    int c = 0;
+#ifdef __ARM_NEON__
+    for (; c + 8 <= col_num; c += 8) {
+      uint8x8x2_t data = vld2_u8(ptr_to_raw_image_data + c * 2);
+      vst1_u8(l_row_ptr + c, data.val[0]);
+      vst1_u8(r_row_ptr + c, data.val[1]);
+    }
 #endif
-  *img_l_ptr = img_l_mono;
-  *img_r_ptr = img_r_mono;
+    for (; c < col_num; ++c) {
+      l_row_ptr[c] = ptr_to_raw_image_data[c * 2];
+      r_row_ptr[c] = ptr_to_raw_image_data[c * 2 + 1];
+    }
+  }
+  return true;
 }
 
 void XpSensorMultithread::handle_col_shift_case(uint8_t* img_data_ptr, int col_shift) {
@@ -0,0 +1,128 @@
+/******************************************************************************
+ * Copyright 2017-2018 Baidu Robotic Vision Authors. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *****************************************************************************/
+
+#include <driver/helper/aec_controller.h>
+#include <driver/helper/xp_logging.h>
+#include <algorithm>
+#include <cmath>
+
+namespace XPDRIVER {
+
+using XP_SENSOR::AecCurve;
+using XP_SENSOR::AecTable;
+
+AecController::AecController() : AecController(Config()) {}
+
+AecController::AecController(const Config& config) :
+    config_(config),
+    aec_table_(&XP_SENSOR::get_aec_table(AecCurve::DEFAULT)),
+    aec_index_(0),
+    frames_since_update_(0),
+    settled_(false) {
+  XP_CHECK_GE(config_.frame_delay, 0);
+  XP_CHECK_GT(config_.target_brightness, 0);
+}
+
+void AecController::reset(int aec_index, AecCurve aec_curve) {
+  aec_table_ = &XP_SENSOR::get_aec_table(aec_curve);
+  XP_CHECK_LT(aec_index, aec_table_->steps);
+  XP_CHECK_GE(aec_index, 0);
+  aec_index_ = aec_index;
+  frames_since_update_ = 0;
+  settled_ = false;
+}
+
+float AecController::gain_x_exp(const AecTable& table, int aec_index) {
+  return static_cast<float>(table.lut[aec_index].gain) * table.lut[aec_index].exp;
+}
+
+int AecController::find_index(const AecTable& table, float gain_x_exp) {
+  // [NOTE] gain x exposure strictly increases with the index of every AEC table
+  const int steps = table.steps;
+  int hi = 0;
+  while (hi < steps && AecController::gain_x_exp(table, hi) < gain_x_exp) {
+    ++hi;
+  }
+  if (hi == 0) {
+    return 0;
+  }
+  if (hi == steps) {
+    return steps - 1;
+  }
+  // Pick the closer one of hi - 1 and hi in log scale
+  const float ratio_lo = gain_x_exp / AecController::gain_x_exp(table, hi - 1);
+  const float ratio_hi = AecController::gain_x_exp(table, hi) / gain_x_exp;
+  return (ratio_lo < ratio_hi) ? hi - 1 : hi;
+}
+
+bool AecController::update(const BrightnessStats& stats, int* aec_index_ptr) {
+  XP_CHECK_NOTNULL(aec_index_ptr);
+  // Wait for the last change to show up in the images
+  if (frames_since_update_ < config_.frame_delay) {
+    ++frames_since_update_;
+    return false;
+  }
+  if (stats.pixel_num == 0) {
+    return false;
+  }
+
+  // [NOTE] Saturated pixels under-report the brightness, so the linear model under-estimates
+  // how much to darken.  Cut gain x exposure harder if many pixels are saturated.
+  constexpr int kSaturatedPixelVal = 253;
+  constexpr float kHeavySaturationRatio = 0.5f;
+  constexpr float kMaxRatio = 16.f;
+  int saturated_num = 0;
+  for (int i = kSaturatedPixelVal; i < 256; ++i) {
+    saturated_num += stats.histogram[i];
+  }
+  const float saturated_ratio = static_cast<float>(saturated_num) / stats.pixel_num;
+  const float brightness = std::max(stats.adjusted_pixel_val, 1);
+  float ratio = config_.target_brightness / brightness;
+  if (saturated_ratio > kHeavySaturationRatio) {
+    ratio = std::min(ratio, 1.f / kMaxRatio);
+  }
+  ratio = std::min(std::max(ratio, 1.f / kMaxRatio), kMaxRatio);
+
+  float log_error = std::log(ratio);
+  settled_ = std::fabs(ratio - 1.f) < config_.deadband_ratio;
+  if (settled_) {
+    return false;
+  }
+  // Only damp near the target, where the noise of the measurement matters
+  if (std::fabs(ratio - 1.f) < config_.damping_zone_ratio) {
+    log_error *= config_.damping;
+  }
+  const float new_gain_x_exp = gain_x_exp(*aec_table_, aec_index_) * std::exp(log_error);
+  int new_index = find_index(*aec_table_, new_gain_x_exp);
+  if (new_index == aec_index_) {
+    // The damped step is below the table resolution.  Move one step to make progress.
+    new_index += (log_error > 0) ? 1 : -1;
+  }
+  new_index = std::min(std::max(new_index, config_.lowest_index),
+                       static_cast<int>(aec_table_->steps) - 1);
+  if (new_index == aec_index_) {
+    // Already at the end of the table
+    return false;
+  }
+  XP_VLOG(1, "AecController brightness " << brightness << " sat_ratio " << saturated_ratio
+          << " aec_index " << aec_index_ << " -> " << new_index);
+  aec_index_ = new_index;
+  frames_since_update_ = 0;
+  *aec_index_ptr = new_index;
+  return true;
+}
+
+}  // namespace XPDRIVER
@@ -16,10 +16,13 @@
 
 #include <driver/helper/xp_logging.h>
 #include <driver/helper/basic_image_utils.h>
-#include <driver/xp_aec_table.h>
 #include <opencv2/imgproc.hpp>
 #include <opencv2/highgui.hpp>
+#include <algorithm>
 #include <iostream>
+#if !defined(__ARM_NEON__) && defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #ifndef __DEVELOPMENT_DEBUG_MODE__
 #define __IMAGE_UTILS_NO_DEBUG__
@@ -31,6 +34,7 @@ namespace XPDRIVER {
 constexpr int kMarginRow = 50;
 constexpr int kMarginCol = 100;
 constexpr int kPixelStep = 2;
+constexpr int kGridSize = 10;
 
 // Compute the histogram of a sampled area of the input image and return the number of
 // sampled pixels
@@ -71,7 +75,6 @@ void gridBrightDarkAdjustBrightness(const cv::Mat& raw_img,
   constexpr float kDarkRegionWeight = 0.75f;
 
   // Grid settings
-  constexpr int kGridSize = 10;
   constexpr int kPixelsPerGrid = kGridSize * kGridSize / kPixelStep / kPixelStep;
 
   const int grid_rows = (raw_img.rows - 2 * kMarginRow) / kGridSize;
@@ -106,17 +109,438 @@ void gridBrightDarkAdjustBrightness(const cv::Mat& raw_img,
   *adjusted_pixel_val_ptr = adjusted_pixel_val / (grid_rows * grid_cols);
 }
 
+// Gather num samples that are sample_stride bytes apart into dst
+inline void gatherSamples(const uint8_t* src, int sample_stride, int num, uint8_t* dst) {
+  int k = 0;
+#ifdef __ARM_NEON__
+  if (sample_stride == 2) {
+    for (; k + 16 <= num; k += 16) {
+      vst1q_u8(dst + k, vld2q_u8(src + k * 2).val[0]);
+    }
+  } else if (sample_stride == 4) {
+    for (; k + 16 <= num; k += 16) {
+      vst1q_u8(dst + k, vld4q_u8(src + k * 4).val[0]);
+    }
+  }
+#elif defined __SSE2__
+  // [NOTE] The loads may read up to sample_stride - 1 bytes after the last sample, which is
+  // always within the image given the margins.
+  if (sample_stride == 2) {
+    const __m128i mask = _mm_set1_epi16(0x00ff);
+    for (; k + 16 <= num; k += 16) {
+      const __m128i* ptr = reinterpret_cast<const __m128i*>(src + k * 2);
+      __m128i a = _mm_and_si128(_mm_loadu_si128(ptr), mask);
+      __m128i b = _mm_and_si128(_mm_loadu_si128(ptr + 1), mask);
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + k), _mm_packus_epi16(a, b));
+    }
+  } else if (sample_stride == 4) {
+    const __m128i mask = _mm_set1_epi32(0x000000ff);
+    for (; k + 16 <= num; k += 16) {
+      const __m128i* ptr = reinterpret_cast<const __m128i*>(src + k * 4);
+      __m128i a = _mm_and_si128(_mm_loadu_si128(ptr), mask);
+      __m128i b = _mm_and_si128(_mm_loadu_si128(ptr + 1), mask);
+      __m128i c = _mm_and_si128(_mm_loadu_si128(ptr + 2), mask);
+      __m128i d = _mm_and_si128(_mm_loadu_si128(ptr + 3), mask);
+      __m128i ab = _mm_packs_epi32(a, b);
+      __m128i cd = _mm_packs_epi32(c, d);
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + k), _mm_packus_epi16(ab, cd));
+    }
+  }
+#endif
+  for (; k < num; ++k) {
+    dst[k] = src[k * sample_stride];
+  }
+}
+
+// Gather num samples of BOTH eyes from the interleaved raw data with one load, where the
+// samples of an eye are 4 bytes apart, i.e., every other pixel of the eye
+inline void gatherStereoSamples(const uint8_t* src, int num, uint8_t* dst_l, uint8_t* dst_r) {
+  int k = 0;
+#ifdef __ARM_NEON__
+  for (; k + 16 <= num; k += 16) {
+    uint8x16x4_t data = vld4q_u8(src + k * 4);
+    vst1q_u8(dst_l + k, data.val[0]);
+    vst1q_u8(dst_r + k, data.val[1]);
+  }
+#elif defined __SSE2__
+  const __m128i mask = _mm_set1_epi32(0x000000ff);
+  for (; k + 16 <= num; k += 16) {
+    const __m128i* ptr = reinterpret_cast<const __m128i*>(src + k * 4);
+    __m128i a = _mm_loadu_si128(ptr);
+    __m128i b = _mm_loadu_si128(ptr + 1);
+    __m128i c = _mm_loadu_si128(ptr + 2);
+    __m128i d = _mm_loadu_si128(ptr + 3);
+    __m128i l_ab = _mm_packs_epi32(_mm_and_si128(a, mask), _mm_and_si128(b, mask));
+    __m128i l_cd = _mm_packs_epi32(_mm_and_si128(c, mask), _mm_and_si128(d, mask));
+    __m128i r_ab = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(a, 8), mask),
+                                   _mm_and_si128(_mm_srli_epi32(b, 8), mask));
+    __m128i r_cd = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(c, 8), mask),
+                                   _mm_and_si128(_mm_srli_epi32(d, 8), mask));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst_l + k), _mm_packus_epi16(l_ab, l_cd));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst_r + k), _mm_packus_epi16(r_ab, r_cd));
+  }
+#endif
+  for (; k < num; ++k) {
+    dst_l[k] = src[k * 4];
+    dst_r[k] = src[k * 4 + 1];
+  }
+}
+
+constexpr float BrightnessMetering::kMaxWeight;
+constexpr int BrightnessMetering::kWeightOne;
+
+void BrightnessMetering::set_roi(const cv::Rect& roi) {
+  roi_ = roi;
+  prepared_rows_ = -1;
+  prepared_cols_ = -1;
+}
+
+bool BrightnessMetering::set_weight_map(int map_rows,
+                                        int map_cols,
+                                        const std::vector<float>& weights) {
+  if (map_rows < 0 || map_cols < 0 || weights.size() != map_rows * map_cols) {
+    XP_LOG_ERROR("set_weight_map: " << weights.size() << " weights for a "
+                 << map_rows << "x" << map_cols << " map");
+    return false;
+  }
+  map_rows_ = map_rows;
+  map_cols_ = map_cols;
+  weight_map_ = weights;
+  prepared_rows_ = -1;
+  prepared_cols_ = -1;
+  return true;
+}
+
+bool BrightnessMetering::prepare(int rows, int cols) {
+  prepared_rows_ = -1;
+  prepared_cols_ = -1;
+  if (roi_.width <= 0 || roi_.height <= 0) {
+    start_row_ = kMarginRow;
+    start_col_ = kMarginCol;
+    end_row_ = rows - kMarginRow;
+    end_col_ = cols - kMarginCol;
+  } else {
+    start_row_ = roi_.y & ~1;
+    start_col_ = roi_.x & ~1;
+    end_row_ = roi_.y + roi_.height;
+    end_col_ = roi_.x + roi_.width;
+  }
+  // [NOTE] The sampling may read a few bytes after the last sample of a row.  Keep a margin.
+  if (start_row_ < 0 || start_col_ < 0 || end_row_ > rows || end_col_ > cols - kPixelStep) {
+    XP_LOG_ERROR("BrightnessMetering roi does not fit in " << rows << "x" << cols);
+    return false;
+  }
+  grid_rows_ = (end_row_ - start_row_) / kGridSize;
+  grid_cols_ = (end_col_ - start_col_) / kGridSize;
+  if (grid_rows_ <= 0 || grid_cols_ <= 0) {
+    return false;
+  }
+
+  grid_weights_.assign(grid_rows_ * grid_cols_, kWeightOne);
+  grid_weight_sum_ = static_cast<int64_t>(kWeightOne) * grid_rows_ * grid_cols_;
+  if (!weight_map_.empty()) {
+    grid_weight_sum_ = 0;
+    for (int grid_r = 0; grid_r < grid_rows_; ++grid_r) {
+      const int map_r = grid_r * map_rows_ / grid_rows_;
+      for (int grid_c = 0; grid_c < grid_cols_; ++grid_c) {
+        const int map_c = grid_c * map_cols_ / grid_cols_;
+        const float w = std::min(std::max(weight_map_[map_r * map_cols_ + map_c], 0.f),
+                                 kMaxWeight);
+        const int weight = static_cast<int>(w * kWeightOne + 0.5f);
+        grid_weights_[grid_r * grid_cols_ + grid_c] = weight;
+        grid_weight_sum_ += weight;
+      }
+    }
+  }
+  if (grid_weight_sum_ == 0) {
+    XP_LOG_ERROR("BrightnessMetering all weights are 0");
+    return false;
+  }
+  prepared_rows_ = rows;
+  prepared_cols_ = cols;
+  return true;
+}
+
+namespace {
+
+// The per-eye accumulators of computeBrightnessStatsImpl
+struct BrightnessAccumulator {
+  // Count in 4 sub-histograms to break the dependency chains of repeated pixel values, which
+  // are common in real images.  The mean is computed from the histogram afterwards.
+  int histogram_1[256];
+  int histogram_2[256];
+  int histogram_3[256];
+  int64_t adjusted_pixel_val;
+};
+
+inline void accumulateSampledRow(const uint8_t* samples,
+                                 int num,
+                                 BrightnessStats* stats,
+                                 BrightnessAccumulator* acc) {
+  int* histogram = stats->histogram;
+  int k = 0;
+  for (; k + 4 <= num; k += 4) {
+    ++histogram[samples[k]];
+    ++acc->histogram_1[samples[k + 1]];
+    ++acc->histogram_2[samples[k + 2]];
+    ++acc->histogram_3[samples[k + 3]];
+  }
+  for (; k < num; ++k) {
+    ++histogram[samples[k]];
+  }
+}
+
+inline void accumulateGridRow(const uint8_t* samples, int grid_cols, int* grid_sums) {
+  constexpr int kSamplesPerGridRow = kGridSize / kPixelStep;
+  for (int grid_c = 0; grid_c < grid_cols; ++grid_c) {
+    const uint8_t* grid_samples = samples + grid_c * kSamplesPerGridRow;
+    for (int k = 0; k < kSamplesPerGridRow; ++k) {
+      grid_sums[grid_c] += grid_samples[k];
+    }
+  }
+}
+
+// Adjust the brightness of a finished row of grids (same as gridBrightDarkAdjustBrightness)
+inline void flushGridRow(int grid_r,
+                         int grid_cols,
+                         int pixels_per_grid,
+                         const int* grid_weights,
+                         int* grid_sums,
+                         BrightnessAccumulator* acc) {
+  constexpr int kBrightRegionThres = 240;
+  constexpr int kDarkRegionThres = 25;
+  constexpr float kBrightRegionWeight = 1.2f;
+  constexpr float kDarkRegionWeight = 0.75f;
+  for (int grid_c = 0; grid_c < grid_cols; ++grid_c) {
+    int grid_pixel_val = grid_sums[grid_c] / pixels_per_grid;
+    if (grid_pixel_val > kBrightRegionThres) {
+      grid_pixel_val *= kBrightRegionWeight;
+    } else if (grid_pixel_val < kDarkRegionThres) {
+      grid_pixel_val *= kDarkRegionWeight;
+    }
+    if (grid_weights != nullptr) {
+      acc->adjusted_pixel_val +=
+          static_cast<int64_t>(grid_weights[grid_r * grid_cols + grid_c]) * grid_pixel_val;
+    } else {
+      acc->adjusted_pixel_val += grid_pixel_val;
+    }
+    grid_sums[grid_c] = 0;
+  }
+}
+
+// The fused statistics pass of one eye (stats_r == nullptr), or both eyes of the interleaved
+// raw data.  Every row_decimation-th sampled row is used.
+bool computeBrightnessStatsImpl(const uint8_t* data,
+                                int rows,
+                                int cols,
+                                size_t row_step,
+                                int pixel_stride,
+                                int row_decimation,
+                                const BrightnessMetering* metering,
+                                BrightnessStats* stats_l,
+                                BrightnessStats* stats_r) {
+  XP_CHECK_NOTNULL(data);
+  XP_CHECK_NOTNULL(stats_l);
+  XP_CHECK_GT(pixel_stride, 0);
+  XP_CHECK_GT(row_decimation, 0);
+  const int eye_num = (stats_r == nullptr) ? 1 : 2;
+  BrightnessStats* stats[2] = {stats_l, stats_r};
+  for (int e = 0; e < eye_num; ++e) {
+    std::fill(stats[e]->histogram, stats[e]->histogram + 256, 0);
+    stats[e]->pixel_num = 0;
+    stats[e]->avg_pixel_val = 0;
+    stats[e]->adjusted_pixel_val = 0;
+  }
+  int start_row = kMarginRow;
+  int start_col = kMarginCol;
+  int end_row = rows - kMarginRow;
+  int end_col = cols - kMarginCol;
+  int grid_rows = (rows - 2 * kMarginRow) / kGridSize;
+  int grid_cols = (cols - 2 * kMarginCol) / kGridSize;
+  // nullptr means uniform weights
+  const int* grid_weights = nullptr;
+  int64_t grid_weight_sum = 0;
+  if (metering != nullptr) {
+    XP_CHECK(metering->is_prepared_for(rows, cols));
+    start_row = metering->start_row();
+    start_col = metering->start_col();
+    end_row = metering->end_row();
+    end_col = metering->end_col();
+    grid_rows = metering->grid_rows();
+    grid_cols = metering->grid_cols();
+    grid_weights = metering->grid_weights().data();
+    grid_weight_sum = metering->grid_weight_sum();
+  }
+  if (end_row <= start_row || end_col <= start_col || grid_rows <= 0 || grid_cols <= 0) {
+    return false;
+  }
+  // The number of sampled pixels per row.  The sampled area of the grids is a subset of the
+  // sampled area of the histogram, and the k-th sample of a row falls in grid k / 5.
+  const int samples_per_row = (end_col - start_col + kPixelStep - 1) / kPixelStep;
+  const int grid_end_row = start_row + grid_rows * kGridSize;
+  const int sampled_row_step = kPixelStep * row_decimation;
+  BrightnessAccumulator accs[2];
+  for (int e = 0; e < eye_num; ++e) {
+    stats[e]->sampled_row.resize(samples_per_row);
+    stats[e]->grid_sums.assign(grid_cols, 0);
+    std::fill(accs[e].histogram_1, accs[e].histogram_1 + 256, 0);
+    std::fill(accs[e].histogram_2, accs[e].histogram_2 + 256, 0);
+    std::fill(accs[e].histogram_3, accs[e].histogram_3 + 256, 0);
+    accs[e].adjusted_pixel_val = 0;
+  }
+
+  int sampled_row_num = 0;
+  int grid_sampled_row_num = 0;  // the number of sampled rows in the current row of grids
+  for (int i = start_row; i < end_row; i += sampled_row_step) {
+    const uint8_t* row_ptr = data + i * row_step + start_col * pixel_stride;
+    if (eye_num == 1) {
+      gatherSamples(row_ptr, kPixelStep * pixel_stride, samples_per_row,
+                    stats_l->sampled_row.data());
+    } else {
+      gatherStereoSamples(row_ptr, samples_per_row, stats_l->sampled_row.data(),
+                          stats_r->sampled_row.data());
+    }
+    ++sampled_row_num;
+    for (int e = 0; e < eye_num; ++e) {
+      accumulateSampledRow(stats[e]->sampled_row.data(), samples_per_row, stats[e], &accs[e]);
+    }
+    if (i >= grid_end_row) {
+      continue;
+    }
+    for (int e = 0; e < eye_num; ++e) {
+      accumulateGridRow(stats[e]->sampled_row.data(), grid_cols, stats[e]->grid_sums.data());
+    }
+    ++grid_sampled_row_num;
+    // The last sampled row of a row of grids
+    const int grid_r = (i - start_row) / kGridSize;
+    const int next_i = i + sampled_row_step;
+    if (next_i >= grid_end_row || (next_i - start_row) / kGridSize != grid_r) {
+      const int pixels_per_grid = grid_sampled_row_num * (kGridSize / kPixelStep);
+      for (int e = 0; e < eye_num; ++e) {
+        flushGridRow(grid_r, grid_cols, pixels_per_grid, grid_weights,
+                     stats[e]->grid_sums.data(), &accs[e]);
+      }
+      grid_sampled_row_num = 0;
+    }
+  }
+  for (int e = 0; e < eye_num; ++e) {
+    int* histogram = stats[e]->histogram;
+    int pixel_sum = 0;
+    for (int v = 0; v < 256; ++v) {
+      histogram[v] += accs[e].histogram_1[v] + accs[e].histogram_2[v] + accs[e].histogram_3[v];
+      pixel_sum += v * histogram[v];
+    }
+    stats[e]->pixel_num = sampled_row_num * samples_per_row;
+    stats[e]->avg_pixel_val = pixel_sum / stats[e]->pixel_num;
+    if (grid_weights != nullptr) {
+      stats[e]->adjusted_pixel_val = accs[e].adjusted_pixel_val / grid_weight_sum;
+    } else {
+      stats[e]->adjusted_pixel_val = accs[e].adjusted_pixel_val / (grid_rows * grid_cols);
+    }
+  }
+  return true;
+}
+
+// Copy the results (not the scratch buffers) of BrightnessStats
+void copyBrightnessStats(const BrightnessStats& src, BrightnessStats* dst) {
+  std::copy(src.histogram, src.histogram + 256, dst->histogram);
+  dst->pixel_num = src.pixel_num;
+  dst->avg_pixel_val = src.avg_pixel_val;
+  dst->adjusted_pixel_val = src.adjusted_pixel_val;
+}
+
+int saturatedPixelNum(const BrightnessStats& stats) {
+  constexpr int kSaturatedPixelVal = 253;
+  int saturated_num = 0;
+  for (int v = kSaturatedPixelVal; v < 256; ++v) {
+    saturated_num += stats.histogram[v];
+  }
+  return saturated_num;
+}
+
+}  // namespace
+
+bool computeBrightnessStats(const uint8_t* data,
+                            int rows,
+                            int cols,
+                            size_t row_step,
+                            int pixel_stride,
+                            BrightnessStats* stats,
+                            const BrightnessMetering* metering) {
+  constexpr int kRowDecimation = 1;
+  return computeBrightnessStatsImpl(data, rows, cols, row_step, pixel_stride, kRowDecimation,
+                                    metering, stats, nullptr);
+}
+
+bool computeStereoBrightnessStats(const uint8_t* data,
+                                  int rows,
+                                  int cols,
+                                  size_t row_step,
+                                  StereoAecMode mode,
+                                  float left_weight,
+                                  StereoBrightnessStats* stats,
+                                  const BrightnessMetering* metering) {
+  XP_CHECK_NOTNULL(stats);
+  constexpr int kPixelStride = 2;
+  // [NOTE] Sample every other row of the mono sampling lattice for each eye, so that the two
+  // eyes together take the same number of samples (and the same time) as one eye in
+  // computeBrightnessStats.
+  constexpr int kRowDecimation = 2;
+  if (!computeBrightnessStatsImpl(data, rows, cols, row_step, kPixelStride, kRowDecimation,
+                                  metering, &stats->l, &stats->r)) {
+    return false;
+  }
+  const BrightnessStats& l = stats->l;
+  const BrightnessStats& r = stats->r;
+  BrightnessStats* joint = &stats->joint;
+  switch (mode) {
+    case StereoAecMode::LEFT:
+      copyBrightnessStats(l, joint);
+      break;
+    case StereoAecMode::MIN_SATURATION: {
+      // Expose for the eye with more saturated pixels (or the brighter one if tie), so that
+      // neither eye gets over-exposed
+      const int l_saturated_num = saturatedPixelNum(l);
+      const int r_saturated_num = saturatedPixelNum(r);
+      const bool use_l = (l_saturated_num != r_saturated_num) ?
+          l_saturated_num > r_saturated_num : l.adjusted_pixel_val >= r.adjusted_pixel_val;
+      copyBrightnessStats(use_l ? l : r, joint);
+      break;
+    }
+    case StereoAecMode::MEAN:
+      left_weight = 0.5f;
+      // fall through
+    case StereoAecMode::WEIGHTED: {
+      left_weight = std::min(std::max(left_weight, 0.f), 1.f);
+      for (int v = 0; v < 256; ++v) {
+        joint->histogram[v] = l.histogram[v] + r.histogram[v];
+      }
+      joint->pixel_num = l.pixel_num + r.pixel_num;
+      joint->avg_pixel_val = static_cast<int>(
+          left_weight * l.avg_pixel_val + (1.f - left_weight) * r.avg_pixel_val + 0.5f);
+      joint->adjusted_pixel_val = static_cast<int>(
+          left_weight * l.adjusted_pixel_val + (1.f - left_weight) * r.adjusted_pixel_val + 0.5f);
+      break;
+    }
+    default:
+      XP_LOG_ERROR("Unsupported StereoAecMode");
+      return false;
+  }
+  return true;
+}
+
+bool computeBrightnessStats(const cv::Mat& mono_img,
+                            BrightnessStats* stats,
+                            const BrightnessMetering* metering) {
+  XP_CHECK_EQ(mono_img.type(), CV_8UC1);
+  return computeBrightnessStats(mono_img.data, mono_img.rows, mono_img.cols, mono_img.step, 1,
+                                stats, metering);
+}
+
 // return true if new aec_index is found
 bool computeNewAecTableIndex(const cv::Mat& raw_img,
                              const bool smooth_aec,
                              int* aec_index_ptr) {
-  using XPDRIVER::XP_SENSOR::kAEC_steps;
-  using XPDRIVER::XP_SENSOR::kAEC_LUT;
-  XP_CHECK_NOTNULL(aec_index_ptr);
-  int& aec_index = *aec_index_ptr;
-  XP_CHECK_LT(aec_index, kAEC_steps);
-  XP_CHECK_GE(aec_index, 0);
-
   cv::Mat mono_img;
   if (raw_img.channels() == 1) {
     mono_img = raw_img;
@@ -127,16 +551,31 @@ bool computeNewAecTableIndex(const cv::Mat& raw_img,
     return false;
   }
 
-  std::vector<int> histogram;
-  int avg_pixel_val = 0;
-  int pixel_num = sampleBrightnessHistogram(mono_img, &histogram, &avg_pixel_val);
-  if (pixel_num == 0) {
+  BrightnessStats stats;
+  if (!computeBrightnessStats(mono_img, &stats)) {
     // Nothing is sampled.  Something is wrong with raw_image
     return false;
   }
+  return computeNewAecTableIndex(stats, smooth_aec, aec_index_ptr);
+}
 
-  int adjusted_pixel_val = 0;
-  gridBrightDarkAdjustBrightness(mono_img, &adjusted_pixel_val);
+// return true if new aec_index is found
+bool computeNewAecTableIndex(const BrightnessStats& stats,
+                             const bool smooth_aec,
+                             int* aec_index_ptr,
+                             XP_SENSOR::AecCurve aec_curve) {
+  XP_CHECK_NOTNULL(aec_index_ptr);
+  const int aec_steps = XP_SENSOR::get_aec_table(aec_curve).steps;
+  int& aec_index = *aec_index_ptr;
+  XP_CHECK_LT(aec_index, aec_steps);
+  XP_CHECK_GE(aec_index, 0);
+  if (stats.pixel_num == 0) {
+    return false;
+  }
+  const int* histogram = stats.histogram;
+  const int pixel_num = stats.pixel_num;
+  const int avg_pixel_val = stats.avg_pixel_val;
+  const int adjusted_pixel_val = stats.adjusted_pixel_val;
 
 #ifndef __IMAGE_UTILS_NO_DEBUG__
   int acc_pixel_counts = 0;
@@ -215,8 +654,8 @@ bool computeNewAecTableIndex(const cv::Mat& raw_img,
   aec_index -= actual_step_num;
   if (aec_index < kLowestAecIndex) {
     aec_index = kLowestAecIndex;
-  } else if (aec_index > kAEC_steps - 1) {
-    aec_index = kAEC_steps - 1;
+  } else if (aec_index > aec_steps - 1) {
+    aec_index = aec_steps - 1;
   }
   return true;
 }
@@ -251,6 +690,61 @@ void AutoWhiteBalance::compute_RGB_mean_neon(const cv::Mat& rgb_img_,
   *ptr_b_mean = vgetq_lane_u32(b_mean, 0) + vgetq_lane_u32(b_mean, 1) +
                 vgetq_lane_u32(b_mean, 2) + vgetq_lane_u32(b_mean, 3);
 }
+#elif defined __SSE2__
+// [NOTE] Each run of 16 BGR pixels is 48 bytes, i.e., 3 SSE registers, and the channel of
+// each byte lane repeats with the same period.  We mask out one channel at a time and let
+// _mm_sad_epu8 do the horizontal byte sums, so no shuffling / deinterleaving is needed.
+void AutoWhiteBalance::compute_RGB_mean_sse(const cv::Mat& rgb_img_,
+                                            uint32_t* ptr_r_mean,
+                                            uint32_t* ptr_g_mean,
+                                            uint32_t* ptr_b_mean) const {
+  const int width = rgb_img_.cols;
+  const int height = rgb_img_.rows;
+  // channel_masks[reg][ch] selects the bytes of channel ch in the reg-th register
+  __m128i channel_masks[3][3];
+  for (int reg = 0; reg < 3; ++reg) {
+    for (int ch = 0; ch < 3; ++ch) {
+      alignas(16) uint8_t mask[16];
+      for (int k = 0; k < 16; ++k) {
+        mask[k] = ((reg * 16 + k) % 3 == ch) ? 0xff : 0x00;
+      }
+      channel_masks[reg][ch] = _mm_load_si128(reinterpret_cast<const __m128i*>(mask));
+    }
+  }
+  const __m128i zero = _mm_setzero_si128();
+  __m128i sums[3] = {zero, zero, zero};  // r, g, b.  Two 64-bit partial sums each
+  uint32_t mr = 0, mg = 0, mb = 0;
+  for (int r = 0; r < height; r += 8) {
+    const uint8_t* row_ptr = rgb_img_.ptr(r);
+    int c = 0;
+    for (; c + 16 <= width; c += 16) {
+      const __m128i* src = reinterpret_cast<const __m128i*>(row_ptr + 3 * c);
+      const __m128i v0 = _mm_loadu_si128(src);
+      const __m128i v1 = _mm_loadu_si128(src + 1);
+      const __m128i v2 = _mm_loadu_si128(src + 2);
+      for (int ch = 0; ch < 3; ++ch) {
+        sums[ch] = _mm_add_epi64(sums[ch],
+                                 _mm_sad_epu8(_mm_and_si128(v0, channel_masks[0][ch]), zero));
+        sums[ch] = _mm_add_epi64(sums[ch],
+                                 _mm_sad_epu8(_mm_and_si128(v1, channel_masks[1][ch]), zero));
+        sums[ch] = _mm_add_epi64(sums[ch],
+                                 _mm_sad_epu8(_mm_and_si128(v2, channel_masks[2][ch]), zero));
+      }
+    }
+    for (; c < width; ++c) {
+      mr += row_ptr[3 * c + 0];
+      mg += row_ptr[3 * c + 1];
+      mb += row_ptr[3 * c + 2];
+    }
+  }
+  // Fold the two 64-bit lanes.  Both lanes are < 2^32 for any sane image size.
+  *ptr_r_mean = mr + _mm_cvtsi128_si32(sums[0]) +
+                _mm_cvtsi128_si32(_mm_unpackhi_epi64(sums[0], sums[0]));
+  *ptr_g_mean = mg + _mm_cvtsi128_si32(sums[1]) +
+                _mm_cvtsi128_si32(_mm_unpackhi_epi64(sums[1], sums[1]));
+  *ptr_b_mean = mb + _mm_cvtsi128_si32(sums[2]) +
+                _mm_cvtsi128_si32(_mm_unpackhi_epi64(sums[2], sums[2]));
+}
 #endif  // __ARM_NEON__
 
 inline void AutoWhiteBalance::compute_RGB_mean(const cv::Mat &rgb_img_,
@@ -259,6 +753,8 @@ inline void AutoWhiteBalance::compute_RGB_mean(const cv::Mat &rgb_img_,
                                                uint32_t *ptr_b_mean) const {
 #ifdef __ARM_NEON__
     return compute_RGB_mean_neon(rgb_img_, ptr_r_mean, ptr_g_mean, ptr_b_mean);
+#elif defined __SSE2__
+    return compute_RGB_mean_sse(rgb_img_, ptr_r_mean, ptr_g_mean, ptr_b_mean);
 #else
   int width = rgb_img_.cols;
   int height = rgb_img_.rows;
@@ -282,29 +778,137 @@ inline void AutoWhiteBalance::compute_RGB_mean(const cv::Mat &rgb_img_,
 #endif  // __ARM_NEON__
 }
 
-void AutoWhiteBalance::compute_AWB_coefficients(const cv::Mat& rgb_img_) {
-  uint32_t r_mean = 0, g_mean = 0, b_mean = 0;
-  compute_RGB_mean(rgb_img_, &r_mean, &g_mean, &b_mean);
+void AutoWhiteBalance::compute_RGB_mean_grid(const cv::Mat& rgb_img_,
+                                             int grid_step,
+                                             uint32_t* ptr_r_mean,
+                                             uint32_t* ptr_g_mean,
+                                             uint32_t* ptr_b_mean) const {
+  // Only a few thousand pixels are touched.  No need to vectorize.
+  const int width = rgb_img_.cols;
+  const int height = rgb_img_.rows;
+  const int pixel_step = 3 * grid_step;
+  uint32_t mr = 0, mg = 0, mb = 0;
+  for (int r = grid_step / 2; r < height; r += grid_step) {
+    const uint8_t* rgb_img_row_ptr = rgb_img_.ptr(r) + 3 * (grid_step / 2);
+    for (int c = grid_step / 2; c < width; c += grid_step) {
+      mr += rgb_img_row_ptr[0];
+      mg += rgb_img_row_ptr[1];
+      mb += rgb_img_row_ptr[2];
+      rgb_img_row_ptr += pixel_step;
+    }
+  }
+  *ptr_r_mean = mr;
+  *ptr_g_mean = mg;
+  *ptr_b_mean = mb;
+}
 
+bool AutoWhiteBalance::coefficients_from_RGB_mean(uint32_t r_mean,
+                                                  uint32_t g_mean,
+                                                  uint32_t b_mean,
+                                                  float* coeff_r,
+                                                  float* coeff_g,
+                                                  float* coeff_b) {
   if (g_mean > r_mean && g_mean > b_mean) {
     XP_VLOG(1, "Green channel based.");
-    m_coeff_g_ = 1.f;
-    m_coeff_r_ = g_mean / static_cast<float>(r_mean);
-    m_coeff_b_ = g_mean / static_cast<float>(b_mean);
+    *coeff_g = 1.f;
+    *coeff_r = g_mean / static_cast<float>(r_mean);
+    *coeff_b = g_mean / static_cast<float>(b_mean);
   } else if (r_mean > g_mean && r_mean > b_mean) {
     XP_VLOG(1, "Red channel based.");
-    m_coeff_g_ = r_mean / static_cast<float>(g_mean);
-    m_coeff_r_ = 1.f;
-    m_coeff_b_ = r_mean / static_cast<float>(b_mean);
+    *coeff_g = r_mean / static_cast<float>(g_mean);
+    *coeff_r = 1.f;
+    *coeff_b = r_mean / static_cast<float>(b_mean);
   } else {
     XP_VLOG(1, "Blue channel based.");
-    m_coeff_g_ = b_mean / static_cast<float>(g_mean);
-    m_coeff_r_ = b_mean / static_cast<float>(r_mean);
-    m_coeff_b_ = 1.f;
+    *coeff_g = b_mean / static_cast<float>(g_mean);
+    *coeff_r = b_mean / static_cast<float>(r_mean);
+    *coeff_b = 1.f;
   }
+  // A black channel leads to inf gains
+  return (r_mean > 0 && g_mean > 0 && b_mean > 0);
+}
+
+void AutoWhiteBalance::compute_AWB_coefficients(const cv::Mat& rgb_img_) {
+  uint32_t r_mean = 0, g_mean = 0, b_mean = 0;
+  compute_RGB_mean(rgb_img_, &r_mean, &g_mean, &b_mean);
+  coefficients_from_RGB_mean(r_mean, g_mean, b_mean, &m_coeff_r_, &m_coeff_g_, &m_coeff_b_);
+}
+
+bool AutoWhiteBalance::needStatistics() {
+  if (m_use_preset_) {
+    return false;
+  }
+  // In smoothed mode, only collect statistics every m_update_interval_ frames
+  const bool need_statistics = !m_use_smoothing_ || !m_has_coeffs_ ||
+                               m_frame_count_ == 0;
+  // Kept in [0, m_update_interval_) so that it never overflows
+  m_frame_count_ = (m_frame_count_ + 1) % m_update_interval_;
+  return need_statistics;
+}
+
+void AutoWhiteBalance::updateCoefficientsFromRGBMean(uint32_t r_mean,
+                                                     uint32_t g_mean,
+                                                     uint32_t b_mean) {
+  if (m_use_preset_) {
+    return;
+  }
+  float coeff_r, coeff_g, coeff_b;
+  if (!coefficients_from_RGB_mean(r_mean, g_mean, b_mean, &coeff_r, &coeff_g, &coeff_b)) {
+    // Keep the previous coefficients if the frame is (partially) black
+    if (!m_has_coeffs_) {
+      m_coeff_r_ = m_coeff_g_ = m_coeff_b_ = 1.f;
+    }
+    return;
+  }
+  if (!m_use_smoothing_ || !m_has_coeffs_) {
+    m_coeff_r_ = coeff_r;
+    m_coeff_g_ = coeff_g;
+    m_coeff_b_ = coeff_b;
+    m_has_coeffs_ = true;
+  } else {
+    // Exponential filter to avoid color flickering
+    m_coeff_r_ += m_smooth_alpha_ * (coeff_r - m_coeff_r_);
+    m_coeff_g_ += m_smooth_alpha_ * (coeff_g - m_coeff_g_);
+    m_coeff_b_ += m_smooth_alpha_ * (coeff_b - m_coeff_b_);
+  }
+}
+
+void AutoWhiteBalance::update_smoothed_AWB_coefficients(const cv::Mat& rgb_img_l,
+                                                        const cv::Mat* rgb_img_r_ptr) {
+  if (!needStatistics()) {
+    return;
+  }
+  uint32_t r_mean = 0, g_mean = 0, b_mean = 0;
+  compute_RGB_mean_grid(rgb_img_l, m_grid_step_, &r_mean, &g_mean, &b_mean);
+  if (rgb_img_r_ptr != nullptr) {
+    uint32_t r_mean_r = 0, g_mean_r = 0, b_mean_r = 0;
+    compute_RGB_mean_grid(*rgb_img_r_ptr, m_grid_step_, &r_mean_r, &g_mean_r, &b_mean_r);
+    r_mean += r_mean_r;
+    g_mean += g_mean_r;
+    b_mean += b_mean_r;
+  }
+  updateCoefficientsFromRGBMean(r_mean, g_mean, b_mean);
+}
+
+void AutoWhiteBalance::run(cv::Mat* rgb_img_l_ptr, cv::Mat* rgb_img_r_ptr) {
+  XP_CHECK_NOTNULL(rgb_img_l_ptr);
+  XP_CHECK_NOTNULL(rgb_img_r_ptr);
+  if (!m_use_smoothing_ || m_use_preset_) {
+    // Legacy behavior: each eye is white balanced on its own
+    run(rgb_img_l_ptr);
+    run(rgb_img_r_ptr);
+    return;
+  }
+  XP_CHECK_EQ(rgb_img_l_ptr->type(), CV_8UC3);
+  XP_CHECK_EQ(rgb_img_r_ptr->type(), CV_8UC3);
+  update_smoothed_AWB_coefficients(*rgb_img_l_ptr, rgb_img_r_ptr);
+  correct_white_balance_coefficients(rgb_img_l_ptr);
+  correct_white_balance_coefficients(rgb_img_r_ptr);
 }
 
 #ifdef __ARM_NEON__
+// [NOTE] vcvtq_u32_f32 truncates toward zero and vqmovn saturates at 255, so this gives exactly
+// the same output as the gain LUTs (see update_gain_lut) for any coefficient >= 0.
 void AutoWhiteBalance::correct_white_balance_coefficients_neon(cv::Mat* rgb_img_ptr) {
   uint8x16x3_t src_raw_data, dst_data;
   int width = rgb_img_ptr->cols;
@@ -315,7 +919,8 @@ void AutoWhiteBalance::correct_white_balance_coefficients_neon(cv::Mat* rgb_img_
   v_coeffs[2] = m_coeff_b_;
   for (int r = 0; r < height; ++r) {
     uint8_t* rgb_img_row_ptr = rgb_img_ptr->ptr(r);
-    for (int c = 0; c < width; c += 16) {
+    int c = 0;
+    for (; c + 16 <= width; c += 16) {
       src_raw_data = vld3q_u8(rgb_img_row_ptr + c * 3);
       for (int ch = 0; ch < 3; ++ch) {
         uint16x8_t low8 = vmovl_u8(vget_low_u8(src_raw_data.val[ch]));
@@ -334,31 +939,78 @@ void AutoWhiteBalance::correct_white_balance_coefficients_neon(cv::Mat* rgb_img_
       }
       vst3q_u8(rgb_img_row_ptr + c * 3, dst_data);
     }
+    if (c < width) {
+      // The last width % 16 pixels through the gain LUTs
+      update_gain_lut();
+      for (uint8_t* pixel_ptr = rgb_img_row_ptr + c * 3;
+           pixel_ptr < rgb_img_row_ptr + width * 3; pixel_ptr += 3) {
+        pixel_ptr[0] = m_gain_lut_[0][pixel_ptr[0]];
+        pixel_ptr[1] = m_gain_lut_[1][pixel_ptr[1]];
+        pixel_ptr[2] = m_gain_lut_[2][pixel_ptr[2]];
+      }
+    }
   }
 }
 #endif  // __ARM_NEON__
 
-void AutoWhiteBalance::correct_white_balance_coefficients(cv::Mat* rgb_img_ptr) {
-#ifdef __ARM_NEON__
-  return correct_white_balance_coefficients_neon(rgb_img_ptr);
-#else
-  cv::Mat& rgb_img_ = *rgb_img_ptr;
-  int width = rgb_img_.cols;
-  int height = rgb_img_.rows;
-  int cr, cg, cb;
+void AutoWhiteBalance::update_gain_lut() {
+  const float coeffs[3] = {m_coeff_r_, m_coeff_g_, m_coeff_b_};
+  for (int ch = 0; ch < 3; ++ch) {
+    if (coeffs[ch] == m_gain_lut_coeffs_[ch]) {
+      continue;
+    }
+    for (int v = 0; v < 256; ++v) {
+      // Same float multiply + truncation + clamp as the per-pixel path used to do
+      const int corrected_v = v * coeffs[ch];
+      m_gain_lut_[ch][v] = (corrected_v <= 255 ? corrected_v : 255);
+    }
+    m_gain_lut_coeffs_[ch] = coeffs[ch];
+  }
+}
 
+void AutoWhiteBalance::correct_white_balance_coefficients_lut(cv::Mat* rgb_img_ptr) {
+  update_gain_lut();
+  cv::Mat& rgb_img_ = *rgb_img_ptr;
+  const int width = rgb_img_.cols;
+  const int height = rgb_img_.rows;
+  const uint8_t* lut_r = m_gain_lut_[0];
+  const uint8_t* lut_g = m_gain_lut_[1];
+  const uint8_t* lut_b = m_gain_lut_[2];
   for (int r = 0; r < height; ++r) {
     uint8_t* rgb_img_row_ptr = rgb_img_.ptr(r);
-    for (int c = 0; c < width; ++c) {
-      cr = *(rgb_img_row_ptr + 0) * m_coeff_r_;
-      cg = *(rgb_img_row_ptr + 1) * m_coeff_g_;
-      cb = *(rgb_img_row_ptr + 2) * m_coeff_b_;
-      *(rgb_img_row_ptr + 0) = (cr <= 255 ? cr : 255);
-      *(rgb_img_row_ptr + 1) = (cg <= 255 ? cg : 255);
-      *(rgb_img_row_ptr + 2) = (cb <= 255 ? cb : 255);
+    int c = 0;
+    // 4 pixels per iteration to give the loads / stores some room to overlap
+    for (; c + 4 <= width; c += 4) {
+      rgb_img_row_ptr[0] = lut_r[rgb_img_row_ptr[0]];
+      rgb_img_row_ptr[1] = lut_g[rgb_img_row_ptr[1]];
+      rgb_img_row_ptr[2] = lut_b[rgb_img_row_ptr[2]];
+      rgb_img_row_ptr[3] = lut_r[rgb_img_row_ptr[3]];
+      rgb_img_row_ptr[4] = lut_g[rgb_img_row_ptr[4]];
+      rgb_img_row_ptr[5] = lut_b[rgb_img_row_ptr[5]];
+      rgb_img_row_ptr[6] = lut_r[rgb_img_row_ptr[6]];
+      rgb_img_row_ptr[7] = lut_g[rgb_img_row_ptr[7]];
+      rgb_img_row_ptr[8] = lut_b[rgb_img_row_ptr[8]];
+      rgb_img_row_ptr[9] = lut_r[rgb_img_row_ptr[9]];
+      rgb_img_row_ptr[10] = lut_g[rgb_img_row_ptr[10]];
+      rgb_img_row_ptr[11] = lut_b[rgb_img_row_ptr[11]];
+      rgb_img_row_ptr += 12;
+    }
+    for (; c < width; ++c) {
+      rgb_img_row_ptr[0] = lut_r[rgb_img_row_ptr[0]];
+      rgb_img_row_ptr[1] = lut_g[rgb_img_row_ptr[1]];
+      rgb_img_row_ptr[2] = lut_b[rgb_img_row_ptr[2]];
       rgb_img_row_ptr += 3;
     }
   }
+}
+
+void AutoWhiteBalance::correct_white_balance_coefficients(cv::Mat* rgb_img_ptr) {
+#ifdef __ARM_NEON__
+  return correct_white_balance_coefficients_neon(rgb_img_ptr);
+#else
+  // [NOTE] There is no byte gather on x86 (AVX2 gathers are 32-bit and slower than scalar
+  // loads here), so a 256-entry LUT per channel is the fastest way to apply the gains.
+  return correct_white_balance_coefficients_lut(rgb_img_ptr);
 #endif  // __ARM_NEON__
 }
 }  // namespace XPDRIVER
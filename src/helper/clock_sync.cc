@@ -0,0 +1,143 @@
+/******************************************************************************
+ * Copyright 2017-2018 Baidu Robotic Vision Authors. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *****************************************************************************/
+#include <driver/helper/clock_sync.h>
+#include <driver/helper/xp_logging.h>
+#include <algorithm>
+#include <cmath>
+
+namespace XPDRIVER {
+
+ClockSync::ClockSync() : ClockSync(Config()) {}
+
+ClockSync::ClockSync(const Config& config) : config_(config) {
+  XP_CHECK_GT(config_.window_s, 0);
+  XP_CHECK_GT(config_.outlier_sigma, 0);
+  XP_CHECK_GT(config_.warmup_samples, 1);
+  XP_CHECK_GT(config_.reset_after_outliers, 0);
+  reset();
+}
+
+void ClockSync::reset() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  stats_ = Stats();
+  reset_fit();
+}
+
+void ClockSync::reset_fit() {
+  has_ref_ = false;
+  ref_sensor_ns_ = 0;
+  ref_offset_ns_ = 0;
+  weight_ = 0;
+  mean_x_ = 0;
+  mean_y_ = 0;
+  co_xx_ = 0;
+  co_xy_ = 0;
+  last_x_ = 0;
+  residual_std_ns_ = 0;
+  sample_num_ = 0;
+  consecutive_outlier_num_ = 0;
+}
+
+bool ClockSync::has_skew() const {
+  // Only fit the skew once the samples are spread enough in time, i.e., var(x) is at least
+  // that of samples spread uniformly over min_skew_span_s
+  return co_xx_ > weight_ * config_.min_skew_span_s * config_.min_skew_span_s / 12;
+}
+
+double ClockSync::predict(double x) const {
+  return has_skew() ? mean_y_ + co_xy_ / co_xx_ * (x - mean_x_) : mean_y_;
+}
+
+bool ClockSync::add_sample(int64_t sensor_ns, int64_t host_ns) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!has_ref_) {
+    has_ref_ = true;
+    ref_sensor_ns_ = sensor_ns;
+    ref_offset_ns_ = host_ns - sensor_ns;
+  }
+  const double x = (sensor_ns - ref_sensor_ns_) * 1e-9;
+  const double y = static_cast<double>(host_ns - sensor_ns - ref_offset_ns_);
+  const double residual = sample_num_ > 0 ? y - predict(x) : 0;
+
+  if (sample_num_ >= config_.warmup_samples) {
+    const double threshold = std::max(config_.outlier_sigma * residual_std_ns_,
+                                      static_cast<double>(config_.min_outlier_ns));
+    if (std::abs(residual) > threshold) {
+      ++stats_.rejected_num;
+      ++consecutive_outlier_num_;
+      if (consecutive_outlier_num_ >= config_.reset_after_outliers) {
+        XP_LOG_WARNING("ClockSync: " << consecutive_outlier_num_
+                       << " outliers in a row.  Restart the fit");
+        ++stats_.reset_num;
+        reset_fit();
+      }
+      return false;
+    }
+  }
+  consecutive_outlier_num_ = 0;
+
+  // The residual std.  A running mean during the warmup, and then a moving average.
+  const double alpha = 1. / std::min(sample_num_ + 1, 50);
+  residual_std_ns_ = std::sqrt((1 - alpha) * residual_std_ns_ * residual_std_ns_ +
+                               alpha * residual * residual);
+
+  // Exponentially-weighted least squares in the incremental (Welford) form
+  const double forget = std::exp(-std::max(x - last_x_, 0.) / config_.window_s);
+  last_x_ = std::max(x, last_x_);
+  weight_ = forget * weight_ + 1;
+  const double dx = x - mean_x_;
+  const double dy = y - mean_y_;
+  mean_x_ += dx / weight_;
+  mean_y_ += dy / weight_;
+  co_xx_ = forget * co_xx_ + dx * (x - mean_x_);
+  co_xy_ = forget * co_xy_ + dx * (y - mean_y_);
+  ++sample_num_;
+  ++stats_.accepted_num;
+  return true;
+}
+
+bool ClockSync::is_synced() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return sample_num_ >= config_.warmup_samples;
+}
+
+int64_t ClockSync::sensor_to_host_ns(int64_t sensor_ns) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  const double x = (sensor_ns - ref_sensor_ns_) * 1e-9;
+  return sensor_ns + ref_offset_ns_ + std::llround(predict(x));
+}
+
+int64_t ClockSync::host_to_sensor_ns(int64_t host_ns) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  // Solve host = sensor + ref_offset + predict(sensor) by fixed-point iteration.
+  // Each iteration shrinks the error by the skew (< 1e-3), so 2 are plenty.
+  int64_t sensor_ns = host_ns - ref_offset_ns_;
+  for (int i = 0; i < 2; ++i) {
+    const double x = (sensor_ns - ref_sensor_ns_) * 1e-9;
+    sensor_ns = host_ns - ref_offset_ns_ - std::llround(predict(x));
+  }
+  return sensor_ns;
+}
+
+ClockSync::Stats ClockSync::stats() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  Stats stats = stats_;
+  stats.residual_std_ns = residual_std_ns_;
+  stats.skew_ppm = has_skew() ? co_xy_ / co_xx_ * 1e-3 : 0;  // ns / s -> ppm
+  return stats;
+}
+
+}  // namespace XPDRIVER
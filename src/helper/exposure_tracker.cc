@@ -0,0 +1,111 @@
+/******************************************************************************
+ * Copyright 2017-2018 Baidu Robotic Vision Authors. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *****************************************************************************/
+#include <driver/helper/exposure_tracker.h>
+#include <driver/helper/xp_logging.h>
+#include <algorithm>
+#include <limits>
+
+namespace XPDRIVER {
+
+ExposureTracker::ExposureTracker() : ExposureTracker(Config()) {}
+
+ExposureTracker::ExposureTracker(const Config& config) :
+    config_(config),
+    gain_reg_val_(0),
+    exp_reg_val_(0),
+    gain_aec_index_(-1),
+    exp_aec_index_(-1),
+    has_offset_(false),
+    offset_us_(0),
+    window_offset_us_(0),
+    last_window_offset_us_(0),
+    window_frames_(0) {
+  XP_CHECK_GE(config_.gain_delay_frames, 0);
+  XP_CHECK_GE(config_.exp_delay_frames, config_.gain_delay_frames);
+  XP_CHECK_GT(config_.offset_window_frames, 0);
+}
+
+void ExposureTracker::reset(int16_t gain_reg_val, int16_t exp_reg_val, int aec_index) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  pending_writes_.clear();
+  gain_reg_val_ = gain_reg_val;
+  exp_reg_val_ = exp_reg_val;
+  gain_aec_index_ = aec_index;
+  exp_aec_index_ = aec_index;
+}
+
+void ExposureTracker::on_registers_written(int64_t host_time_us,
+                                           int16_t gain_reg_val,
+                                           int16_t exp_reg_val,
+                                           int aec_index) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  PendingWrite write;
+  // Without any frame yet, every coming frame is after the write
+  write.sensor_time_us = has_offset_ ? host_time_us - offset_us_ :
+      std::numeric_limits<int64_t>::min();
+  write.gain_reg_val = gain_reg_val;
+  write.exp_reg_val = exp_reg_val;
+  write.aec_index = aec_index;
+  write.frames_after = 0;
+  pending_writes_.push_back(write);
+}
+
+ExposureMetadata ExposureTracker::on_frame(int64_t sensor_time_us, int64_t host_time_us) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  // Update the lower envelope of host time - sensor time
+  const int64_t offset_us = host_time_us - sensor_time_us;
+  if (!has_offset_) {
+    has_offset_ = true;
+    window_offset_us_ = offset_us;
+    last_window_offset_us_ = offset_us;
+  }
+  window_offset_us_ = std::min(window_offset_us_, offset_us);
+  offset_us_ = std::min(window_offset_us_, last_window_offset_us_);
+  if (++window_frames_ >= config_.offset_window_frames) {
+    last_window_offset_us_ = window_offset_us_;
+    window_offset_us_ = offset_us;
+    window_frames_ = 0;
+  }
+
+  // Apply the writes that have taken effect in this frame.  A later write overrides an
+  // earlier one.
+  for (PendingWrite& write : pending_writes_) {
+    if (sensor_time_us > write.sensor_time_us) {
+      ++write.frames_after;
+    }
+    if (write.frames_after >= config_.gain_delay_frames) {
+      gain_reg_val_ = write.gain_reg_val;
+      gain_aec_index_ = write.aec_index;
+    }
+    if (write.frames_after >= config_.exp_delay_frames) {
+      exp_reg_val_ = write.exp_reg_val;
+      exp_aec_index_ = write.aec_index;
+    }
+  }
+  // exp_delay_frames >= gain_delay_frames, so a write is done once its exposure is applied
+  while (!pending_writes_.empty() &&
+         pending_writes_.front().frames_after >= config_.exp_delay_frames) {
+    pending_writes_.pop_front();
+  }
+
+  ExposureMetadata metadata;
+  metadata.gain_reg_val = gain_reg_val_;
+  metadata.exp_reg_val = exp_reg_val_;
+  metadata.aec_index = (gain_aec_index_ == exp_aec_index_) ? gain_aec_index_ : -1;
+  return metadata;
+}
+
+}  // namespace XPDRIVER
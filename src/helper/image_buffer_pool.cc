@@ -0,0 +1,92 @@
+/******************************************************************************
+ * Copyright 2017-2018 Baidu Robotic Vision Authors. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *****************************************************************************/
+
+#include <driver/helper/image_buffer_pool.h>
+#include <driver/helper/xp_logging.h>
+
+namespace XPDRIVER {
+
+ImageBufferPool::ImageBufferPool(const ImageBufferLayout& layout) :
+    layout_(layout),
+    state_(new State) {
+  XP_CHECK_GT(layout_.rows, 0);
+  XP_CHECK_GT(layout_.cols, 0);
+  XP_CHECK_GT(layout_.alignment, 0);
+  const size_t packed_step = layout_.cols * CV_ELEM_SIZE(layout_.type);
+  step_ = (layout_.step == 0) ? packed_step : layout_.step;
+  if (step_ < packed_step) {
+    XP_LOG_FATAL("ImageBufferPool step " << step_ << " < packed row size " << packed_step);
+  }
+}
+
+bool ImageBufferPool::add_buffer(uint8_t* l_data, uint8_t* r_data) {
+  if (l_data == nullptr || r_data == nullptr) {
+    XP_LOG_ERROR("ImageBufferPool::add_buffer null buffer");
+    return false;
+  }
+  if (reinterpret_cast<uintptr_t>(l_data) % layout_.alignment != 0 ||
+      reinterpret_cast<uintptr_t>(r_data) % layout_.alignment != 0) {
+    XP_LOG_ERROR("ImageBufferPool::add_buffer buffer is not aligned to "
+                 << layout_.alignment << " bytes");
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(state_->m);
+  state_->free_indices.push_back(state_->l_data.size());
+  state_->l_data.push_back(l_data);
+  state_->r_data.push_back(r_data);
+  return true;
+}
+
+ImageBufferPool::StereoImagePtr ImageBufferPool::acquire() {
+  int index;
+  uint8_t* l_data;
+  uint8_t* r_data;
+  {
+    // [NOTE] Read the buffers under the lock, as add_buffer may reallocate the vectors
+    std::lock_guard<std::mutex> lock(state_->m);
+    if (state_->free_indices.empty()) {
+      return nullptr;
+    }
+    index = state_->free_indices.back();
+    state_->free_indices.pop_back();
+    l_data = state_->l_data[index];
+    r_data = state_->r_data[index];
+  }
+  StereoImage* img = new StereoImage;
+  img->l = cv::Mat(layout_.rows, layout_.cols, layout_.type, l_data, step_);
+  img->r = cv::Mat(layout_.rows, layout_.cols, layout_.type, r_data, step_);
+  img->index = index;
+  std::shared_ptr<State> state = state_;
+  return StereoImagePtr(img, [state](StereoImage* img) {
+    {
+      std::lock_guard<std::mutex> lock(state->m);
+      state->free_indices.push_back(img->index);
+    }
+    delete img;
+  });
+}
+
+int ImageBufferPool::size() const {
+  std::lock_guard<std::mutex> lock(state_->m);
+  return state_->l_data.size();
+}
+
+int ImageBufferPool::num_free() const {
+  std::lock_guard<std::mutex> lock(state_->m);
+  return state_->free_indices.size();
+}
+
+}  // namespace XPDRIVER
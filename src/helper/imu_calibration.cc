@@ -0,0 +1,150 @@
+/******************************************************************************
+ * Copyright 2017-2018 Baidu Robotic Vision Authors. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *****************************************************************************/
+#include <driver/helper/imu_calibration.h>
+#include <driver/helper/xp_logging.h>
+#include <cmath>
+#include <fstream>
+#include <sstream>
+
+namespace XPDRIVER {
+
+namespace {
+// Read exactly num floats from the rest of the line
+bool read_floats(std::istringstream* ss, int num, float* values) {
+  for (int i = 0; i < num; ++i) {
+    if (!(*ss >> values[i])) {
+      return false;
+    }
+  }
+  std::string extra;
+  return !(*ss >> extra);
+}
+
+// Row k of m = axis_sign[k] * scale * row axis_src[k] of calib_matrix
+void fold_matrix(const float* calib_matrix, const int axis_src[3], const float axis_sign[3],
+                 float scale, float* m) {
+  for (int k = 0; k < 3; ++k) {
+    for (int j = 0; j < 3; ++j) {
+      m[k * 3 + j] = axis_sign[k] * scale * calib_matrix[axis_src[k] * 3 + j];
+    }
+  }
+}
+}  // namespace
+
+bool load_imu_calibration(const std::string& file_name,
+                          const std::string& device_id,
+                          ImuCalibration* calib) {
+  XP_CHECK_NOTNULL(calib);
+  std::ifstream infile(file_name);
+  if (!infile.is_open()) {
+    XP_LOG_ERROR("Cannot open imu calibration file " << file_name);
+    return false;
+  }
+  ImuCalibration new_calib;
+  bool in_section = false;
+  bool found = false;
+  std::string line;
+  int line_num = 0;
+  while (std::getline(infile, line)) {
+    ++line_num;
+    const size_t comment_pos = line.find('#');
+    if (comment_pos != std::string::npos) {
+      line.erase(comment_pos);
+    }
+    std::istringstream ss(line);
+    std::string key;
+    if (!(ss >> key)) {
+      continue;
+    }
+    if (key.front() == '[') {
+      if (key.back() != ']') {
+        XP_LOG_ERROR(file_name << ":" << line_num << " bad section " << key);
+        return false;
+      }
+      if (found && in_section) {
+        break;  // done with the section of device_id
+      }
+      in_section = (key.substr(1, key.size() - 2) == device_id);
+      found |= in_section;
+      continue;
+    }
+    if (!in_section) {
+      continue;
+    }
+    bool ok = false;
+    if (key == "ref_temp") {
+      ok = read_floats(&ss, 1, &new_calib.ref_temp);
+    } else if (key == "gyro_bias") {
+      ok = read_floats(&ss, 3, new_calib.gyro_bias);
+    } else if (key == "gyro_temp_coeff") {
+      ok = read_floats(&ss, 3, new_calib.gyro_temp_coeff);
+    } else if (key == "gyro_matrix") {
+      ok = read_floats(&ss, 9, new_calib.gyro_matrix);
+    } else if (key == "accel_bias") {
+      ok = read_floats(&ss, 3, new_calib.accel_bias);
+    } else if (key == "accel_temp_coeff") {
+      ok = read_floats(&ss, 3, new_calib.accel_temp_coeff);
+    } else if (key == "accel_matrix") {
+      ok = read_floats(&ss, 9, new_calib.accel_matrix);
+    }
+    if (!ok) {
+      XP_LOG_ERROR(file_name << ":" << line_num << " bad or unknown entry " << key);
+      return false;
+    }
+  }
+  if (!found) {
+    XP_LOG_ERROR("No imu calibration of device " << device_id << " in " << file_name);
+    return false;
+  }
+  *calib = new_calib;
+  return true;
+}
+
+ImuCorrector::ImuCorrector(const ImuCalibration& calib,
+                           const int axis_src[3],
+                           const float axis_sign[3]) : ref_temp_(calib.ref_temp) {
+  for (int k = 0; k < 3; ++k) {
+    XP_CHECK_GE(axis_src[k], 0);
+    XP_CHECK_LT(axis_src[k], 3);
+    gyro_bias_[k] = calib.gyro_bias[k];
+    gyro_temp_coeff_[k] = calib.gyro_temp_coeff[k];
+    accel_bias_[k] = calib.accel_bias[k];
+    accel_temp_coeff_[k] = calib.accel_temp_coeff[k];
+  }
+  fold_matrix(calib.gyro_matrix, axis_src, axis_sign, static_cast<float>(M_PI / 180.),
+              gyro_matrix_);
+  fold_matrix(calib.accel_matrix, axis_src, axis_sign, 1.f, accel_matrix_);
+}
+
+void ImuCorrector::apply(const XP_20608_data* imu_data, int num, ImuData* xp_imu) const {
+  for (int i = 0; i < num; ++i) {
+    // An unknown temperature means no temperature term
+    const float dt = std::isnan(imu_data[i].temp) ? 0.f : imu_data[i].temp - ref_temp_;
+    float g[3], a[3];
+    for (int k = 0; k < 3; ++k) {
+      g[k] = imu_data[i].gyro[k] - gyro_bias_[k] - gyro_temp_coeff_[k] * dt;
+      a[k] = imu_data[i].accel[k] - accel_bias_[k] - accel_temp_coeff_[k] * dt;
+    }
+    for (int k = 0; k < 3; ++k) {
+      const float* gm = gyro_matrix_ + k * 3;
+      const float* am = accel_matrix_ + k * 3;
+      xp_imu[i].ang_v[k] = gm[0] * g[0] + gm[1] * g[1] + gm[2] * g[2];
+      xp_imu[i].accel[k] = am[0] * a[0] + am[1] * a[1] + am[2] * a[2];
+    }
+  }
+}
+
+}  // namespace XPDRIVER
@@ -0,0 +1,97 @@
+/******************************************************************************
+ * Copyright 2017-2018 Baidu Robotic Vision Authors. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *****************************************************************************/
+#include <driver/helper/imu_decimator.h>
+#include <driver/helper/xp_logging.h>
+#include <cmath>
+
+namespace XPDRIVER {
+
+ImuDecimator::ImuDecimator(int factor, float cutoff_ratio) :
+    factor_(factor),
+    head_(0),
+    filled_(0),
+    phase_(0) {
+  XP_CHECK_GT(factor_, 0);
+  XP_CHECK_GT(cutoff_ratio, 0.f);
+  XP_CHECK_LE(cutoff_ratio, 1.f);
+  // 8 taps per output sample gives > 50 dB stop band attenuation with the Blackman window
+  const int num_taps = 8 * factor_ + 1;
+  const float cutoff = cutoff_ratio * 0.5f / factor_;  // in cycles per input sample
+  const int center = num_taps / 2;
+  coeffs_.resize(num_taps);
+  float sum = 0;
+  for (int i = 0; i < num_taps; ++i) {
+    const int n = i - center;
+    const float sinc = (n == 0) ? 2.f * cutoff :
+        std::sin(2.f * M_PI * cutoff * n) / (M_PI * n);
+    const float window = 0.42f - 0.5f * std::cos(2.f * M_PI * i / (num_taps - 1))
+        + 0.08f * std::cos(4.f * M_PI * i / (num_taps - 1));
+    coeffs_[i] = sinc * window;
+    sum += coeffs_[i];
+  }
+  // Unit DC gain
+  for (float& c : coeffs_) {
+    c /= sum;
+  }
+  history_.resize(num_taps);
+}
+
+void ImuDecimator::reset() {
+  head_ = 0;
+  filled_ = 0;
+  phase_ = 0;
+}
+
+bool ImuDecimator::push(const ImuData& input, ImuData* output) {
+  XP_CHECK_NOTNULL(output);
+  const int num_taps = taps();
+  history_[head_] = input;
+  head_ = (head_ + 1 == num_taps) ? 0 : head_ + 1;
+  if (filled_ < num_taps) {
+    ++filled_;
+  }
+  if (++phase_ < factor_) {
+    return false;
+  }
+  phase_ = 0;
+  if (filled_ < num_taps) {
+    // Wait for a full filter
+    return false;
+  }
+  // history_[head_] is the oldest sample now.  The filter is symmetric, so the order of the
+  // coefficients doesn't matter.
+  ImuData& out = *output;
+  for (int k = 0; k < 3; ++k) {
+    out.accel[k] = 0;
+    out.ang_v[k] = 0;
+  }
+  int slot = head_;
+  for (int i = 0; i < num_taps; ++i) {
+    const float c = coeffs_[i];
+    const ImuData& sample = history_[slot];
+    for (int k = 0; k < 3; ++k) {
+      out.accel[k] += c * sample.accel[k];
+      out.ang_v[k] += c * sample.ang_v[k];
+    }
+    slot = (slot + 1 == num_taps) ? 0 : slot + 1;
+  }
+  const ImuData& center = history_[(head_ + num_taps / 2) % num_taps];
+  out.time_stamp = center.time_stamp;
+  out.ts = center.ts;
+  return true;
+}
+
+}  // namespace XPDRIVER
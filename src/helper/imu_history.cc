@@ -0,0 +1,129 @@
+/******************************************************************************
+ * Copyright 2017-2018 Baidu Robotic Vision Authors. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *****************************************************************************/
+#include <driver/helper/imu_history.h>
+#include <driver/helper/xp_logging.h>
+#include <algorithm>
+
+namespace XPDRIVER {
+
+namespace {
+// Linear interpolation of a at w = 0 and b at w = 1, with ts.sensor_ns exactly t_ns
+ImuData interpolate(const ImuData& a, const ImuData& b, int64_t t_ns) {
+  if (t_ns == a.ts.sensor_ns) {
+    return a;
+  }
+  if (t_ns == b.ts.sensor_ns) {
+    return b;
+  }
+  const int64_t span_ns = b.ts.sensor_ns - a.ts.sensor_ns;
+  const double w = span_ns > 0 ? static_cast<double>(t_ns - a.ts.sensor_ns) / span_ns : 0.;
+  const float wf = static_cast<float>(w);
+  ImuData imu;
+  for (int k = 0; k < 3; ++k) {
+    imu.accel[k] = a.accel[k] + wf * (b.accel[k] - a.accel[k]);
+    imu.ang_v[k] = a.ang_v[k] + wf * (b.ang_v[k] - a.ang_v[k]);
+  }
+  imu.ts.sensor_ns = t_ns;
+  imu.ts.host_ns = a.ts.host_ns + static_cast<int64_t>(w * (b.ts.host_ns - a.ts.host_ns));
+  imu.ts.synced_host_ns = a.ts.synced_host_ns +
+      static_cast<int64_t>(w * (b.ts.synced_host_ns - a.ts.synced_host_ns));
+  imu.time_stamp = t_ns * 1e-5f;  // in 100us
+  return imu;
+}
+
+// Hold the sample to t_ns, e.g., beyond the newest sample
+ImuData hold(const ImuData& a, int64_t t_ns) {
+  return interpolate(a, a, t_ns);
+}
+}  // namespace
+
+ImuHistory::ImuHistory(size_t capacity) : head_(0), size_(0) {
+  XP_CHECK_GT(capacity, 0);
+  size_t n = 1;
+  while (n < capacity) {
+    n <<= 1;
+  }
+  buf_.resize(n);
+  mask_ = n - 1;
+}
+
+void ImuHistory::push(const ImuData& imu) {
+  if (size_ > 0 && imu.ts.sensor_ns <= at(size_ - 1).ts.sensor_ns) {
+    XP_LOG_WARNING("ImuHistory drops an out-of-order imu at " << imu.ts.sensor_ns << " ns");
+    return;
+  }
+  buf_[head_ & mask_] = imu;
+  ++head_;
+  if (size_ < buf_.size()) {
+    ++size_;
+  }
+}
+
+void ImuHistory::push(const ImuData* imu, int num) {
+  for (int i = 0; i < num; ++i) {
+    push(imu[i]);
+  }
+}
+
+void ImuHistory::clear() {
+  head_ = 0;
+  size_ = 0;
+}
+
+size_t ImuHistory::first_index_after(int64_t t_ns, bool inclusive) const {
+  size_t lo = 0;
+  size_t hi = size_;
+  while (lo < hi) {
+    const size_t mid = lo + (hi - lo) / 2;
+    const int64_t mid_ns = at(mid).ts.sensor_ns;
+    if (mid_ns > t_ns || (inclusive && mid_ns == t_ns)) {
+      hi = mid;
+    } else {
+      lo = mid + 1;
+    }
+  }
+  return lo;
+}
+
+bool ImuHistory::query(int64_t t0_ns, int64_t t1_ns, ImuInterval* interval) const {
+  XP_CHECK_NOTNULL(interval);
+  if (t1_ns < t0_ns || size_ == 0) {
+    return false;
+  }
+  // The first sample inside (t0, t1) and the first one at or after t1
+  const size_t i0 = first_index_after(t0_ns, false);
+  if (i0 == 0) {
+    return false;
+  }
+  const size_t i1 = std::max(i0, first_index_after(t1_ns, true));
+
+  interval->begin = i0 < size_ ? interpolate(at(i0 - 1), at(i0), t0_ns) : hold(at(i0 - 1), t0_ns);
+  interval->complete = i1 < size_;
+  interval->end = interval->complete ? interpolate(at(i1 - 1), at(i1), t1_ns) :
+      hold(at(size_ - 1), t1_ns);
+
+  const size_t first_slot = (head_ - size_ + i0) & mask_;
+  const int inner_num = static_cast<int>(i1 - i0);
+  const int first_num = std::min(inner_num, static_cast<int>(buf_.size() - first_slot));
+  interval->inner[0] = buf_.data() + first_slot;
+  interval->inner_num[0] = first_num;
+  interval->inner[1] = buf_.data();
+  interval->inner_num[1] = inner_num - first_num;
+  interval->valid = true;
+  return true;
+}
+
+}  // namespace XPDRIVER
@@ -0,0 +1,115 @@
+/******************************************************************************
+ * Copyright 2017-2018 Baidu Robotic Vision Authors. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *****************************************************************************/
+#include <driver/helper/imu_poll_scheduler.h>
+#include <driver/helper/xp_logging.h>
+#include <algorithm>
+#include <limits>
+
+namespace XPDRIVER {
+
+namespace {
+constexpr int kFirmwarePeriodWindow = 100;  // samples
+}  // namespace
+
+constexpr int ImuPollScheduler::Stats::kJitterBinUs;
+constexpr int ImuPollScheduler::Stats::kJitterBinNum;
+constexpr int ImuPollScheduler::Stats::kMissBinNum;
+
+ImuPollScheduler::ImuPollScheduler() : ImuPollScheduler(Config()) {}
+
+ImuPollScheduler::ImuPollScheduler(const Config& config) :
+    config_(config),
+    period_ns_(1000000000LL / std::max(config.rate_hz, 1)),
+    next_deadline_ns_(0),
+    has_last_sample_(false),
+    last_sample_sensor_ns_(0),
+    new_sample_streak_(0),
+    window_min_step_ns_(std::numeric_limits<int64_t>::max()),
+    last_window_min_step_ns_(std::numeric_limits<int64_t>::max()),
+    window_sample_num_(0) {
+  XP_CHECK_GT(config_.rate_hz, 0);
+  XP_CHECK_GT(config_.retry_divisor, 1);
+  XP_CHECK_GT(config_.advance_after_polls, 0);
+  XP_CHECK_GT(config_.advance_divisor, 1);
+  stats_.firmware_period_ns = period_ns_;
+}
+
+void ImuPollScheduler::start(int64_t now_ns) {
+  next_deadline_ns_ = now_ns + period_ns_;
+}
+
+void ImuPollScheduler::on_wake(int64_t wake_ns) {
+  ++stats_.poll_num;
+  const int64_t jitter_us = std::max<int64_t>(wake_ns - next_deadline_ns_, 0) / 1000;
+  ++stats_.wake_jitter_hist[std::min<int64_t>(jitter_us / Stats::kJitterBinUs,
+                                              Stats::kJitterBinNum - 1)];
+}
+
+bool ImuPollScheduler::on_sample(int64_t sample_sensor_ns, int64_t done_ns) {
+  if (has_last_sample_ && sample_sensor_ns == last_sample_sensor_ns_) {
+    // Polled before the firmware update.  Retry soon, and stay that much later from now on.
+    ++stats_.duplicate_num;
+    new_sample_streak_ = 0;
+    next_deadline_ns_ = done_ns + period_ns_ / config_.retry_divisor;
+    return false;
+  }
+  if (has_last_sample_) {
+    const int64_t step_ns = sample_sensor_ns - last_sample_sensor_ns_;
+    if (step_ns > 0) {
+      window_min_step_ns_ = std::min(window_min_step_ns_, step_ns);
+      if (++window_sample_num_ >= kFirmwarePeriodWindow) {
+        last_window_min_step_ns_ = window_min_step_ns_;
+        window_min_step_ns_ = std::numeric_limits<int64_t>::max();
+        window_sample_num_ = 0;
+      }
+      const int64_t firmware_period_ns = std::min(window_min_step_ns_, last_window_min_step_ns_);
+      stats_.firmware_period_ns = firmware_period_ns;
+      if (2 * step_ns >= 3 * firmware_period_ns) {
+        const int missed_num =
+            static_cast<int>((step_ns + firmware_period_ns / 2) / firmware_period_ns) - 1;
+        ++stats_.gap_num;
+        stats_.missed_sample_num += missed_num;
+        ++stats_.missed_sample_hist[std::min(std::max(missed_num, 1), Stats::kMissBinNum) - 1];
+      }
+    }
+  }
+  has_last_sample_ = true;
+  last_sample_sensor_ns_ = sample_sensor_ns;
+  ++stats_.sample_num;
+
+  // Probe for the firmware update edge again once in a while
+  if (++new_sample_streak_ >= config_.advance_after_polls) {
+    new_sample_streak_ = 0;
+    next_deadline_ns_ -= period_ns_ / config_.advance_divisor;
+  }
+  advance_deadline(done_ns);
+  return true;
+}
+
+void ImuPollScheduler::on_failure(int64_t done_ns) {
+  ++stats_.failure_num;
+  advance_deadline(done_ns);
+}
+
+void ImuPollScheduler::advance_deadline(int64_t done_ns) {
+  next_deadline_ns_ += period_ns_;
+  if (next_deadline_ns_ <= done_ns) {
+    ++stats_.overrun_num;
+    next_deadline_ns_ += ((done_ns - next_deadline_ns_) / period_ns_ + 1) * period_ns_;
+  }
+}
+
+}  // namespace XPDRIVER
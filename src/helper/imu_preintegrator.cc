@@ -0,0 +1,214 @@
+/******************************************************************************
+ * Copyright 2017-2018 Baidu Robotic Vision Authors. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *****************************************************************************/
+#include <driver/helper/imu_preintegrator.h>
+#include <driver/helper/xp_logging.h>
+#include <cmath>
+#include <cstring>
+
+namespace XPDRIVER {
+
+namespace {
+// Row-major 3x3 / 9x9 matrix helpers.  The outputs must not alias the inputs.
+void mat3_set_identity(float* m) {
+  memset(m, 0, 9 * sizeof(float));
+  m[0] = m[4] = m[8] = 1.f;
+}
+
+// c = a * b
+void mat3_mul(const float* a, const float* b, float* c) {
+  for (int i = 0; i < 3; ++i) {
+    for (int j = 0; j < 3; ++j) {
+      c[i * 3 + j] = a[i * 3] * b[j] + a[i * 3 + 1] * b[3 + j] + a[i * 3 + 2] * b[6 + j];
+    }
+  }
+}
+
+// c = a^T * b
+void mat3_mul_at(const float* a, const float* b, float* c) {
+  for (int i = 0; i < 3; ++i) {
+    for (int j = 0; j < 3; ++j) {
+      c[i * 3 + j] = a[i] * b[j] + a[3 + i] * b[3 + j] + a[6 + i] * b[6 + j];
+    }
+  }
+}
+
+// c = a * v
+void mat3_mul_vec(const float* a, const float* v, float* c) {
+  for (int i = 0; i < 3; ++i) {
+    c[i] = a[i * 3] * v[0] + a[i * 3 + 1] * v[1] + a[i * 3 + 2] * v[2];
+  }
+}
+
+// [v]x
+void skew(const float* v, float* m) {
+  m[0] = 0.f;   m[1] = -v[2]; m[2] = v[1];
+  m[3] = v[2];  m[4] = 0.f;   m[5] = -v[0];
+  m[6] = -v[1]; m[7] = v[0];  m[8] = 0.f;
+}
+
+// The SO3 exponential map (Rodrigues) and its right Jacobian
+//   exp = I + s [phi]x + c [phi]x^2,  jr = I - c [phi]x + d [phi]x^2
+// with s = sin(t) / t, c = (1 - cos(t)) / t^2, d = (t - sin(t)) / t^3 and t = |phi|
+void so3_exp_and_right_jacobian(const float* phi, float* exp_phi, float* jr) {
+  const float t2 = phi[0] * phi[0] + phi[1] * phi[1] + phi[2] * phi[2];
+  float s, c, d;
+  if (t2 < 1e-6f) {
+    // Taylor expansions, exact in float for such a small angle
+    s = 1.f - t2 / 6.f;
+    c = 0.5f - t2 / 24.f;
+    d = 1.f / 6.f - t2 / 120.f;
+  } else {
+    const float t = std::sqrt(t2);
+    s = std::sin(t) / t;
+    c = (1.f - std::cos(t)) / t2;
+    d = (t - std::sin(t)) / (t2 * t);
+  }
+  float k[9];
+  skew(phi, k);
+  float k2[9];
+  mat3_mul(k, k, k2);
+  for (int i = 0; i < 9; ++i) {
+    const float eye = (i % 4 == 0) ? 1.f : 0.f;
+    exp_phi[i] = eye + s * k[i] + c * k2[i];
+    jr[i] = eye - c * k[i] + d * k2[i];
+  }
+}
+}  // namespace
+
+ImuPreintegrator::ImuPreintegrator() : ImuPreintegrator(Config()) {}
+
+ImuPreintegrator::ImuPreintegrator(const Config& config) : config_(config) {
+  XP_CHECK_GE(config_.gyro_noise_density, 0);
+  XP_CHECK_GE(config_.accel_noise_density, 0);
+}
+
+void ImuPreintegrator::integrate(const ImuInterval& interval, ImuPreintegration* result) const {
+  XP_CHECK_NOTNULL(result);
+  *result = ImuPreintegration();
+  if (!interval.valid) {
+    return;
+  }
+  result->valid = true;
+  result->complete = interval.complete;
+  result->t0_ns = interval.begin.ts.sensor_ns;
+  result->t1_ns = interval.end.ts.sensor_ns;
+  mat3_set_identity(result->delta_rot);
+
+  const ImuData* prev = &interval.begin;
+  for (int i = 0; i < interval.inner_size(); ++i) {
+    integrate_segment(*prev, interval.inner_at(i), result);
+    prev = &interval.inner_at(i);
+  }
+  integrate_segment(*prev, interval.end, result);
+}
+
+void ImuPreintegrator::integrate_segment(const ImuData& imu0, const ImuData& imu1,
+                                         ImuPreintegration* result) const {
+  const float dt = (imu1.ts.sensor_ns - imu0.ts.sensor_ns) * 1e-9f;
+  if (dt <= 0.f) {
+    return;
+  }
+  const float dt2 = dt * dt;
+  float w[3], a[3];
+  for (int k = 0; k < 3; ++k) {
+    w[k] = 0.5f * (imu0.ang_v[k] + imu1.ang_v[k]) - config_.gyro_bias[k];
+    a[k] = 0.5f * (imu0.accel[k] + imu1.accel[k]) - config_.accel_bias[k];
+  }
+  const float phi[3] = {w[0] * dt, w[1] * dt, w[2] * dt};
+  float exp_phi[9], jr[9];
+  so3_exp_and_right_jacobian(phi, exp_phi, jr);
+
+  float* rot = result->delta_rot;
+  float a_skew[9], rot_a_skew[9], rot_a[3];
+  skew(a, a_skew);
+  mat3_mul(rot, a_skew, rot_a_skew);  // R [a]x
+  mat3_mul_vec(rot, a, rot_a);
+
+  // The bias Jacobians, all from the values before this segment
+  float tmp[9];
+  mat3_mul(rot_a_skew, result->jac_rot_bg, tmp);  // R [a]x dR/dbg
+  for (int i = 0; i < 9; ++i) {
+    result->jac_pos_ba[i] += result->jac_vel_ba[i] * dt - 0.5f * rot[i] * dt2;
+    result->jac_pos_bg[i] += result->jac_vel_bg[i] * dt - 0.5f * tmp[i] * dt2;
+    result->jac_vel_ba[i] -= rot[i] * dt;
+    result->jac_vel_bg[i] -= tmp[i] * dt;
+  }
+  mat3_mul_at(exp_phi, result->jac_rot_bg, tmp);
+  for (int i = 0; i < 9; ++i) {
+    result->jac_rot_bg[i] = tmp[i] - jr[i] * dt;
+  }
+
+  // The covariance P = A P A^T + B Qg B^T + C Qa C^T of the errors [rot, vel, pos] with
+  //   A = | exp^T           0     0 |   B = | jr dt |   C = | 0           |
+  //       | -R [a]x dt      I     0 |       | 0     |       | R dt        |
+  //       | -R [a]x dt^2/2  I dt  I |       | 0     |       | R dt^2 / 2  |
+  // and Q = noise_density^2 / dt I for the discrete white noise
+  float mat_a[81] = {0.f};
+  for (int i = 0; i < 3; ++i) {
+    for (int j = 0; j < 3; ++j) {
+      mat_a[i * 9 + j] = exp_phi[j * 3 + i];
+      mat_a[(3 + i) * 9 + j] = -rot_a_skew[i * 3 + j] * dt;
+      mat_a[(6 + i) * 9 + j] = -0.5f * rot_a_skew[i * 3 + j] * dt2;
+    }
+    mat_a[(3 + i) * 9 + 3 + i] = 1.f;
+    mat_a[(6 + i) * 9 + 3 + i] = dt;
+    mat_a[(6 + i) * 9 + 6 + i] = 1.f;
+  }
+  float* cov = result->cov;
+  float a_cov[81];
+  for (int i = 0; i < 9; ++i) {
+    for (int j = 0; j < 9; ++j) {
+      float sum = 0.f;
+      for (int k = 0; k < 9; ++k) {
+        sum += mat_a[i * 9 + k] * cov[k * 9 + j];
+      }
+      a_cov[i * 9 + j] = sum;
+    }
+  }
+  for (int i = 0; i < 9; ++i) {
+    for (int j = 0; j < 9; ++j) {
+      float sum = 0.f;
+      for (int k = 0; k < 9; ++k) {
+        sum += a_cov[i * 9 + k] * mat_a[j * 9 + k];
+      }
+      cov[i * 9 + j] = sum;
+    }
+  }
+  // B Qg B^T = jr jr^T gyro_nd^2 dt,  C Qa C^T = [R; R dt / 2] [R; R dt / 2]^T accel_nd^2 dt
+  // with R R^T = I
+  const float qg = config_.gyro_noise_density * config_.gyro_noise_density * dt;
+  const float qa = config_.accel_noise_density * config_.accel_noise_density * dt;
+  for (int i = 0; i < 3; ++i) {
+    for (int j = 0; j < 3; ++j) {
+      cov[i * 9 + j] += qg * (jr[i * 3] * jr[j * 3] + jr[i * 3 + 1] * jr[j * 3 + 1] +
+                              jr[i * 3 + 2] * jr[j * 3 + 2]);
+    }
+    cov[(3 + i) * 9 + 3 + i] += qa;
+    cov[(3 + i) * 9 + 6 + i] += qa * 0.5f * dt;
+    cov[(6 + i) * 9 + 3 + i] += qa * 0.5f * dt;
+    cov[(6 + i) * 9 + 6 + i] += qa * 0.25f * dt2;
+  }
+
+  // The states, position first as it uses the old velocity and rotation
+  for (int k = 0; k < 3; ++k) {
+    result->delta_pos[k] += result->delta_vel[k] * dt + 0.5f * rot_a[k] * dt2;
+    result->delta_vel[k] += rot_a[k] * dt;
+  }
+  mat3_mul(rot, exp_phi, tmp);
+  memcpy(rot, tmp, sizeof(tmp));
+}
+
+}  // namespace XPDRIVER
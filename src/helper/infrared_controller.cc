@@ -0,0 +1,91 @@
+/******************************************************************************
+ * Copyright 2017-2018 Baidu Robotic Vision Authors. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *****************************************************************************/
+#include <driver/helper/infrared_controller.h>
+#include <driver/helper/xp_logging.h>
+#include <algorithm>
+#include <cmath>
+
+namespace XPDRIVER {
+
+InfraredController::InfraredController() : InfraredController(Config()) {}
+
+InfraredController::InfraredController(const Config& config) :
+    config_(config),
+    pwm_(0),
+    frames_since_update_(0) {
+  XP_CHECK_GT(config_.min_pwm, 0);
+  XP_CHECK_GE(config_.max_pwm, config_.min_pwm);
+  XP_CHECK_GT(config_.target_brightness, 0);
+}
+
+void InfraredController::reset(int pwm) {
+  pwm_ = pwm;
+  frames_since_update_ = 0;
+}
+
+bool InfraredController::update(const BrightnessStats& ir_stats,
+                                float frame_gain_x_exp,
+                                float aec_gain_x_exp,
+                                int* pwm_ptr) {
+  XP_CHECK_NOTNULL(pwm_ptr);
+  // Wait for the last change to show up in the images, and rate limit the control transfers
+  if (frames_since_update_ < config_.min_interval_frames) {
+    ++frames_since_update_;
+    return false;
+  }
+  if (ir_stats.pixel_num == 0 || frame_gain_x_exp <= 0 || aec_gain_x_exp <= 0) {
+    return false;
+  }
+
+  // [NOTE] Close-range objects saturate first.  Cut the PWM harder if many pixels are
+  // saturated, as the saturated pixels under-report the brightness.
+  constexpr int kSaturatedPixelVal = 253;
+  constexpr float kHeavySaturationRatio = 0.5f;
+  constexpr float kSaturationCut = 0.25f;
+  constexpr float kMaxRatio = 16.f;
+  int saturated_num = 0;
+  for (int i = kSaturatedPixelVal; i < 256; ++i) {
+    saturated_num += ir_stats.histogram[i];
+  }
+  const float saturated_ratio = static_cast<float>(saturated_num) / ir_stats.pixel_num;
+  const float brightness = std::max(ir_stats.adjusted_pixel_val, 1);
+  float ratio = config_.target_brightness / brightness;
+  if (saturated_ratio > kHeavySaturationRatio) {
+    ratio = std::min(ratio, kSaturationCut);
+  }
+  ratio = std::min(std::max(ratio, 1.f / kMaxRatio), kMaxRatio);
+  // Compensate the AEC change that is not in this frame yet
+  ratio *= frame_gain_x_exp / aec_gain_x_exp;
+
+  const float predicted_pwm = std::max(pwm_, 1) * ratio;
+  if (std::fabs(predicted_pwm / std::max(pwm_, 1) - 1.f) < config_.deadband_ratio) {
+    return false;
+  }
+  const int new_pwm = std::min(std::max(static_cast<int>(predicted_pwm + 0.5f), config_.min_pwm),
+                               config_.max_pwm);
+  if (new_pwm == pwm_) {
+    // Already at the end of the PWM range
+    return false;
+  }
+  XP_VLOG(1, "InfraredController brightness " << brightness << " sat_ratio " << saturated_ratio
+          << " pwm " << pwm_ << " -> " << new_pwm);
+  pwm_ = new_pwm;
+  frames_since_update_ = 0;
+  *pwm_ptr = new_pwm;
+  return true;
+}
+
+}  // namespace XPDRIVER
@@ -0,0 +1,211 @@
+/******************************************************************************
+ * Copyright 2017-2018 Baidu Robotic Vision Authors. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *****************************************************************************/
+#include <driver/xp_aec_table.h>
+
+namespace XPDRIVER {
+namespace XP_SENSOR {
+
+// The AEC tables are generated by constexpr functions at compile time.
+// Each curve is described by
+//   static constexpr AecEntry first();            // the darkest entry
+//   static constexpr AecEntry next(AecEntry e);   // the entry after e
+//   static constexpr bool is_last(AecEntry e);    // true if e is the brightest entry
+// [NOTE] The entry i is generated by i nested calls of next(), so a table must stay below the
+// constexpr recursion limit of the compiler (512 for gcc and clang).
+namespace {
+
+constexpr int kMaxGain = 64;   // 4x analog gain for V024
+constexpr int kMinGain = 16;   // 1x analog gain
+constexpr int kMaxExp = 1010;  // the same max exposure as the DEFAULT curve
+
+constexpr AecEntry make_entry(int gain, int exp) {
+  return AecEntry{static_cast<int16_t>(gain), static_cast<int16_t>(exp)};
+}
+
+constexpr int max_int(int a, int b) { return a > b ? a : b; }
+constexpr int min_int(int a, int b) { return a < b ? a : b; }
+
+// The smallest integer after val that is at least (1 + step_permille / 1000) x val
+constexpr int ratio_step_up(int val, int step_permille) {
+  return max_int(val + 1, (val * (1000 + step_permille) + 999) / 1000);
+}
+
+constexpr int floor_pow2(int val, int pow2 = 1) {
+  return pow2 * 2 > val ? pow2 : floor_pow2(val, pow2 * 2);
+}
+
+// The mono AEC table of utils/exposure_table.py (step 4), reproduced bit-exact.
+// In exposure segment k, [1, 16, 32, 64, 96, 128, 192, 256, 384, 512, 1024)[k, k + 1),
+// the exposure steps up by more than 3%.  The gain steps up by 1/16 at the end of each segment,
+// i.e., gain - 16 is the segment index.  After the last segment, the gain steps up by at least
+// 3% until 4x.
+struct DefaultCurve {
+  static constexpr int kSegmentNum = 10;
+  static constexpr int segment_begin(int k) {
+    return k == 0 ? 1 : k == 1 ? 16 : k == 2 ? 32 : k == 3 ? 64 : k == 4 ? 96 : k == 5 ? 128 :
+        k == 6 ? 192 : k == 7 ? 256 : k == 8 ? 384 : k == 9 ? 512 : 1024;
+  }
+  // The smallest exposure that is MORE than 3% larger than exp
+  static constexpr int exp_step_up(int exp) { return exp * 103 / 100 + 1; }
+  static constexpr AecEntry next_in_segment(AecEntry e, int k, int exp) {
+    return exp < segment_begin(k + 1) ? make_entry(e.gain, exp) : make_entry(e.gain + 1, e.exp);
+  }
+  static constexpr AecEntry first() { return make_entry(kMinGain, 1); }
+  static constexpr AecEntry next(AecEntry e) {
+    return e.gain - kMinGain < kSegmentNum ?
+        next_in_segment(e, e.gain - kMinGain,
+                        max_int(segment_begin(e.gain - kMinGain), exp_step_up(e.exp))) :
+        make_entry(min_int(kMaxGain, ratio_step_up(e.gain, 30)), e.exp);
+  }
+  static constexpr bool is_last(AecEntry e) { return e.gain == kMaxGain; }
+};
+
+// Step up exposure then gain by at least StepPermille / 1000 each.
+// If FillLowEnd, fill the exposure steps that are coarser than that with gain steps.
+template <int MinGain, int MaxGain, int MaxExp, int StepPermille, bool FillLowEnd>
+struct RatioCurve {
+  static constexpr bool is_coarse(int exp) {
+    return (exp + 1) * 1000 > exp * (1000 + StepPermille);
+  }
+  static constexpr AecEntry fill_low_end(AecEntry e, int gain) {
+    return gain <= MaxGain && gain * e.exp < MinGain * (e.exp + 1) ?
+        make_entry(gain, e.exp) : make_entry(MinGain, e.exp + 1);
+  }
+  static constexpr AecEntry first() { return make_entry(MinGain, 1); }
+  static constexpr AecEntry next(AecEntry e) {
+    return e.exp >= MaxExp ?
+        make_entry(min_int(MaxGain, ratio_step_up(e.gain, StepPermille)), MaxExp) :
+        (FillLowEnd && is_coarse(e.exp)) ?
+        fill_low_end(e, ratio_step_up(e.gain, StepPermille)) :
+        make_entry(e.gain, min_int(MaxExp, ratio_step_up(e.exp, StepPermille)));
+  }
+  static constexpr bool is_last(AecEntry e) { return e.exp >= MaxExp && e.gain >= MaxGain; }
+};
+
+// Step up exposure by the same number of rows within an octave of exposure, e.g., by 4 rows
+// in [64, 128) for 16 steps per octave (at least 1 row), then gain by 1/16
+template <int MinGain, int MaxGain, int MaxExp, int StepsPerOctave>
+struct DeltaCurve {
+  static constexpr AecEntry first() { return make_entry(MinGain, 1); }
+  static constexpr AecEntry next(AecEntry e) {
+    return e.exp >= MaxExp ? make_entry(e.gain + 1, MaxExp) :
+        make_entry(e.gain,
+                   min_int(MaxExp, e.exp + max_int(1, floor_pow2(e.exp) / StepsPerOctave)));
+  }
+  static constexpr bool is_last(AecEntry e) { return e.exp >= MaxExp && e.gain >= MaxGain; }
+};
+
+// C++11 has no std::make_integer_sequence
+template <int... Is> struct IndexSequence {};
+template <int N, int... Is>
+struct MakeIndexSequence : MakeIndexSequence<N - 1, N - 1, Is...> {};
+template <int... Is>
+struct MakeIndexSequence<0, Is...> {
+  typedef IndexSequence<Is...> type;
+};
+
+template <typename Curve>
+constexpr AecEntry aec_entry(int i) {
+  return i == 0 ? Curve::first() : Curve::next(aec_entry<Curve>(i - 1));
+}
+
+// The number of entries from e (included) to the last one
+template <typename Curve>
+constexpr int aec_steps(AecEntry e) {
+  return Curve::is_last(e) ? 1 : 1 + aec_steps<Curve>(Curve::next(e));
+}
+
+template <int N>
+struct AecLut {
+  AecEntry entries[N];
+};
+
+template <typename Curve, int... Is>
+constexpr AecLut<sizeof...(Is)> make_aec_lut(IndexSequence<Is...>) {
+  return AecLut<sizeof...(Is)>{{aec_entry<Curve>(Is)...}};
+}
+
+constexpr int64_t gain_x_exp(const AecEntry& e) {
+  return static_cast<int64_t>(e.gain) * e.exp;
+}
+
+// Check the entries [begin, end) of lut by divide and conquer to keep the recursion shallow
+template <int N>
+constexpr bool is_strictly_increasing(const AecLut<N>& lut, int begin, int end) {
+  return end - begin < 2 ? true :
+      end - begin == 2 ? gain_x_exp(lut.entries[begin]) < gain_x_exp(lut.entries[begin + 1]) :
+      is_strictly_increasing(lut, begin, (begin + end) / 2 + 1) &&
+      is_strictly_increasing(lut, (begin + end) / 2, end);
+}
+
+template <int N>
+constexpr bool is_monotonic(const AecLut<N>& lut, int begin, int end) {
+  return end - begin < 2 ? true :
+      end - begin == 2 ? (lut.entries[begin].gain <= lut.entries[begin + 1].gain &&
+                          lut.entries[begin].exp <= lut.entries[begin + 1].exp) :
+      is_monotonic(lut, begin, (begin + end) / 2 + 1) &&
+      is_monotonic(lut, (begin + end) / 2, end);
+}
+
+template <typename Curve>
+struct GeneratedAecLut {
+  static constexpr int kSteps = aec_steps<Curve>(Curve::first());
+  static constexpr AecLut<kSteps> kLut =
+      make_aec_lut<Curve>(typename MakeIndexSequence<kSteps>::type());
+};
+template <typename Curve>
+constexpr int GeneratedAecLut<Curve>::kSteps;
+template <typename Curve>
+constexpr AecLut<GeneratedAecLut<Curve>::kSteps> GeneratedAecLut<Curve>::kLut;
+
+typedef GeneratedAecLut<DefaultCurve> DefaultLut;
+typedef GeneratedAecLut<RatioCurve<kMinGain, kMaxGain, kMaxExp, 30, false>> ConstantRatioLut;
+typedef GeneratedAecLut<DeltaCurve<kMinGain, kMaxGain, kMaxExp, 16>> ConstantDeltaLut;
+typedef GeneratedAecLut<RatioCurve<kMinGain, kMaxGain, kMaxExp, 30, true>> FineLowEndLut;
+typedef GeneratedAecLut<RatioCurve<kMinGain, kMinGain * 2, kMaxExp, 30, true>> LowGainLut;
+
+static_assert(DefaultLut::kSteps == 168, "DEFAULT AEC table changed");
+static_assert(DefaultLut::kLut.entries[0].gain == 16 && DefaultLut::kLut.entries[0].exp == 1 &&
+              DefaultLut::kLut.entries[167].gain == 64 &&
+              DefaultLut::kLut.entries[167].exp == 1010, "DEFAULT AEC table changed");
+static_assert(is_strictly_increasing(DefaultLut::kLut, 0, DefaultLut::kSteps) &&
+              is_strictly_increasing(ConstantRatioLut::kLut, 0, ConstantRatioLut::kSteps) &&
+              is_strictly_increasing(ConstantDeltaLut::kLut, 0, ConstantDeltaLut::kSteps) &&
+              is_strictly_increasing(FineLowEndLut::kLut, 0, FineLowEndLut::kSteps) &&
+              is_strictly_increasing(LowGainLut::kLut, 0, LowGainLut::kSteps),
+              "gain x exposure has to strictly increase with the AEC table index");
+static_assert(is_monotonic(DefaultLut::kLut, 0, DefaultLut::kSteps) &&
+              is_monotonic(ConstantRatioLut::kLut, 0, ConstantRatioLut::kSteps) &&
+              is_monotonic(ConstantDeltaLut::kLut, 0, ConstantDeltaLut::kSteps),
+              "gain and exposure have to step in the same direction");
+
+// Indexed by AecCurve
+constexpr AecTable kAecTables[kAecCurveNum] = {
+  {AecCurve::DEFAULT, DefaultLut::kSteps, DefaultLut::kLut.entries},
+  {AecCurve::CONSTANT_RATIO, ConstantRatioLut::kSteps, ConstantRatioLut::kLut.entries},
+  {AecCurve::CONSTANT_DELTA, ConstantDeltaLut::kSteps, ConstantDeltaLut::kLut.entries},
+  {AecCurve::FINE_LOW_END, FineLowEndLut::kSteps, FineLowEndLut::kLut.entries},
+  {AecCurve::LOW_GAIN, LowGainLut::kSteps, LowGainLut::kLut.entries},
+};
+
+}  // namespace
+
+const AecTable& get_aec_table(AecCurve curve) {
+  return kAecTables[static_cast<int>(curve)];
+}
+
+}  // namespace XP_SENSOR
+}  // namespace XPDRIVER